@@ -0,0 +1,532 @@
+/*
+ * bench.cpp
+ *
+ * Native benchmark for the RS485 side of EVSE-WiFi. Runs the requests the
+ * firmware issues for queryEVSE(), activateEVSE() and updateMMeterData()
+ * against simulated slaves and reports
+ *  - per-operation latency in virtual (bus) time, which moves with frame
+ *    sizes, gaps, timeouts and queueing, and
+ *  - loop jitter in host time, which moves with the CPU cost of loop(), and
+ *  - the latency of a loop pass against a blocking master as baseline, and
+ *  - recovery from a frame with a foreign slave address, and
+ *  - the error of the S0 power reading through a load profile, and
+ *  - the drift of float kWh bookkeeping against integer Wh, and
+ *  - the latencies of the storage backend in host time. On a board the
+ *    same numbers come from GET /benchStorage of each build.
+ *
+ * Build and run: pio run -e native && .pio/build/native/program
+ * The exit code is the number of failed checks.
+ */
+
+#include <Arduino.h>
+#include <chrono>
+#include <vector>
+#include "modbus.h"
+#include "regcache.h"
+#include "sdm.h"
+#include "s0meter.h"
+#include "storage.h"
+#include "simslave.h"
+
+#define EVSE_ID 1
+#define METER_ID 2
+#define EVSE_BLOCK_STATUS 0
+#define EVSE_BLOCK_CONFIG 1
+#define LOOP_TICK 250       // us of virtual time per loop() pass
+#define ITERATIONS 200
+#define BLOCKING_TICK 100   // us of virtual time per spin of a blocking wait
+
+struct s_samples {
+    const char* name;
+    std::vector<double> values;
+    unsigned errors;
+};
+
+static EvseWiFiModbus evseBus;
+static EvseWiFiModbus meterBus;
+static EvseWiFiModbus* meterBusUsed = &meterBus;
+static EvseWiFiRegisterCache evseRegisters;
+static EvseWiFiSdmMeter sdmMeter;
+
+// Background refreshes complete at any time - every operation has its own flag
+static bool doneStatus = false;
+static bool doneWrite = false;
+static bool doneMeter = false;
+static uint8_t lastResult = 0;
+static uint64_t microsStart = 0;
+static std::vector<double> loopNanos;
+static unsigned failures = 0;
+
+static void check(const char* what, bool ok) {
+  printf("%-34s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok) {
+    failures++;
+  }
+}
+
+static void onEvseBlock(uint8_t result, uint8_t slave, uint16_t address, const uint16_t* values) {
+  if (address == 1000) {
+    doneStatus = true;
+    lastResult = result;
+  }
+}
+
+static void onWrite(uint8_t result, const s_modbusRequest* request, const uint16_t* response) {
+  doneWrite = true;
+  lastResult = result;
+}
+
+static void onMeter(uint8_t result) {
+  doneMeter = true;
+  lastResult = result;
+}
+
+// One pass of the firmware loop as far as the bus is concerned
+static void benchLoop() {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  evseBus.loop();
+  if (meterBusUsed != &evseBus) {
+    meterBusUsed->loop();
+  }
+  evseRegisters.loop();
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  loopNanos.push_back(std::chrono::duration<double, std::nano>(end - start).count());
+  hostAdvanceMicros(LOOP_TICK);
+}
+
+static void runUntilDone(s_samples& samples, bool& done) {
+  unsigned long millisStart = millis();
+  while (!done && millis() - millisStart < 5000) {
+    benchLoop();
+  }
+  if (!done || lastResult != MODBUS_SUCCESS) {
+    samples.errors++;
+    return;
+  }
+  samples.values.push_back((hostMicros() - microsStart) / 1000.0);
+}
+
+static void start(bool& done) {
+  done = false;
+  microsStart = hostMicros();
+}
+
+static void report(s_samples& samples, const char* unit) {
+  std::vector<double>& v = samples.values;
+  if (v.empty()) {
+    printf("%-34s no samples\n", samples.name);
+    return;
+  }
+  std::sort(v.begin(), v.end());
+  double sum = 0.0;
+  for (size_t i = 0; i < v.size(); i++) {
+    sum += v[i];
+  }
+  printf("%-34s n=%-6u min=%9.3f avg=%9.3f p99=%9.3f max=%9.3f %s", samples.name, (unsigned)v.size(),
+      v.front(), sum / v.size(), v[(v.size() * 99) / 100], v.back(), unit);
+  if (samples.errors > 0) {
+    printf("  errors=%u", samples.errors);
+  }
+  printf("\n");
+}
+
+static void setup(SimLine& evseLine, SimLine& meterLine, bool sharedLine, const char* meterType) {
+  evseBus.begin(&evseLine);
+  if (sharedLine) {
+    meterBusUsed = &evseBus;
+  }
+  else {
+    meterBus.begin(&meterLine);
+    meterBusUsed = &meterBus;
+  }
+  evseRegisters = EvseWiFiRegisterCache();
+  evseRegisters.begin(&evseBus, EVSE_ID);
+  evseRegisters.addBlock(1000, 8, 7, 3000, onEvseBlock);
+  evseRegisters.addBlock(2000, 18, 10, 60000, onEvseBlock);
+  sdmMeter.begin(meterBusUsed, METER_ID, meterType);
+}
+
+// Single operations on an otherwise idle bus (ESP8266 layout: separate lines)
+static void benchOperations(const char* meterType, uint8_t phases) {
+  SimLine evseLine(MODBUS_BAUD);
+  SimLine meterLine(MODBUS_BAUD);
+  SimEvse evse(EVSE_ID);
+  SimSdm meter(METER_ID, phases);
+  evseLine.attach(&evse);
+  meterLine.attach(&meter);
+  setup(evseLine, meterLine, false, meterType);
+  evse.plugIn(true);
+  meter.setPower(phases * 3680.0);
+
+  s_samples query = {"queryEVSE", std::vector<double>(), 0};
+  s_samples activate = {"activateEVSE", std::vector<double>(), 0};
+  char meterName[40];
+  snprintf(meterName, sizeof(meterName), "updateMMeterData (%s)", meterType);
+  s_samples poll = {meterName, std::vector<double>(), 0};
+
+  for (int i = 0; i < ITERATIONS; i++) {
+    start(doneStatus);
+    evseRegisters.refresh(EVSE_BLOCK_STATUS);
+    runUntilDone(query, doneStatus);
+
+    start(doneWrite);
+    evseBus.writeRegister(EVSE_ID, 2005, (i & 1) ? 16384 + 32 : 8192 + 32, onWrite);
+    runUntilDone(activate, doneWrite);
+
+    start(doneMeter);
+    sdmMeter.poll(onMeter);
+    runUntilDone(poll, doneMeter);
+  }
+  report(query, "ms");
+  report(activate, "ms");
+  report(poll, "ms");
+  printf("%-34s %u transactions per poll\n", "", sdmMeter.getBlockCount());
+}
+
+// Old EVSE firmware rejects the long blocks once, the cache falls back
+static void benchFallback() {
+  SimLine evseLine(MODBUS_BAUD);
+  SimLine meterLine(MODBUS_BAUD);
+  SimEvse evse(EVSE_ID, true);
+  evseLine.attach(&evse);
+  setup(evseLine, meterLine, false, "SDM120");
+
+  s_samples first = {"queryEVSE (old firmware, first)", std::vector<double>(), 0};
+  s_samples later = {"queryEVSE (old firmware)", std::vector<double>(), 0};
+  for (int i = 0; i < ITERATIONS; i++) {
+    start(doneStatus);
+    evseRegisters.refresh(EVSE_BLOCK_STATUS);
+    runUntilDone(i == 0 ? first : later, doneStatus);
+  }
+  report(first, "ms");
+  report(later, "ms");
+}
+
+// EVSE does not answer at all - failed refreshes are backed off
+static void benchOffline() {
+  SimLine evseLine(MODBUS_BAUD);
+  SimLine meterLine(MODBUS_BAUD);
+  setup(evseLine, meterLine, false, "SDM120");
+  unsigned long millisEnd = millis() + 5 * 60 * 1000UL;
+  while (millis() < millisEnd) {
+    benchLoop();
+  }
+  printf("%-34s %u requests in 5 minutes\n", "EVSE offline", evseLine.frames);
+}
+
+// ESP32 layout: EVSE and meter share one line, background polling runs
+// while user commands come in
+static void benchSharedLine() {
+  SimLine line(MODBUS_BAUD);
+  SimEvse evse(EVSE_ID);
+  SimSdm meter(METER_ID, 3);
+  line.attach(&evse);
+  line.attach(&meter);
+  setup(line, line, true, "SDM630");
+  evse.plugIn(true);
+  meter.setPower(11000.0);
+
+  s_samples command = {"command latency (shared line)", std::vector<double>(), 0};
+  unsigned long millisMeter = 0;
+  unsigned long millisCommand = millis() + 1000;
+  unsigned long millisEnd = millis() + 10 * 60 * 1000UL;
+  bool commandPending = false;
+  uint16_t current = 6;
+  loopNanos.clear();
+
+  while (millis() < millisEnd) {
+    if (millis() >= millisMeter) {
+      sdmMeter.poll(NULL);
+      millisMeter = millis() + 5000;
+    }
+    if (!commandPending && millis() >= millisCommand) {
+      start(doneWrite);
+      evseBus.writeRegister(EVSE_ID, 1000, current, onWrite);
+      current = current < 16 ? current + 1 : 6;
+      commandPending = true;
+    }
+    if (commandPending && doneWrite) {
+      if (lastResult == MODBUS_SUCCESS) {
+        command.values.push_back((hostMicros() - microsStart) / 1000.0);
+      }
+      else {
+        command.errors++;
+      }
+      commandPending = false;
+      millisCommand = millis() + 7300;
+    }
+    benchLoop();
+  }
+  report(command, "ms");
+  printf("%-34s evse=%.1f%% meter=%.1f%% frames=%u\n", "bus load (last minute)",
+      evseBus.getLoad(EVSE_ID), evseBus.getLoad(METER_ID), line.frames);
+}
+
+static double hostNow() {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Latency of one loop() pass: host CPU time plus the bus time the pass
+// waits for. The blocking baseline is the former ModbusMaster way, a due
+// request is sent and waited for within the pass (without the former
+// delay() calls around it). Same schedule for both: EVSE status every 3 s,
+// meter every 5 s, on the shared line.
+static void benchLoopLatency(bool blocking, s_samples& samples) {
+  SimLine line(MODBUS_BAUD);
+  SimEvse evse(EVSE_ID);
+  SimSdm meter(METER_ID, 3);
+  line.attach(&evse);
+  line.attach(&meter);
+  setup(line, line, true, "SDM630");
+  evse.plugIn(true);
+  meter.setPower(11000.0);
+  unsigned long millisStatus = millis();
+  unsigned long millisMeter = millis();
+  unsigned long millisEnd = millis() + 2 * 60 * 1000UL;
+  while (millis() < millisEnd) {
+    double hostStart = hostNow();
+    uint64_t microsVirtual = hostMicros();
+    if (blocking) {
+      if (millis() >= millisStatus) {
+        start(doneWrite);
+        evseBus.readHoldingRegisters(EVSE_ID, 1000, 8, onWrite);
+        while (!doneWrite) {
+          evseBus.loop();
+          hostAdvanceMicros(BLOCKING_TICK);
+        }
+        millisStatus = millis() + 3000;
+      }
+      if (millis() >= millisMeter) {
+        start(doneMeter);
+        sdmMeter.poll(onMeter);
+        while (!doneMeter) {
+          evseBus.loop();
+          hostAdvanceMicros(BLOCKING_TICK);
+        }
+        millisMeter = millis() + 5000;
+      }
+    }
+    else {
+      if (millis() >= millisMeter) {
+        sdmMeter.poll(NULL);
+        millisMeter = millis() + 5000;
+      }
+      evseBus.loop();
+      evseRegisters.loop();
+    }
+    samples.values.push_back(hostNow() - hostStart + (hostMicros() - microsVirtual));
+    hostAdvanceMicros(LOOP_TICK);
+  }
+}
+
+// Every tenth answer carries a foreign slave address; only those may fail,
+// the rest of such a frame must not spoil the next transaction
+static void benchBadFrames() {
+  SimLine evseLine(MODBUS_BAUD);
+  SimEvse evse(EVSE_ID);
+  evseLine.attach(&evse);
+  evseBus.begin(&evseLine);
+  unsigned rejected = 0;
+  unsigned spoiled = 0;
+  for (int i = 0; i < ITERATIONS; i++) {
+    bool bad = i % 10 == 0;
+    if (bad) {
+      evse.wrongAddress = 1;
+    }
+    start(doneWrite);
+    evseBus.readHoldingRegisters(EVSE_ID, 2000, 18, onWrite);
+    unsigned long millisStart = millis();
+    while (!doneWrite && millis() - millisStart < 5000) {
+      evseBus.loop();
+      hostAdvanceMicros(LOOP_TICK);
+    }
+    if (bad) {
+      rejected += lastResult == MODBUS_INVALID_SLAVE_ID;
+    }
+    else {
+      spoiled += lastResult != MODBUS_SUCCESS;
+    }
+  }
+  printf("%-34s %u of %u rejected, %u good answers lost\n", "foreign slave address", rejected, ITERATIONS / 10, spoiled);
+  check("bad frame stays contained", rejected == ITERATIONS / 10 && spoiled == 0);
+}
+
+// S0 meter with 1000 imp/kWh (one pulse per Wh) read once a second, every
+// fifth pulse bounces. "single interval" is the former updateS0MeterData():
+// power from the last pulse interval, 0 after 10 s without a pulse.
+static void benchS0() {
+  struct s_step {
+    const char* name;
+    unsigned seconds;
+    float watts;
+  };
+  const s_step profile[] = {
+    {"S0 11 kW", 60, 11000.0},
+    {"S0 1.4 kW", 60, 1400.0},
+    {"S0 300 W", 120, 300.0},
+    {"S0 off", 60, 0.0},
+    {"S0 3.7 kW", 60, 3700.0}
+  };
+  EvseWiFiS0Meter s0;
+  s0.begin(1000, 1, 30);
+  double wattHours = 0.0;
+  unsigned long millisLastPulse = 0;
+  float singleKW = 0.0;
+  unsigned pulses = 0;
+
+  for (size_t p = 0; p < sizeof(profile) / sizeof(profile[0]); p++) {
+    double singleError = 0.0;
+    double windowError = 0.0;
+    unsigned readings = 0;
+    for (unsigned ms = 0; ms < profile[p].seconds * 1000; ms++) {
+      wattHours += profile[p].watts / 3600000.0;
+      if (wattHours >= 1.0) {
+        wattHours -= 1.0;
+        s0.pulse();
+        if (++pulses % 5 == 0) {
+          s0.pulse();     // bounce, arrives within the same millisecond
+        }
+        if (millisLastPulse != 0) {
+          singleKW = 3600.0 / float(millis() - millisLastPulse);
+        }
+        millisLastPulse = millis();
+      }
+      if (millisLastPulse != 0 && millis() - millisLastPulse > 10000) {
+        singleKW = 0.0;
+      }
+      if (s0.loop() && ms >= 10000) {   // leave the first 10 s of a step out
+        float actual = profile[p].watts / 1000.0;
+        singleError += fabs(singleKW - actual);
+        windowError += fabs(s0.getPower() - actual);
+        readings++;
+      }
+      hostAdvanceMicros(1000);
+    }
+    printf("%-34s mean abs error: single interval=%6.3f kW  window=%6.3f kW\n", profile[p].name,
+        singleError / readings, windowError / readings);
+    if (profile[p].watts == 0.0) {   // 0 within two of the former pulse intervals
+      check("S0 power falls to 0", s0.getPower() == 0.0 && windowError / readings < 0.02);
+    }
+  }
+  printf("%-34s %u rejected\n", "S0 bounces", s0.getRejected());
+}
+
+// Years of sessions of 5..25 kWh. The former bookkeeping kept kWh in
+// floats (startTotal += meteredKWh, meteredKWh = meterReading - startTotal),
+// the firmware now keeps integer Wh. The SDM total itself is a float
+// register, its resolution is the floor for both.
+static void benchEnergyDrift() {
+  const unsigned sessions = 5000;
+  const uint16_t impPerKwh = 800;
+  const uint8_t factor = 1;
+
+  // S0: pulses are exact, the float total is not
+  EvseWiFiS0Meter s0;
+  s0.begin(impPerKwh, factor, 30);
+  uint64_t pulsesTotal = 0;
+  float startTotal = 0.0;
+  int64_t startTotalWh = 0;
+  for (unsigned i = 0; i < sessions; i++) {
+    uint32_t pulses = 4000 + (i * 7919) % 16000;
+    pulsesTotal += pulses;
+    float meteredKWh = float(pulses) / float(impPerKwh / 1000.0) / 1000.0 * float(factor);
+    startTotal += meteredKWh;
+    s0.resetEnergy();
+    for (uint32_t p = 0; p < pulses; p++) {
+      s0.pulse();
+      s0.loop();
+      hostAdvanceMicros(50000);
+    }
+    startTotalWh += s0.getWattHours();
+  }
+  double exactWh = (double)pulsesTotal * 1000.0 * factor / impPerKwh;
+  printf("%-34s float=%+9.0f Wh  int64=%+6.0f Wh  (%.0f kWh metered)\n", "S0 lifetime total error",
+      (double)startTotal * 1000.0 - exactWh, (double)startTotalWh - exactWh, exactWh / 1000.0);
+
+  // SDM: session energy from two readings of the float total register
+  double totalKWh = 150000.0;
+  double floatSum = 0.0;
+  double floatWorst = 0.0;
+  int64_t intSum = 0;
+  double intWorst = 0.0;
+  double exactSum = 0.0;
+  for (unsigned i = 0; i < sessions; i++) {
+    double sessionKWh = 5.0 + ((i * 7919) % 20000) / 1000.0;
+    float meterStart = (float)totalKWh;
+    totalKWh += sessionKWh;
+    float meterEnd = (float)totalKWh;
+    float meteredKWh = meterEnd - meterStart;
+    int64_t meteredWh = (int64_t)((double)meterEnd * 1000.0 + 0.5) - (int64_t)((double)meterStart * 1000.0 + 0.5);
+    floatSum += float(int((meteredKWh + 0.005) * 100.0)) / 100.0;   // as logged before
+    intSum += meteredWh;
+    exactSum += sessionKWh * 1000.0;
+    floatWorst = max(floatWorst, fabs((double)meteredKWh * 1000.0 - sessionKWh * 1000.0));
+    intWorst = max(intWorst, fabs((double)meteredWh - sessionKWh * 1000.0));
+  }
+  printf("%-34s float=%9.1f Wh  int64=%6.1f Wh  (register step %.1f Wh)\n", "SDM worst session error",
+      floatWorst, intWorst, (double)(nextafterf((float)totalKWh, 1e9f) - (float)totalKWh) * 1000.0);
+  printf("%-34s float=%+9.0f Wh  int64=%+6.0f Wh\n", "SDM sum of logged sessions error",
+      floatSum * 1000.0 - exactSum, (double)intSum - exactSum);
+}
+
+static unsigned long hostClock() {
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void benchStorage() {
+  if (!storage.begin()) {
+    printf("%-34s cannot mount\n", storage.getName());
+    return;
+  }
+  s_storageTiming timings[STORAGE_OPERATIONS];
+  storage.benchmark(timings, hostClock);
+  for (uint8_t i = 0; i < STORAGE_OPERATIONS; i++) {
+    printf("%-34s avg=%6u us  max=%6u us  %u errors\n", EvseWiFiStorage::getOperationName(i),
+        timings[i].average, timings[i].maximum, timings[i].errors);
+  }
+}
+
+int main() {
+  printf("EVSE-WiFi native benchmark, %d baud, loop tick %d us\n\n", MODBUS_BAUD, LOOP_TICK);
+
+  printf("-- operations (virtual time)\n");
+  loopNanos.clear();
+  benchOperations("SDM120", 1);
+  benchOperations("SDM630", 3);
+  benchFallback();
+  benchOffline();
+
+  printf("\n-- background polling, 10 minutes (virtual time)\n");
+  benchSharedLine();
+
+  printf("\n-- loop() cost (host time)\n");
+  s_samples jitter = {"loop pass", std::vector<double>(), 0};
+  for (size_t i = 0; i < loopNanos.size(); i++) {
+    jitter.values.push_back(loopNanos[i] / 1000.0);
+  }
+  report(jitter, "us");
+
+  printf("\n-- loop() pass latency incl. bus waits, 2 minutes (host + virtual time)\n");
+  s_samples baseline = {"loop pass (blocking baseline)", std::vector<double>(), 0};
+  s_samples queued = {"loop pass (queued)", std::vector<double>(), 0};
+  benchLoopLatency(true, baseline);
+  benchLoopLatency(false, queued);
+  report(baseline, "us");
+  report(queued, "us");
+  check("queued pass p99 below 1 ms", queued.values[(queued.values.size() * 99) / 100] < 1000.0);
+  check("queued worst pass 10x below baseline", queued.values.back() * 10.0 < baseline.values.back());
+
+  printf("\n-- bus errors (virtual time)\n");
+  benchBadFrames();
+
+  printf("\n-- S0 power, one reading per second (virtual time)\n");
+  benchS0();
+
+  printf("\n-- energy bookkeeping, 5000 sessions\n");
+  benchEnergyDrift();
+
+  printf("\n-- storage, %s backend, %d runs (host time)\n", storage.getName(), STORAGE_BENCH_RUNS);
+  benchStorage();
+  return failures;
+}
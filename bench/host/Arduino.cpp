@@ -0,0 +1,28 @@
+#include "Arduino.h"
+
+static uint64_t virtualMicros = 0;
+
+unsigned long millis() {
+  return (unsigned long)(virtualMicros / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)virtualMicros;
+}
+
+void delay(unsigned long ms) {
+  virtualMicros += (uint64_t)ms * 1000;
+}
+
+// Busy-wait loops (EvseWiFiModbus::flush) must make progress
+void yield() {
+  virtualMicros += 100;
+}
+
+void hostAdvanceMicros(unsigned long us) {
+  virtualMicros += us;
+}
+
+uint64_t hostMicros() {
+  return virtualMicros;
+}
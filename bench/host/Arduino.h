@@ -0,0 +1,61 @@
+/*
+ * Arduino.h (host)
+ *
+ * Just enough of the Arduino core to build the Modbus engine, the register
+ * cache and the SDM planner on a Linux box. Time comes from a virtual clock
+ * that only moves when the benchmark advances it.
+ */
+
+#ifndef HOST_ARDUINO_H_
+#define HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RAM_ATTR
+
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+// Virtual clock
+void hostAdvanceMicros(unsigned long us);
+uint64_t hostMicros();
+
+inline uint16_t word(uint8_t high, uint8_t low) { return (uint16_t)((high << 8) | low); }
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define lowByte(w) ((uint8_t)((w) & 0xFF))
+
+using std::min;
+using std::max;
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+        size_t n = 0;
+        while (size--) {
+            n += write(*buffer++);
+        }
+        return n;
+    }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {}
+};
+
+#endif /* HOST_ARDUINO_H_ */
@@ -0,0 +1,165 @@
+#include "FS.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#define HOST_FS_TOTAL (1024 * 1024)     // like a 1 MB flash partition
+
+fs::FS HostFS("/tmp/evsewifi-hostfs");
+
+namespace fs {
+
+File::File(FILE* file) : handle(file, fclose) {}
+
+size_t File::size() {
+  long position = ftell(handle.get());
+  fseek(handle.get(), 0, SEEK_END);
+  long size = ftell(handle.get());
+  fseek(handle.get(), position, SEEK_SET);
+  return (size_t)size;
+}
+
+size_t File::position() {
+  return (size_t)ftell(handle.get());
+}
+
+bool File::seek(uint32_t position) {
+  return fseek(handle.get(), position, SEEK_SET) == 0;
+}
+
+int File::available() {
+  return (int)(size() - position());
+}
+
+int File::read() {
+  return fgetc(handle.get());
+}
+
+size_t File::read(uint8_t* buffer, size_t size) {
+  return fread(buffer, 1, size, handle.get());
+}
+
+size_t File::write(const uint8_t* buffer, size_t size) {
+  return fwrite(buffer, 1, size, handle.get());
+}
+
+Dir::Dir(const std::vector<std::string>& names, const std::vector<size_t>& sizes) : names(names), sizes(sizes) {}
+
+bool Dir::next() {
+  return ++index < (int)names.size();
+}
+
+std::string Dir::fileName() {
+  return names[index];
+}
+
+size_t Dir::fileSize() {
+  return sizes[index];
+}
+
+bool FS::begin() {
+  makeParents(root + "/");
+  return true;
+}
+
+std::string FS::hostPath(const char* path) {
+  return root + (path[0] == '/' ? "" : "/") + path;
+}
+
+void FS::makeParents(const std::string& path) {
+  for (size_t i = 1; i < path.size(); i++) {
+    if (path[i] == '/') {
+      mkdir(path.substr(0, i).c_str(), 0755);
+    }
+  }
+}
+
+// Arduino modes, always binary
+File FS::open(const char* path, const char* mode) {
+  std::string file = hostPath(path);
+  std::string hostMode = mode;
+  if (hostMode != "r") {
+    makeParents(file);
+  }
+  if (hostMode == "w") {
+    hostMode = "w+";
+  }
+  FILE* handle = fopen(file.c_str(), (hostMode + "b").c_str());
+  return handle ? File(handle) : File();
+}
+
+bool FS::exists(const char* path) {
+  struct stat status;
+  return stat(hostPath(path).c_str(), &status) == 0;
+}
+
+bool FS::remove(const char* path) {
+  return ::remove(hostPath(path).c_str()) == 0;
+}
+
+bool FS::rename(const char* from, const char* to) {
+  return ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0;
+}
+
+// Files directly in path, with full names as SPIFFS gives them
+Dir FS::openDir(const char* path) {
+  std::string prefix = path;
+  if (prefix.empty() || prefix[prefix.size() - 1] != '/') {
+    prefix += "/";
+  }
+  std::vector<std::string> names;
+  std::vector<size_t> sizes;
+  DIR* dir = opendir(hostPath(prefix.c_str()).c_str());
+  if (dir) {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+      struct stat status;
+      std::string name = prefix + entry->d_name;
+      if (stat(hostPath(name.c_str()).c_str(), &status) == 0 && S_ISREG(status.st_mode)) {
+        names.push_back(name);
+      }
+    }
+    closedir(dir);
+  }
+  std::sort(names.begin(), names.end());
+  for (size_t i = 0; i < names.size(); i++) {
+    struct stat status;
+    stat(hostPath(names[i].c_str()).c_str(), &status);
+    sizes.push_back(status.st_size);
+  }
+  return Dir(names, sizes);
+}
+
+// Only what the storage layer needs: the files at the top and one level down
+bool FS::info(FSInfo& info) {
+  info.totalBytes = HOST_FS_TOTAL;
+  info.usedBytes = 0;
+  DIR* dir = opendir(root.c_str());
+  if (!dir) {
+    return false;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    std::string name = std::string("/") + entry->d_name;
+    struct stat status;
+    if (stat(hostPath(name.c_str()).c_str(), &status) != 0) {
+      continue;
+    }
+    if (S_ISREG(status.st_mode)) {
+      info.usedBytes += status.st_size;
+    }
+    else if (S_ISDIR(status.st_mode)) {
+      Dir files = openDir(name.c_str());
+      while (files.next()) {
+        info.usedBytes += files.fileSize();
+      }
+    }
+  }
+  closedir(dir);
+  return true;
+}
+
+}
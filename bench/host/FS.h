@@ -0,0 +1,83 @@
+/*
+ * FS.h (host)
+ *
+ * The part of the ESP8266 filesystem API the storage layer uses, on plain
+ * files below a directory of the host. Parent directories are created on
+ * write, like LittleFS does.
+ */
+
+#ifndef HOST_FS_H_
+#define HOST_FS_H_
+
+#include <Arduino.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fs {
+
+struct FSInfo {
+    size_t totalBytes;
+    size_t usedBytes;
+};
+
+class File {
+public:
+    File() {}
+    explicit File(FILE* file);
+    operator bool() const { return (bool)handle; }
+    size_t size();
+    size_t position();
+    bool seek(uint32_t position);
+    int available();
+    int read();
+    size_t read(uint8_t* buffer, size_t size);
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t* buffer, size_t size);
+    void close() { handle.reset(); }
+
+private:
+    std::shared_ptr<FILE> handle;
+};
+
+class Dir {
+public:
+    Dir() {}
+    Dir(const std::vector<std::string>& names, const std::vector<size_t>& sizes);
+    bool next();
+    std::string fileName();
+    size_t fileSize();
+
+private:
+    std::vector<std::string> names;
+    std::vector<size_t> sizes;
+    int index = -1;
+};
+
+class FS {
+public:
+    explicit FS(const char* root) : root(root) {}
+    bool begin();
+    File open(const char* path, const char* mode);
+    bool exists(const char* path);
+    bool remove(const char* path);
+    bool rename(const char* from, const char* to);
+    Dir openDir(const char* path);
+    bool info(FSInfo& info);
+
+private:
+    std::string hostPath(const char* path);
+    void makeParents(const std::string& path);
+
+    std::string root;
+};
+
+}
+
+using fs::File;
+using fs::Dir;
+using fs::FSInfo;
+
+extern fs::FS HostFS;
+
+#endif /* HOST_FS_H_ */
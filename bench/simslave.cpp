@@ -0,0 +1,245 @@
+#include "simslave.h"
+
+uint16_t SimSlave::crc16(const uint8_t* data, size_t length) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x0001) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+  }
+  return crc;
+}
+
+size_t SimSlave::handle(const uint8_t* request, size_t length, uint8_t* response) {
+  if (length < 8 || request[0] != id) {
+    return 0;
+  }
+  uint16_t crc = crc16(request, length - 2);
+  if (request[length - 2] != lowByte(crc) || request[length - 1] != highByte(crc)) {
+    return 0;
+  }
+  requests++;
+
+  uint8_t function = request[1];
+  uint16_t address = word(request[2], request[3]);
+  uint16_t quantity = word(request[4], request[5]);
+  size_t len = 0;
+  response[len++] = id;
+  response[len++] = function;
+  uint8_t exception = 0;
+
+  if (function == 0x03 || function == 0x04) {
+    if (quantity == 0 || quantity > 125) {
+      exception = 0x03;
+    }
+    else {
+      response[len++] = 2 * quantity;
+      for (uint16_t i = 0; i < quantity && exception == 0; i++) {
+        uint16_t value;
+        if (!readRegister(function, address + i, value)) {
+          exception = 0x02;
+        }
+        response[len++] = highByte(value);
+        response[len++] = lowByte(value);
+      }
+    }
+  }
+  else if (function == 0x10 && length >= 9 + 2 * (size_t)quantity) {
+    for (uint16_t i = 0; i < quantity && exception == 0; i++) {
+      if (!writeRegister(address + i, word(request[7 + 2 * i], request[8 + 2 * i]))) {
+        exception = 0x02;
+      }
+    }
+    memcpy(&response[len], &request[2], 4);
+    len += 4;
+  }
+  else {
+    exception = 0x01;
+  }
+
+  if (exception != 0) {
+    len = 0;
+    response[len++] = id;
+    response[len++] = function | 0x80;
+    response[len++] = exception;
+  }
+  if (wrongAddress > 0) {
+    wrongAddress--;
+    response[0] = id + 100;
+  }
+  crc = crc16(response, len);
+  response[len++] = lowByte(crc);
+  response[len++] = highByte(crc);
+  return len;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+///////       SimpleEVSE
+//////////////////////////////////////////////////////////////////////////////////////////
+SimEvse::SimEvse(uint8_t id, bool oldFirmware) : SimSlave(id, 3000), oldFirmware(oldFirmware) {
+  memset(status, 0, sizeof(status));
+  memset(config, 0, sizeof(config));
+  status[0] = 16;     // 1000 configured amps
+  status[3] = 32;     // 1003 PP limit
+  status[5] = 18;     // 1005 firmware
+  status[6] = 3;      // 1006 EVSE state: disabled
+  config[0] = 16;     // 2000 amps after boot
+  config[1] = 1;      // 2001 modbus enabled
+  config[2] = 6;      // 2002 minimum amps
+  config[5] = 16384;  // 2005 deactivated
+  config[9] = 2;      // 2009 bootloader firmware
+  update();
+}
+
+void SimEvse::plugIn(bool connected) {
+  this->connected = connected;
+  update();
+}
+
+void SimEvse::update() {
+  bool enabled = status[6] != 3;
+  status[2] = !connected ? 1 : (enabled ? 3 : 2);               // 1002 vehicle state
+  status[1] = (connected && enabled) ? status[0] : 0;           // 1001 output amps
+}
+
+bool SimEvse::readRegister(uint8_t function, uint16_t address, uint16_t& value) {
+  value = 0;
+  if (function != 0x03) {
+    return false;
+  }
+  if (address >= 1000 && address < (oldFirmware ? 1007 : 1008)) {
+    value = status[address - 1000];
+    return true;
+  }
+  if (address >= 2000 && address < (oldFirmware ? 2010 : 2018)) {
+    value = config[address - 2000];
+    return true;
+  }
+  return false;
+}
+
+bool SimEvse::writeRegister(uint16_t address, uint16_t value) {
+  if (address == 1000) {
+    status[0] = value;
+  }
+  else if (address == 2005) {
+    config[5] = value;
+    if (value & 8192) {
+      status[6] = 1;      // enabled
+    }
+    if (value & 16384) {
+      status[6] = 3;      // disabled
+    }
+  }
+  else if (address >= 2000 && address < 2018) {
+    config[address - 2000] = value;
+  }
+  else {
+    return false;
+  }
+  update();
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+///////       Eastron SDM
+//////////////////////////////////////////////////////////////////////////////////////////
+// Eastron meters take a while to answer
+SimSdm::SimSdm(uint8_t id, uint8_t phases) : SimSlave(id, 20000), phases(phases) {
+}
+
+void SimSdm::setPower(float watts) {
+  this->watts = watts;
+}
+
+float SimSdm::valueAt(uint16_t address) {
+  float amps = watts / 230.0 / phases;
+  switch (address) {
+  case 0x0000: return 230.1;
+  case 0x0002: return phases > 1 ? 229.8 : 0.0;
+  case 0x0004: return phases > 1 ? 231.0 : 0.0;
+  case 0x0006: return amps;
+  case 0x0008: return phases > 1 ? amps : 0.0;
+  case 0x000A: return phases > 1 ? amps : 0.0;
+  case 0x000C: return watts / phases;
+  case 0x0034: return watts;
+  case 0x0156: return (float)kWh;
+  }
+  return 0.0;
+}
+
+bool SimSdm::readRegister(uint8_t function, uint16_t address, uint16_t& value) {
+  value = 0;
+  if (function != 0x04 || address > 0x0180) {
+    return false;
+  }
+  uint64_t now = hostMicros();
+  kWh += watts / 1000.0 * (double)(now - microsIntegrated) / 3600e6;
+  microsIntegrated = now;
+
+  uint32_t raw;
+  float f = valueAt(address & 0xFFFE);
+  memcpy(&raw, &f, sizeof(raw));
+  value = (address & 1) ? (uint16_t)raw : (uint16_t)(raw >> 16);
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+///////       RS485 line
+//////////////////////////////////////////////////////////////////////////////////////////
+SimLine::SimLine(unsigned long baud) {
+  charMicros = 11000000UL / baud;   // start, 8 data, parity/stop
+}
+
+void SimLine::attach(SimSlave* slave) {
+  slaves.push_back(slave);
+}
+
+size_t SimLine::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+// The master hands over complete frames
+size_t SimLine::write(const uint8_t* buffer, size_t size) {
+  uint64_t frameEnd = std::max(hostMicros(), lineBusyUntil) + size * charMicros;
+  lineBusyUntil = frameEnd;
+  frames++;
+  for (size_t i = 0; i < slaves.size(); i++) {
+    uint8_t response[SIM_MAX_FRAME];
+    size_t len = slaves[i]->handle(buffer, size, response);
+    if (len == 0) {
+      continue;
+    }
+    uint64_t at = frameEnd + slaves[i]->turnaroundMicros;
+    for (size_t j = 0; j < len; j++) {
+      at += charMicros;
+      s_timedByte b = {at, response[j]};
+      rx.push_back(b);
+    }
+    lineBusyUntil = at;
+  }
+  return size;
+}
+
+int SimLine::available() {
+  int count = 0;
+  uint64_t now = hostMicros();
+  for (size_t i = 0; i < rx.size() && rx[i].at <= now; i++) {
+    count++;
+  }
+  return count;
+}
+
+int SimLine::read() {
+  if (available() == 0) {
+    return -1;
+  }
+  uint8_t value = rx.front().value;
+  rx.pop_front();
+  return value;
+}
+
+int SimLine::peek() {
+  return available() ? rx.front().value : -1;
+}
@@ -0,0 +1,94 @@
+/*
+ * simslave.h
+ *
+ * In-process Modbus RTU slaves for the native benchmark: a SimpleEVSE
+ * (holding registers 1000-1007 and 2000-2017) and an Eastron SDM meter
+ * (input registers), connected to a simulated RS485 line that delivers
+ * every byte at the time it would arrive at the configured baud rate.
+ */
+
+#ifndef SIMSLAVE_H_
+#define SIMSLAVE_H_
+
+#include <Arduino.h>
+#include <deque>
+#include <vector>
+
+#define SIM_MAX_FRAME 256
+
+class SimSlave {
+public:
+    SimSlave(uint8_t id, unsigned long turnaroundMicros) : id(id), turnaroundMicros(turnaroundMicros) {}
+    virtual ~SimSlave() {}
+    // Builds the answer to a request frame, returns its length (0 = stay silent)
+    size_t handle(const uint8_t* request, size_t length, uint8_t* response);
+    static uint16_t crc16(const uint8_t* data, size_t length);
+
+    uint8_t id;
+    unsigned long turnaroundMicros;
+    uint32_t requests = 0;
+    uint8_t wrongAddress = 0;   // answers left that carry another slave address
+
+protected:
+    virtual bool readRegister(uint8_t function, uint16_t address, uint16_t& value) = 0;
+    virtual bool writeRegister(uint16_t address, uint16_t value) { return false; }
+};
+
+class SimEvse : public SimSlave {
+public:
+    SimEvse(uint8_t id, bool oldFirmware = false);
+    void plugIn(bool connected);
+
+protected:
+    bool readRegister(uint8_t function, uint16_t address, uint16_t& value);
+    bool writeRegister(uint16_t address, uint16_t value);
+
+private:
+    void update();
+    bool oldFirmware;       // firmware without 1007 and 2010-2017
+    bool connected = false;
+    uint16_t status[8];     // 1000-1007
+    uint16_t config[18];    // 2000-2017
+};
+
+class SimSdm : public SimSlave {
+public:
+    SimSdm(uint8_t id, uint8_t phases);
+    void setPower(float watts);
+
+protected:
+    bool readRegister(uint8_t function, uint16_t address, uint16_t& value);
+
+private:
+    float valueAt(uint16_t address);
+    uint8_t phases;
+    float watts = 0.0;
+    double kWh = 1234.5;
+    uint64_t microsIntegrated = 0;
+};
+
+// RS485 line as seen from the master
+class SimLine : public Stream {
+public:
+    SimLine(unsigned long baud);
+    void attach(SimSlave* slave);
+    size_t write(uint8_t c);
+    size_t write(const uint8_t* buffer, size_t size);
+    int available();
+    int read();
+    int peek();
+
+    uint32_t frames = 0;
+
+private:
+    struct s_timedByte {
+        uint64_t at;
+        uint8_t value;
+    };
+    std::vector<SimSlave*> slaves;
+    std::deque<s_timedByte> rx;
+    unsigned long charMicros;
+    uint64_t lineBusyUntil = 0;
+};
+
+#endif /* SIMSLAVE_H_ */
@@ -1,13 +1,11 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
 
-#ifdef ESP8266
-#include <FS.h>
-#else
-#include <SPIFFS.h>
-#endif
+#include "storage.h"
 
 #define ACTUAL_CONFIG_VERSION 1
+#define EVSE_MAX_COUNT 4    // SimpleEVSE boards on one bus
+#define SDM_MBID 2          // Modbus id of the meter, not given to an EVSE
 
 struct s_wifiConfig {
     const char* bssid;
@@ -37,6 +35,7 @@ struct s_rfidConfig {
     bool usePN532;
     uint8_t sspin;
     int8_t rfidgain;
+    int8_t irqpin;          // IRQ of the MFRC522, -1 if not wired
 };
 
 struct s_ntpConfig {
@@ -107,14 +106,13 @@ public:
     uint8_t ICACHE_FLASH_ATTR getMeterFactor(uint8_t meterId);
     bool useSMeter;
     bool useMMeter;
-    bool mMeterTypeSDM120;
-    bool mMeterTypeSDM630;
 
 // rfidConfig
     bool ICACHE_FLASH_ATTR getRfidActive();
     uint8_t ICACHE_FLASH_ATTR getRfidPin();
     uint8_t ICACHE_FLASH_ATTR getRfidUsePN532();
     int8_t ICACHE_FLASH_ATTR getRfidGain();
+    int8_t ICACHE_FLASH_ATTR getRfidIrqPin();
 
 // ntpConfig
     int8_t ICACHE_FLASH_ATTR getNtpTimezone();
@@ -158,11 +156,13 @@ private:
     s_ntpConfig ntpConfig;
     s_buttonConfig buttonConfig[1];
     s_systemConfig systemConfig;
-    s_evseConfig evseConfig[1];
+    s_evseConfig evseConfig[EVSE_MAX_COUNT];
 
     bool configLoaded;
     bool pre_0_4_Config;
     bool ICACHE_FLASH_ATTR saveConfigFile(String jsonConfig);
+    String ICACHE_FLASH_ATTR keepEvseConfig(String jsonConfig);
+    void ICACHE_FLASH_ATTR evseConfigToJson(JsonObject item, uint8_t evseId);
 
 protected:
 
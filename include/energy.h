@@ -0,0 +1,43 @@
+/*
+ * energy.h
+ *
+ * Lifetime energy counter in Wh. Every save appends a small checksummed
+ * record to a file instead of rewriting it in place; when the file is
+ * full it is rotated, so writes are spread over fresh flash pages. The
+ * latest valid record wins - a record torn by a power loss is skipped.
+ */
+
+#ifndef ENERGY_H_
+#define ENERGY_H_
+
+#include <Arduino.h>
+#include "storage.h"
+
+#define ENERGY_FILE "/energy.bin"
+#define ENERGY_FILE_OLD "/energy.old"
+#define ENERGY_RECORDS_PER_FILE 256   // 3 KB, then the file is rotated
+#define ENERGY_SAVE_INTERVAL 900000   // ms between saves while charging
+
+struct s_energyRecord {
+    uint32_t sequence;
+    uint32_t wattHours;
+    uint32_t check;
+};
+
+class EvseWiFiEnergyCounter {
+public:
+    bool ICACHE_FLASH_ATTR begin();
+    uint32_t ICACHE_FLASH_ATTR getWattHours();
+    bool ICACHE_FLASH_ATTR save(uint32_t wattHours);
+    void ICACHE_FLASH_ATTR reset();
+
+private:
+    bool ICACHE_FLASH_ATTR readLast(const char* path, s_energyRecord& record, bool& clean);
+    static uint32_t ICACHE_FLASH_ATTR checksum(const s_energyRecord& record);
+
+    uint32_t wattHours = 0;
+    uint32_t sequence = 0;
+    uint16_t records = 0;   // in ENERGY_FILE
+};
+
+#endif /* ENERGY_H_ */
@@ -0,0 +1,117 @@
+/*
+ * modbus.h
+ *
+ * Non-blocking Modbus RTU master. Requests are queued and processed by a
+ * small state machine driven from loop(), results are delivered through
+ * completion callbacks. The master owns the serial line: it keeps the
+ * inter-frame gap, lets commands overtake background polls and keeps
+ * track of how long every slave occupies the bus.
+ */
+
+#ifndef MODBUS_H_
+#define MODBUS_H_
+
+#include <Arduino.h>
+
+#define MODBUS_QUEUE_SIZE 16          // two register blocks per EVSE, the meter and commands
+#define MODBUS_MAX_REGS 64
+#define MODBUS_RESPONSE_TIMEOUT 1000  // ms
+#define MODBUS_BAUD 9600              // SimpleEVSE and SDM factory setting
+#define MODBUS_MAX_SLAVES 6           // four EVSEs and a meter
+#define MODBUS_STATS_WINDOW 60000     // ms
+
+// Function codes
+#define MODBUS_READ_HOLDING_REGISTERS 0x03
+#define MODBUS_READ_INPUT_REGISTERS 0x04
+#define MODBUS_WRITE_MULTIPLE_REGISTERS 0x10
+
+// Result codes (same values as used by ModbusMaster)
+#define MODBUS_SUCCESS 0x00
+#define MODBUS_ILLEGAL_FUNCTION 0x01
+#define MODBUS_ILLEGAL_DATA_ADDRESS 0x02
+#define MODBUS_ILLEGAL_DATA_VALUE 0x03
+#define MODBUS_SLAVE_DEVICE_FAILURE 0x04
+#define MODBUS_INVALID_SLAVE_ID 0xE0
+#define MODBUS_INVALID_FUNCTION 0xE1
+#define MODBUS_RESPONSE_TIMED_OUT 0xE2
+#define MODBUS_INVALID_CRC 0xE3
+
+enum ModbusPriority {
+    MODBUS_PRIORITY_POLL,       // background reads, served in order
+    MODBUS_PRIORITY_COMMAND     // user actions, overtake queued polls
+};
+
+struct s_modbusRequest;
+
+// Called once per request; response holds request->quantity registers on success
+typedef void (*ModbusCallback)(uint8_t result, const s_modbusRequest* request, const uint16_t* response);
+
+struct s_modbusRequest {
+    uint8_t slave;
+    uint8_t function;
+    uint16_t address;
+    uint16_t quantity;
+    uint16_t value;
+    ModbusCallback callback;
+    void* context;
+    uint8_t priority;
+};
+
+struct s_modbusSlaveStats {
+    uint8_t slave;
+    uint32_t busyMicros;        // current window
+    uint16_t transactions;
+    uint16_t errors;
+    uint16_t loadPermille;      // bus occupancy of the last complete window
+};
+
+enum ModbusState {
+    MODBUS_IDLE,
+    MODBUS_RECEIVING,
+    MODBUS_DISCARDING   // rest of a rejected frame, until the line is silent
+};
+
+class EvseWiFiModbus {
+public:
+    void ICACHE_FLASH_ATTR begin(Stream* serial, unsigned long baud = MODBUS_BAUD);
+    bool ICACHE_FLASH_ATTR readHoldingRegisters(uint8_t slave, uint16_t address, uint16_t quantity, ModbusCallback callback, void* context = NULL, uint8_t priority = MODBUS_PRIORITY_POLL);
+    bool ICACHE_FLASH_ATTR readInputRegisters(uint8_t slave, uint16_t address, uint16_t quantity, ModbusCallback callback, void* context = NULL, uint8_t priority = MODBUS_PRIORITY_POLL);
+    bool ICACHE_FLASH_ATTR writeRegister(uint8_t slave, uint16_t address, uint16_t value, ModbusCallback callback, void* context = NULL, uint8_t priority = MODBUS_PRIORITY_COMMAND);
+    void ICACHE_FLASH_ATTR loop();
+    bool ICACHE_FLASH_ATTR isIdle();
+    bool ICACHE_FLASH_ATTR flush(unsigned long timeout);
+    void ICACHE_FLASH_ATTR retransmit();
+    float ICACHE_FLASH_ATTR getLoad(uint8_t slave);
+    const s_modbusSlaveStats* ICACHE_FLASH_ATTR getStats(uint8_t slave);
+
+private:
+    bool ICACHE_FLASH_ATTR enqueue(const s_modbusRequest& request);
+    void ICACHE_FLASH_ATTR transmit();
+    void ICACHE_FLASH_ATTR receive();
+    void ICACHE_FLASH_ATTR discard();
+    void ICACHE_FLASH_ATTR reject(uint8_t result);
+    void ICACHE_FLASH_ATTR finish(uint8_t result);
+    void ICACHE_FLASH_ATTR account(uint8_t slave, uint32_t busy, bool error);
+    void ICACHE_FLASH_ATTR rollStats();
+    static uint16_t ICACHE_FLASH_ATTR crc16(const uint8_t* data, uint16_t length);
+
+    Stream* serial = NULL;
+    s_modbusRequest queue[MODBUS_QUEUE_SIZE];
+    uint8_t queueHead = 0;
+    uint8_t queueCount = 0;
+    ModbusState state = MODBUS_IDLE;
+    unsigned long millisTransmit = 0;
+    unsigned long microsTransmit = 0;
+    unsigned long microsLastActivity = 0;  // last byte seen on the line
+    unsigned long frameGapMicros = 0;
+    unsigned long millisStatsWindow = 0;
+    s_modbusSlaveStats stats[MODBUS_MAX_SLAVES];
+    uint8_t statsCount = 0;
+    uint8_t frame[5 + 2 * MODBUS_MAX_REGS];
+    uint16_t frameLength = 0;
+    uint16_t frameExpected = 0;
+    uint8_t rejectResult = 0;          // result of the transaction once the line is silent
+    uint16_t response[MODBUS_MAX_REGS];
+};
+
+#endif /* MODBUS_H_ */
@@ -0,0 +1,82 @@
+/*
+ * modbustcp.h
+ *
+ * Modbus TCP server. Reads are answered from memory through a read handler,
+ * writes are handed to a write handler that queues them on the RS485 bus and
+ * reports back with complete() - TCP clients never cause bus traffic of
+ * their own. Several clients may be connected at once.
+ */
+
+#ifndef MODBUSTCP_H_
+#define MODBUSTCP_H_
+
+#include <Arduino.h>
+#ifdef ESP8266
+#include <ESPAsyncTCP.h>
+#else
+#include <AsyncTCP.h>
+#endif
+#include "modbus.h"
+
+#define MODBUSTCP_PORT 502
+#define MODBUSTCP_MAX_CLIENTS 4
+#define MODBUSTCP_MAX_PENDING 4       // write transactions waiting for the RS485 bus
+#define MODBUSTCP_MAX_FRAME 260       // MBAP header + largest PDU
+#define MODBUSTCP_MAX_READ 125        // registers per read (Modbus application protocol)
+#define MODBUSTCP_MAX_WRITE 8         // registers per write, each one is a bus transaction
+#define MODBUSTCP_IDLE_TIMEOUT 120    // s without a request before a client is dropped
+
+#define MODBUS_WRITE_SINGLE_REGISTER 0x06
+#define MODBUS_SERVER_DEVICE_BUSY 0x06
+#define MODBUS_GATEWAY_PATH_UNAVAILABLE 0x0A
+#define MODBUS_GATEWAY_TARGET_FAILED 0x0B
+
+// Fills values for function 0x03/0x04, returns MODBUS_SUCCESS or an exception code
+typedef uint8_t (*ModbusTcpReadHandler)(uint8_t unit, uint8_t function, uint16_t address, uint16_t quantity, uint16_t* values);
+// Queues one register write, returns MODBUS_SUCCESS or an exception code; complete(token, ...) follows later
+typedef uint8_t (*ModbusTcpWriteHandler)(uint8_t unit, uint16_t address, uint16_t value, void* token);
+
+struct s_modbusTcpClient {
+    AsyncClient* client;
+    bool closed;            // disconnected, freed by loop()
+    uint16_t rxLength;
+    uint8_t rx[MODBUSTCP_MAX_FRAME];
+};
+
+struct s_modbusTcpPending {
+    bool used;
+    s_modbusTcpClient* client;  // NULL once the client is gone
+    uint16_t transaction;
+    uint8_t unit;
+    uint8_t function;
+    uint16_t address;
+    uint16_t quantity;      // quantity (0x10) or value (0x06) for the response
+    uint8_t outstanding;    // bus writes not completed yet
+    uint8_t result;         // first error of the transaction
+};
+
+class EvseWiFiModbusTcp {
+public:
+    void ICACHE_FLASH_ATTR begin(ModbusTcpReadHandler readHandler, ModbusTcpWriteHandler writeHandler, uint16_t port = MODBUSTCP_PORT);
+    void ICACHE_FLASH_ATTR loop();
+    void ICACHE_FLASH_ATTR complete(void* token, uint8_t result);
+    uint8_t ICACHE_FLASH_ATTR getClientCount();
+
+private:
+    static void ICACHE_FLASH_ATTR onClient(void* arg, AsyncClient* client);
+    static void ICACHE_FLASH_ATTR onData(void* arg, AsyncClient* client, void* data, size_t len);
+    static void ICACHE_FLASH_ATTR onDisconnect(void* arg, AsyncClient* client);
+    void ICACHE_FLASH_ATTR receive(s_modbusTcpClient* slot, const uint8_t* data, size_t len);
+    void ICACHE_FLASH_ATTR handleFrame(s_modbusTcpClient* slot, const uint8_t* frame, uint16_t length);
+    uint8_t ICACHE_FLASH_ATTR handleWrite(s_modbusTcpClient* slot, uint16_t transaction, uint8_t unit, const uint8_t* pdu, uint16_t length);
+    void ICACHE_FLASH_ATTR sendResponse(s_modbusTcpClient* slot, uint16_t transaction, uint8_t unit, const uint8_t* pdu, uint16_t length);
+    void ICACHE_FLASH_ATTR sendException(s_modbusTcpClient* slot, uint16_t transaction, uint8_t unit, uint8_t function, uint8_t exception);
+
+    AsyncServer* server = NULL;
+    ModbusTcpReadHandler readHandler = NULL;
+    ModbusTcpWriteHandler writeHandler = NULL;
+    s_modbusTcpClient clients[MODBUSTCP_MAX_CLIENTS];
+    s_modbusTcpPending pending[MODBUSTCP_MAX_PENDING];
+};
+
+#endif /* MODBUSTCP_H_ */
@@ -1,15 +1,3 @@
-struct s_addEvseData {
-    uint16_t evseAmpsAfterboot;  //Register 2000
-    uint16_t evseModbusEnabled;  //Register 2001
-    uint16_t evseAmpsMin;        //Register 2002
-    uint16_t evseAnIn;           //Register 2003
-    uint16_t evseAmpsPowerOn;    //Register 2004
-    uint16_t evseReg2005;        //Register 2005
-    uint16_t evseShareMode;      //Register 2006
-    uint16_t evsePpDetection;    //Register 2007
-    uint16_t evseBootFirmware;   //Register 2009
-};
-
 void ICACHE_FLASH_ATTR doChangeLedTimes();
 void ICACHE_FLASH_ATTR changeLedTimes(uint16_t, uint16_t);
 String ICACHE_FLASH_ATTR printIP(IPAddress);
@@ -17,30 +5,67 @@ void ICACHE_FLASH_ATTR parseBytes(const char*, char, byte*, int, int);
 void ICACHE_RAM_ATTR handleMeterInt();
 void ICACHE_FLASH_ATTR updateS0MeterData();
 void ICACHE_FLASH_ATTR updateMMeterData();
-void ICACHE_FLASH_ATTR updateSDMMeterCurrent();
-unsigned long ICACHE_FLASH_ATTR getChargingTime();
+String ICACHE_FLASH_ATTR formatKWh(int64_t);
+void ICACHE_FLASH_ATTR onMeterData(uint8_t);
+unsigned long ICACHE_FLASH_ATTR getChargingTime(uint8_t);
+bool ICACHE_FLASH_ATTR isEvseDeactivating();
+bool ICACHE_FLASH_ATTR isVehicleCharging();
+uint8_t ICACHE_FLASH_ATTR getEvseId(uint8_t);
+void ICACHE_FLASH_ATTR changeEvseLedTimes(uint8_t, uint16_t, uint16_t);
 void ICACHE_FLASH_ATTR rfidloop();
-s_addEvseData ICACHE_FLASH_ATTR getAdditionalEVSEData();
+void ICACHE_FLASH_ATTR onAdditionalEVSEData(uint8_t, uint8_t, uint16_t, const uint16_t*);
 void ICACHE_FLASH_ATTR sendStatus();
 void ICACHE_FLASH_ATTR printScanResult(int);
 void ICACHE_FLASH_ATTR logLatest(String, String);
 void ICACHE_FLASH_ATTR updateLog(bool);
-float ICACHE_FLASH_ATTR getS0MeterReading();
+void ICACHE_FLASH_ATTR flushSessionLog();
+void ICACHE_FLASH_ATTR compactUserDb();
+void ICACHE_FLASH_ATTR benchStorage();
+void ICACHE_FLASH_ATTR commitUserImport();
+void ICACHE_FLASH_ATTR importUserData(AsyncWebServerRequest*, size_t, uint8_t*, size_t);
+int64_t ICACHE_FLASH_ATTR getS0MeterReading();
+void ICACHE_FLASH_ATTR saveEnergyTotal(int64_t);
+void ICACHE_FLASH_ATTR queueEnergyTotal(int64_t);
+void ICACHE_FLASH_ATTR closeMeteredSession();
 bool ICACHE_FLASH_ATTR initLogFile();
-float ICACHE_FLASH_ATTR readMeter(uint16_t);
-bool ICACHE_FLASH_ATTR queryEVSE();
-bool ICACHE_FLASH_ATTR activateEVSE();
-bool ICACHE_FLASH_ATTR deactivateEVSE(bool);
-bool ICACHE_FLASH_ATTR setEVSEcurrent();
-bool ICACHE_FLASH_ATTR setEVSERegister(uint16_t, uint16_t);
+void ICACHE_FLASH_ATTR importLogFile();
+bool ICACHE_FLASH_ATTR queryEVSE(uint8_t);
+void ICACHE_FLASH_ATTR onQueryEVSE(uint8_t, uint8_t, uint16_t, const uint16_t*);
+void ICACHE_FLASH_ATTR adaptEvsePolling(uint8_t, bool);
+bool ICACHE_FLASH_ATTR processEVSEData(uint8_t, uint8_t, const uint16_t*);
+bool ICACHE_FLASH_ATTR activateEVSE(uint8_t);
+void ICACHE_FLASH_ATTR onActivateEVSE(uint8_t, const s_modbusRequest*, const uint16_t*);
+void ICACHE_FLASH_ATTR finishActivateEVSE(uint8_t);
+bool ICACHE_FLASH_ATTR deactivateEVSE(uint8_t, bool);
+void ICACHE_FLASH_ATTR onDeactivateEVSE(uint8_t, const s_modbusRequest*, const uint16_t*);
+void ICACHE_FLASH_ATTR finishDeactivateEVSE(uint8_t);
+bool ICACHE_FLASH_ATTR setEVSEcurrent(uint8_t);
+void ICACHE_FLASH_ATTR onSetEVSEcurrent(uint8_t, const s_modbusRequest*, const uint16_t*);
+void ICACHE_FLASH_ATTR processEvseCommands(uint8_t);
+void ICACHE_FLASH_ATTR awaitReadBack(uint8_t);
+bool ICACHE_FLASH_ATTR isEvseCommandConfirmed(uint8_t);
+void ICACHE_FLASH_ATTR confirmEvseCommand(uint8_t, bool);
+void ICACHE_FLASH_ATTR sendCommandResult(uint8_t, uint8_t, bool);
+void ICACHE_FLASH_ATTR onSetEVSERegister(uint8_t, const s_modbusRequest*, const uint16_t*);
+bool ICACHE_FLASH_ATTR setEVSERegister(uint8_t, uint16_t, uint16_t, ModbusCallback = onSetEVSERegister, void* = NULL);
+uint8_t ICACHE_FLASH_ATTR onModbusTcpRead(uint8_t, uint8_t, uint16_t, uint16_t, uint16_t*);
+uint8_t ICACHE_FLASH_ATTR onModbusTcpWrite(uint8_t, uint16_t, uint16_t, void*);
+void ICACHE_FLASH_ATTR onModbusTcpWritten(uint8_t, const s_modbusRequest*, const uint16_t*);
 void ICACHE_FLASH_ATTR pushSessionTimeOut();
-void ICACHE_FLASH_ATTR sendEVSEdata();
+void ICACHE_FLASH_ATTR sendEVSEdata(uint8_t, AsyncWebSocketClient* = NULL);
 void ICACHE_FLASH_ATTR sendTime();
-void ICACHE_FLASH_ATTR sendUserList(int , AsyncWebSocketClient*);
+void ICACHE_FLASH_ATTR sendUserList(const s_userQuery&, AsyncWebSocketClient*);
+void ICACHE_FLASH_ATTR sendLatestLog(const s_sessionQuery&, AsyncWebSocketClient*);
+size_t ICACHE_FLASH_ATTR formatUserList(const s_userRecord*, uint8_t, bool, char*);
 void ICACHE_FLASH_ATTR onWsEvent(AsyncWebSocket*, AsyncWebSocketClient*, AwsEventType, void*, uint8_t*, size_t);
 void ICACHE_FLASH_ATTR processWsEvent(JsonDocument&, AsyncWebSocketClient*);
 void ICACHE_FLASH_ATTR restoreDefaultConfig();
+int ICACHE_FLASH_ATTR getEvseParam(AsyncWebServerRequest*);
 void ICACHE_FLASH_ATTR setWebEvents();
 void ICACHE_FLASH_ATTR fallbacktoAPMode();
 void ICACHE_FLASH_ATTR startWebserver();
+void ICACHE_FLASH_ATTR suspendModbusSerial();
+void ICACHE_FLASH_ATTR resumeModbusSerial();
 bool ICACHE_FLASH_ATTR resetUserData();
+bool ICACHE_FLASH_ATTR queueUserChange(const char*, const char*, uint8_t, uint32_t, bool);
+void ICACHE_FLASH_ATTR applyUserChange();
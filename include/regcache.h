@@ -0,0 +1,62 @@
+/*
+ * regcache.h
+ *
+ * In-memory copy of Modbus register blocks. Every block has a freshness
+ * budget (maxAge); stale blocks are refreshed in the background through
+ * the Modbus engine, consumers only ever read from memory.
+ */
+
+#ifndef REGCACHE_H_
+#define REGCACHE_H_
+
+#include <Arduino.h>
+#include "modbus.h"
+
+#define REGCACHE_MAX_BLOCKS 4
+#define REGCACHE_MAX_REGS 18
+#define REGCACHE_RETRY 500       // ms after the first failed refresh, doubled with every further failure
+#define REGCACHE_RETRY_MAX 30000
+
+// Called after every refresh attempt of a block; values holds the cached registers
+typedef void (*RegisterCacheCallback)(uint8_t result, uint8_t slave, uint16_t address, const uint16_t* values);
+
+struct s_registerBlock {
+    uint16_t address;
+    uint16_t quantity;      // registers actually polled
+    uint16_t minQuantity;   // fallback for slaves that reject the full range
+    unsigned long maxAge;
+    unsigned long millisUpdated;
+    unsigned long millisRequested;
+    bool valid;
+    bool pending;
+    uint8_t failures;       // consecutive failed refreshes
+    RegisterCacheCallback callback;
+    uint16_t values[REGCACHE_MAX_REGS];
+};
+
+class EvseWiFiRegisterCache {
+public:
+    void ICACHE_FLASH_ATTR begin(EvseWiFiModbus* bus, uint8_t slave);
+    uint8_t ICACHE_FLASH_ATTR addBlock(uint16_t address, uint16_t quantity, uint16_t minQuantity, unsigned long maxAge, RegisterCacheCallback callback);
+    void ICACHE_FLASH_ATTR setMaxAge(uint8_t block, unsigned long maxAge);
+    bool ICACHE_FLASH_ATTR refresh(uint8_t block);
+    void ICACHE_FLASH_ATTR invalidate(uint8_t block);
+    void ICACHE_FLASH_ATTR loop();
+    bool ICACHE_FLASH_ATTR isFresh(uint8_t block);
+    bool ICACHE_FLASH_ATTR isValid(uint8_t block);
+    bool ICACHE_FLASH_ATTR contains(uint16_t reg);
+    uint16_t ICACHE_FLASH_ATTR get(uint16_t reg);
+    void ICACHE_FLASH_ATTR set(uint16_t reg, uint16_t value);
+
+private:
+    static void ICACHE_FLASH_ATTR onResponse(uint8_t result, const s_modbusRequest* request, const uint16_t* response);
+    s_registerBlock* ICACHE_FLASH_ATTR findBlock(uint16_t reg);
+    static unsigned long ICACHE_FLASH_ATTR retryDelay(const s_registerBlock& block);
+
+    EvseWiFiModbus* bus = NULL;
+    uint8_t slave = 0;
+    s_registerBlock blocks[REGCACHE_MAX_BLOCKS];
+    uint8_t blockCount = 0;
+};
+
+#endif /* REGCACHE_H_ */
@@ -7,11 +7,53 @@
 //#include <Adafruit_PN532.h> 
 #include "ntp.h"
 
+#include "userdb.h"
+
+// Users of the user database are kept in RAM from begin() on, a card tap is
+// a hash lookup without flash I/O. userfile/remove change the table along
+// with the database. The key is the UID as a scan writes it - hex digits
+// without padding - packed to nibbles. Only when the table or the name pool
+// ran full are misses looked up in the database.
+//
+// The MFRC522 cannot look for cards by itself, it has to send a REQA. With
+// its IRQ pin wired (rfid.irqpin), a REQA is three register writes every
+// RFID_KICK_INTERVAL and a card's answer raises the interrupt; without it
+// each poll waits for the reader's timeout. On ESP32 this runs in its own
+// task, which hands finished scans to the loop through a queue; on ESP8266
+// the loop calls it, the interrupt saves the polls. Instead of a PCD_Init()
+// every second the reader is checked for a lost setup and only then set up
+// again.
 #ifdef ESP8266
-#include <FS.h>
+#define RFID_USER_SLOTS 128         // power of two
+#define RFID_NAMES 1024             // bytes for all user names
 #else
-#include <SPIFFS.h>
+#define RFID_USER_SLOTS 512
+#define RFID_NAMES 8192
 #endif
+#define RFID_USERS (RFID_USER_SLOTS * 3 / 4)
+#define RFID_KICK_INTERVAL 100      // ms between two REQA with IRQ pin
+#define RFID_POLL_INTERVAL 50       // ms between two polls without
+#define RFID_CHECK_INTERVAL 1000    // ms between two checks of the reader setup
+#define RFID_COOLDOWN 3000          // ms after a card before the next one is read
+#define RFID_QUEUE 4                // ESP32, scans waiting for the loop
+#define RFID_TASK_STACK 4096
+#define RFID_UID_DIGITS 20
+#define RFID_NAME_LENGTH 50
+
+struct s_rfidUser {
+    uint8_t uid[RFID_UID_DIGITS / 2];
+    uint8_t digits;         // 0 = free slot
+    uint8_t acctype;        // 1 active, 99 admin, 0 disabled
+    uint32_t validuntil;    // Unix time
+    uint16_t name;          // offset in the name pool
+};
+
+// A card as read by the reader, looked up in the users later
+struct s_rfidScan {
+    uint8_t uid[10];
+    uint8_t size;
+    uint8_t sak;
+};
 
 struct scanResult {
     String uid = "";
@@ -24,15 +66,51 @@ struct scanResult {
 
 class EvseWiFiRfid {
 public:
-	bool ICACHE_FLASH_ATTR begin(int rfidss, bool usePN532, int rfidgain, NtpClient* ntp, bool debug);
-    scanResult ICACHE_FLASH_ATTR readPicc();
+	bool ICACHE_FLASH_ATTR begin(int rfidss, bool usePN532, int rfidgain, int irqpin, NtpClient* ntp, bool debug);
+    bool ICACHE_FLASH_ATTR getScan(scanResult& result);
     bool ICACHE_FLASH_ATTR performSelfTest();
     bool ICACHE_FLASH_ATTR reset();
-    DynamicJsonDocument ICACHE_FLASH_ATTR getUserList(int page);
-    unsigned long cooldown;
+    bool ICACHE_FLASH_ATTR loadUsers();
+    bool ICACHE_FLASH_ATTR setUser(const char* uid, const char* user, uint8_t acctype, uint32_t validuntil);
+    void ICACHE_FLASH_ATTR removeUser(const char* uid);
+    void ICACHE_FLASH_ATTR clearUsers();
 
 private:
     void ICACHE_FLASH_ATTR printReaderDetails();
+    bool ICACHE_FLASH_ATTR service(s_rfidScan& scan);
+    bool ICACHE_FLASH_ATTR readAnswered(s_rfidScan& scan);
+    bool ICACHE_FLASH_ATTR poll(s_rfidScan& scan);
+    void ICACHE_FLASH_ATTR takeCard(s_rfidScan& scan);
+    void ICACHE_FLASH_ATTR sendRequest();
+    void ICACHE_FLASH_ATTR initReader();
+    void ICACHE_FLASH_ATTR armIrq();
+    bool ICACHE_FLASH_ATTR isReaderReady();
+    scanResult ICACHE_FLASH_ATTR resolve(const s_rfidScan& scan);
+    #ifdef ESP32
+    static void runTask(void* parameter);
+    #endif
+    int ICACHE_FLASH_ATTR findUser(const uint8_t* uid, uint8_t digits);
+    void ICACHE_FLASH_ATTR removeSlot(uint16_t slot);
+    bool ICACHE_FLASH_ATTR addName(const char* user, uint16_t& offset);
+    void ICACHE_FLASH_ATTR compactNames();
+    bool ICACHE_FLASH_ATTR isPermitted(uint8_t acctype, uint32_t validuntil);
+    static bool ICACHE_FLASH_ATTR packUid(const char* uid, uint8_t* packed, uint8_t& digits);
+    static uint16_t ICACHE_FLASH_ATTR hashUid(const uint8_t* packed, uint8_t digits);
+
+    s_rfidUser users[RFID_USER_SLOTS];
+    uint16_t userCount = 0;
+    char names[RFID_NAMES];
+    uint16_t namesUsed = 0;
+    bool loaded = false;
+    bool overflow = false;  // not every user fitted, misses go to flash
+
+    int irqPin = -1;        // -1 polls
+    bool started = false;
+    bool cooling = false;   // a card was read, the next waits until millisNext
+    unsigned long millisNext = 0;
+    unsigned long millisCheck = 0;
+    volatile bool toReset = false;
+
     NtpClient* ntpClient;
     bool debug;
     bool usePN532;
@@ -0,0 +1,58 @@
+/*
+ * s0meter.h
+ *
+ * S0 pulse meter. The interrupt only stores a micros() timestamp in a
+ * single-producer/single-consumer ring; loop() takes the timestamps over,
+ * drops contact bounces and derives the power once a second from all
+ * pulses of a sliding window.
+ */
+
+#ifndef S0METER_H_
+#define S0METER_H_
+
+#include <Arduino.h>
+
+#define S0_RING_SIZE 16             // power of two, drained with every loop() pass
+#define S0_HISTORY 64               // accepted pulses kept for the window
+#define S0_WINDOW 10000             // ms of pulses that make up one power value
+#define S0_UPDATE_INTERVAL 1000     // ms between power values
+#define S0_IDLE_TIMEOUT 60000       // ms without pulses until the power is 0
+#define S0_STOP_INTERVALS 2         // average pulse intervals without a pulse until the power is 0
+#define S0_BOUNCE_MARGIN 10         // ms on top of the pulse length
+
+class EvseWiFiS0Meter {
+public:
+    void ICACHE_FLASH_ATTR begin(uint16_t impPerKwh, uint8_t factor, uint16_t impLength);
+    void ICACHE_RAM_ATTR pulse();
+    bool ICACHE_FLASH_ATTR loop();
+    float ICACHE_FLASH_ATTR getPower();
+    uint64_t ICACHE_FLASH_ATTR getWattHours();
+    void ICACHE_FLASH_ATTR resetEnergy();
+    uint32_t ICACHE_FLASH_ATTR getRejected();
+
+private:
+    void ICACHE_FLASH_ATTR accept(uint32_t timestamp);
+    float ICACHE_FLASH_ATTR calculate(uint32_t microsNow);
+    uint32_t ICACHE_FLASH_ATTR getHistory(uint8_t age);
+
+    // Written by the interrupt only ...
+    volatile uint32_t ring[S0_RING_SIZE];
+    volatile uint8_t ringHead = 0;
+    volatile uint32_t overruns = 0;
+    // ... and by loop() only
+    volatile uint8_t ringTail = 0;
+
+    uint32_t history[S0_HISTORY];
+    uint8_t historyHead = 0;
+    uint8_t historyCount = 0;
+    uint64_t pulses = 0;            // accepted since begin()
+    uint64_t pulsesReset = 0;       // at resetEnergy()
+    uint32_t rejected = 0;
+    uint32_t minInterval = 0;       // us, anything shorter is a bounce
+    uint16_t impPerKwh = 0;
+    uint8_t factor = 1;
+    float power = 0.0;
+    unsigned long millisUpdate = 0;
+};
+
+#endif /* S0METER_H_ */
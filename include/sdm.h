@@ -0,0 +1,75 @@
+/*
+ * sdm.h
+ *
+ * Eastron SDM energy meters. Every model is described by a constant
+ * register table; at begin() the table is planned into as few
+ * multi-register reads as possible and one poll() reads all values.
+ */
+
+#ifndef SDM_H_
+#define SDM_H_
+
+#include <Arduino.h>
+#include "modbus.h"
+
+#define SDM_MAX_BLOCKS 4
+#define SDM_MAX_GAP 40  // unused registers worth reading instead of starting a new transaction
+
+enum SdmValue {
+    SDM_VOLTAGE_P1,
+    SDM_VOLTAGE_P2,
+    SDM_VOLTAGE_P3,
+    SDM_CURRENT_P1,
+    SDM_CURRENT_P2,
+    SDM_CURRENT_P3,
+    SDM_POWER_TOTAL,
+    SDM_ENERGY_TOTAL,
+    SDM_VALUE_COUNT
+};
+
+struct s_sdmRegister {
+    uint8_t value;      // SdmValue
+    uint16_t address;   // input register, float spans two registers
+};
+
+struct s_sdmModel {
+    const char* name;
+    const s_sdmRegister* registers;  // sorted by address
+    uint8_t count;
+};
+
+struct s_sdmBlock {
+    uint16_t address;
+    uint16_t quantity;
+};
+
+// Called once per poll cycle with the first error of the cycle (or MODBUS_SUCCESS)
+typedef void (*SdmCallback)(uint8_t result);
+
+class EvseWiFiSdmMeter {
+public:
+    bool ICACHE_FLASH_ATTR begin(EvseWiFiModbus* bus, uint8_t slave, const char* type);
+    bool ICACHE_FLASH_ATTR poll(SdmCallback callback);
+    bool ICACHE_FLASH_ATTR isUpdated(SdmValue value);
+    float ICACHE_FLASH_ATTR get(SdmValue value);
+    bool ICACHE_FLASH_ATTR getRegister(uint16_t address, uint16_t& value);
+    uint8_t ICACHE_FLASH_ATTR getBlockCount();
+    static float ICACHE_FLASH_ATTR decodeFloat(const uint16_t* registers);
+
+private:
+    static void ICACHE_FLASH_ATTR onResponse(uint8_t result, const s_modbusRequest* request, const uint16_t* response);
+    void ICACHE_FLASH_ATTR plan();
+
+    EvseWiFiModbus* bus = NULL;
+    uint8_t slave = 0;
+    const s_sdmModel* model = NULL;
+    s_sdmBlock blocks[SDM_MAX_BLOCKS];
+    uint8_t blockCount = 0;
+    uint8_t pending = 0;
+    uint8_t cycleResult = MODBUS_SUCCESS;
+    uint16_t updated = 0;  // bit per SdmValue, reset with every poll
+    float values[SDM_VALUE_COUNT];
+    SdmCallback callback = NULL;
+};
+
+#endif /* SDM_H_ */
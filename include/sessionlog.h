@@ -0,0 +1,210 @@
+/*
+ * sessionlog.h
+ *
+ * Charging session history as fixed-size binary records on flash, one
+ * segment file per month. A small index keeps for every segment its
+ * month, first sequence, record count, energy sum and a mask of the
+ * users in it, so queries by time or user open only the segments that
+ * can match. A session start appends one record to the segment of its
+ * month, the session end rewrites just that record. Every record and
+ * index entry carries a CRC; a record torn by a power loss is skipped by
+ * readers. The oldest segments are removed when flash runs low.
+ *
+ * Next to each segment a totals file keeps per RFID UID the finished
+ * sessions, Wh, duration and cost of the month, updated as sessions are
+ * closed - a billing report reads these instead of the records.
+ *
+ * Appends and updates only go into a small queue in RAM, where a session
+ * started and finished before the next flush becomes a single write.
+ * flush() does the flash I/O later, from an idle moment of the main loop;
+ * readers see queued records as if they were stored.
+ *
+ * The JSON of /getLog is produced a record at a time from the files,
+ * never as one document, and can be fetched in pages by sequence number.
+ * While a download is open the files are not written, flush() leaves the
+ * queue as it is; one that stops reading is dropped after
+ * SESSIONLOG_READ_TIMEOUT.
+ */
+
+#ifndef SESSIONLOG_H_
+#define SESSIONLOG_H_
+
+#include <Arduino.h>
+#include "storage.h"
+
+#define SESSIONLOG_INDEX "/log/index.bin"
+#define SESSIONLOG_SEGMENT "/log/%06lu.bin"
+#define SESSIONLOG_TOTALS "/log/%06lu.sum"
+#ifdef ESP8266
+#define SESSIONLOG_SEGMENTS 36      // months kept at most
+#define SESSIONLOG_MIN_FREE 16384   // bytes of flash left before the oldest month goes
+#define SESSIONLOG_QUEUE 4          // appends and updates waiting for flush()
+#else
+#define SESSIONLOG_SEGMENTS 120
+#define SESSIONLOG_MIN_FREE 32768
+#define SESSIONLOG_QUEUE 8
+#endif
+#define SESSIONLOG_LINE 320
+#define SESSIONLOG_PAGE 10          // records per websocket message
+#define SESSIONLOG_READ_TIMEOUT 10000   // ms without a read before a download is dropped
+
+enum SessionState {
+    SESSION_RUNNING,
+    SESSION_FINISHED,
+    SESSION_FAILED      // interrupted by a reboot, shown as "e"
+};
+
+struct s_sessionRecord {
+    uint32_t sequence;      // 1.., position in its segment is sequence - firstSequence
+    uint32_t timestamp;     // session start, Unix time
+    uint32_t duration;      // ms
+    uint32_t energy;        // Wh
+    float price;            // cent per kWh
+    uint8_t state;          // SessionState
+    char uid[21];
+    char username[50];
+    uint32_t check;
+};
+
+struct s_sessionSegment {
+    uint32_t month;         // YYYYMM, 0 for sessions started without time
+    uint32_t firstTimestamp;
+    uint32_t lastTimestamp;
+    uint32_t firstSequence;
+    uint32_t count;
+    uint32_t energy;        // Wh of the finished sessions
+    uint32_t users;         // one bit per uid hash, a clear bit rules the uid out
+    uint32_t check;
+};
+
+// Finished sessions of one UID in one month
+struct s_sessionTotal {
+    char uid[21];
+    char username[50];      // of the latest session
+    uint32_t sessions;
+    uint32_t energy;        // Wh
+    uint32_t duration;      // ms
+    uint32_t cost;          // 0.001 cent, each session at its own price
+    uint32_t check;
+};
+
+struct s_sessionPending {
+    s_sessionRecord record;
+    bool append;            // not in a segment yet
+};
+
+// A JSON download asked for, kept until it is opened
+struct s_sessionQuery {
+    uint32_t since;
+    uint32_t limit;
+    uint32_t from;
+    uint32_t to;
+    char uid[21];           // empty for all users
+};
+
+// Position of a JSON download
+struct s_sessionCursor {
+    uint32_t sequence;
+    uint32_t remaining;     // records still to write, 0 = no limit
+    bool limited;
+    uint32_t from;          // session start range, to = 0 for no upper bound
+    uint32_t to;
+    char uid[21];           // empty for all users
+    uint8_t part;           // 0 head, 1 records, 2 tail, 3 done
+    bool separator;         // a record has been written, the next needs a comma
+    char line[SESSIONLOG_LINE];
+    uint16_t lineLength;
+    uint16_t lineOffset;
+    uint32_t generation;    // of the downloads it was opened among
+};
+
+// Position of a totals download
+struct s_totalsCursor {
+    uint32_t fromMonth;     // YYYYMM, toMonth = 0 for no upper bound
+    uint32_t toMonth;
+    char uid[21];           // empty for all users
+    bool started;
+    uint32_t month;         // being read, the next one is the first segment after it
+    uint32_t entry;         // within the totals file of month
+    uint8_t part;           // 0 head, 1 totals, 2 tail, 3 done
+    bool separator;
+    char line[SESSIONLOG_LINE];
+    uint16_t lineLength;
+    uint16_t lineOffset;
+    uint32_t generation;    // of the downloads it was opened among
+};
+
+class EvseWiFiSessionLog {
+public:
+    bool ICACHE_FLASH_ATTR begin();
+    bool ICACHE_FLASH_ATTR append(s_sessionRecord& record);
+    bool ICACHE_FLASH_ATTR update(s_sessionRecord& record);
+    bool ICACHE_FLASH_ATTR flush(uint8_t max = SESSIONLOG_QUEUE);
+    bool ICACHE_FLASH_ATTR isPending();
+    bool ICACHE_FLASH_ATTR isFull();
+    bool ICACHE_FLASH_ATTR read(uint32_t sequence, s_sessionRecord& record);
+    bool ICACHE_FLASH_ATTR getLatest(s_sessionRecord& record);
+    uint32_t ICACHE_FLASH_ATTR getFirst();
+    uint32_t ICACHE_FLASH_ATTR getLast();
+    uint64_t ICACHE_FLASH_ATTR getEnergy();
+    uint8_t ICACHE_FLASH_ATTR getSegmentCount();
+    bool ICACHE_FLASH_ATTR getSegment(uint8_t index, s_sessionSegment& segment);
+    bool ICACHE_FLASH_ATTR clear();
+    bool ICACHE_FLASH_ATTR openJson(s_sessionCursor& cursor, uint32_t since = 0, uint32_t limit = 0,
+        uint32_t from = 0, uint32_t to = 0, const char* uid = NULL);
+    size_t ICACHE_FLASH_ATTR readJson(s_sessionCursor& cursor, uint8_t* buffer, size_t maxLen);
+    bool ICACHE_FLASH_ATTR openTotals(s_totalsCursor& cursor, uint32_t fromMonth = 0, uint32_t toMonth = 0, const char* uid = NULL);
+    size_t ICACHE_FLASH_ATTR readTotals(s_totalsCursor& cursor, uint8_t* buffer, size_t maxLen);
+    bool ICACHE_FLASH_ATTR isReading();
+
+private:
+    bool ICACHE_FLASH_ATTR beginWrite();
+    void ICACHE_FLASH_ATTR endWrite();
+    bool ICACHE_FLASH_ATTR isReadAlive(unsigned long now);
+    bool ICACHE_FLASH_ATTR openRead(uint32_t& generation);
+    bool ICACHE_FLASH_ATTR continueRead(uint32_t generation);
+    void ICACHE_FLASH_ATTR closeRead(uint32_t generation);
+    bool ICACHE_FLASH_ATTR queue(const s_sessionRecord& record, bool append);
+    int ICACHE_FLASH_ATTR findPending(uint32_t sequence);
+    bool ICACHE_FLASH_ATTR store(s_sessionRecord& record);
+    bool ICACHE_FLASH_ATTR rewrite(s_sessionRecord& record);
+    bool ICACHE_FLASH_ATTR readStored(uint32_t sequence, s_sessionRecord& record);
+    uint32_t ICACHE_FLASH_ATTR getStoredLast();
+    bool ICACHE_FLASH_ATTR write(uint8_t index, s_sessionRecord& record);
+    bool ICACHE_FLASH_ATTR writeSegment(uint8_t index);
+    bool ICACHE_FLASH_ATTR writeIndex();
+    bool ICACHE_FLASH_ATTR scanSegment(uint8_t index);
+    bool ICACHE_FLASH_ATTR addTotal(uint32_t month, const s_sessionRecord& record, bool subtract = false);
+    bool ICACHE_FLASH_ATTR rebuildTotals(uint8_t index);
+    bool ICACHE_FLASH_ATTR nextTotal(s_totalsCursor& cursor, s_sessionTotal& total, uint32_t& month);
+    bool ICACHE_FLASH_ATTR prune();
+    int ICACHE_FLASH_ATTR findSegment(uint32_t sequence);
+    bool ICACHE_FLASH_ATTR isRelevant(uint8_t index, const s_sessionCursor& cursor);
+    bool ICACHE_FLASH_ATTR nextRecord(s_sessionCursor& cursor, s_sessionRecord& record);
+    static bool ICACHE_FLASH_ATTR matches(const s_sessionRecord& record, const s_sessionCursor& cursor);
+    static void ICACHE_FLASH_ATTR segmentName(uint32_t month, char* name);
+    static void ICACHE_FLASH_ATTR totalsName(uint32_t month, char* name);
+    static uint32_t ICACHE_FLASH_ATTR toMonth(uint32_t timestamp);
+    static uint32_t ICACHE_FLASH_ATTR userBit(const char* uid);
+    static uint32_t ICACHE_FLASH_ATTR crc32(const uint8_t* data, size_t length);
+    static uint32_t ICACHE_FLASH_ATTR checksum(const s_sessionRecord& record);
+    static uint32_t ICACHE_FLASH_ATTR checksum(const s_sessionSegment& segment);
+    static uint32_t ICACHE_FLASH_ATTR checksum(const s_sessionTotal& total);
+    static size_t ICACHE_FLASH_ATTR formatRecord(const s_sessionRecord& record, bool separator, char* line, size_t size);
+    static size_t ICACHE_FLASH_ATTR formatTotal(uint32_t month, const s_sessionTotal& total, bool separator, char* line, size_t size);
+    static size_t ICACHE_FLASH_ATTR escape(const char* text, char* line, size_t size);
+
+    s_sessionSegment segments[SESSIONLOG_SEGMENTS];
+    uint8_t segmentCount = 0;
+    s_sessionPending pending[SESSIONLOG_QUEUE];
+    uint8_t pendingCount = 0;
+    uint32_t nextSequence = 1;
+    s_sessionRecord latest;     // copy of the newest record, getLatest() needs no flash
+    bool hasLatest = false;
+    uint8_t writing = 0;                // writes of the main loop
+    uint8_t readers = 0;                // downloads open, several may be
+    uint32_t readGeneration = 0;
+    unsigned long millisRead = 0;       // last read of any open download
+};
+
+#endif /* SESSIONLOG_H_ */
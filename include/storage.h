@@ -0,0 +1,90 @@
+/*
+ * storage.h
+ *
+ * The one place that knows which filesystem holds config, users, logs and
+ * counters. The backend is chosen at build time: SPIFFS by default,
+ * LittleFS with -D STORAGE_LITTLEFS, and a directory of host files for
+ * the native build. Directory listing hides the differences between the
+ * cores and backends and always yields full paths.
+ *
+ * benchmark() times the operations the firmware relies on - open, read,
+ * append, rename, list and creating small files like /P/ users - so the
+ * backends can be compared on each board.
+ */
+
+#ifndef STORAGE_H_
+#define STORAGE_H_
+
+#include <Arduino.h>
+#if defined(STORAGE_LITTLEFS)
+#include <LittleFS.h>
+#define STORAGE_FS LittleFS
+#define STORAGE_NAME "LittleFS"
+#elif defined(ESP8266)
+#include <FS.h>
+#define STORAGE_FS SPIFFS
+#define STORAGE_NAME "SPIFFS"
+#elif defined(ESP32)
+#include <SPIFFS.h>
+#define STORAGE_FS SPIFFS
+#define STORAGE_NAME "SPIFFS"
+#else
+#include <FS.h>                     // bench/host
+#define STORAGE_FS HostFS
+#define STORAGE_NAME "host"
+#endif
+
+#define STORAGE_PATH 48
+#define STORAGE_BENCH_DIR "/bench"
+#define STORAGE_BENCH_FILES 20      // users in the listed directory
+#define STORAGE_BENCH_RUNS 20       // per operation
+
+struct s_storageDir {
+#ifdef ESP32
+    File dir;
+#else
+    Dir dir;
+#endif
+    char path[STORAGE_PATH];
+};
+
+enum StorageOperation {
+    STORAGE_OPEN,
+    STORAGE_READ,                   // 1 KB
+    STORAGE_APPEND,                 // 16 bytes, like the energy counter
+    STORAGE_RENAME,
+    STORAGE_LIST,                   // STORAGE_BENCH_FILES entries
+    STORAGE_CREATE,                 // 100 bytes, like a user file
+    STORAGE_OPERATIONS
+};
+
+struct s_storageTiming {
+    uint32_t average;               // us
+    uint32_t maximum;
+    uint8_t errors;
+};
+
+class EvseWiFiStorage {
+public:
+    bool ICACHE_FLASH_ATTR begin();
+    const char* ICACHE_FLASH_ATTR getName();
+    File ICACHE_FLASH_ATTR open(const char* path, const char* mode);
+    bool ICACHE_FLASH_ATTR exists(const char* path);
+    bool ICACHE_FLASH_ATTR remove(const char* path);
+    bool ICACHE_FLASH_ATTR rename(const char* from, const char* to);
+    size_t ICACHE_FLASH_ATTR getTotalBytes();
+    size_t ICACHE_FLASH_ATTR getUsedBytes();
+    size_t ICACHE_FLASH_ATTR getFreeBytes();
+    bool ICACHE_FLASH_ATTR openDir(const char* path, s_storageDir& dir);
+    bool ICACHE_FLASH_ATTR nextFile(s_storageDir& dir, char* path, size_t size);
+    fs::FS& ICACHE_FLASH_ATTR getFS();
+    void ICACHE_FLASH_ATTR benchmark(s_storageTiming* timings, unsigned long (*clock)() = micros);
+    static const char* ICACHE_FLASH_ATTR getOperationName(uint8_t operation);
+
+private:
+    void ICACHE_FLASH_ATTR getInfo(size_t& total, size_t& used);
+};
+
+extern EvseWiFiStorage storage;
+
+#endif /* STORAGE_H_ */
@@ -0,0 +1,74 @@
+/*
+ * timeseries.h
+ *
+ * Power, phase currents and voltages of the running charging session in
+ * fixed memory. Every meter poll is averaged into several tiers of
+ * growing period, each one a ring of its own - the fine tier covers the
+ * last minutes, the coarse one the whole session. Readers walk the rings
+ * by sequence number and get CSV a piece at a time, so the download never
+ * has to be built as one document.
+ */
+
+#ifndef TIMESERIES_H_
+#define TIMESERIES_H_
+
+#include <Arduino.h>
+
+#define SERIES_TIERS 3
+#define SERIES_VALUES 7             // power, currents P1..P3, voltages P1..P3
+#define SERIES_LINE 96
+
+// Fixed point: W, 0.01 A, 0.1 V
+struct s_seriesSample {
+    uint32_t time;                  // s since session start, start of the period
+    uint16_t values[SERIES_VALUES];
+};
+
+struct s_seriesTier {
+    uint16_t period;                // s
+    uint8_t capacity;
+    s_seriesSample* samples;
+    uint8_t head;
+    uint32_t total;                 // samples ever written, sequence of the next one
+    uint32_t periodStart;
+    uint16_t count;                 // polls in the running period
+    uint32_t sums[SERIES_VALUES];
+};
+
+// Position of a CSV download
+struct s_seriesCursor {
+    uint8_t tier;
+    uint8_t lastTier;
+    uint32_t sequence;
+    bool header;
+    char line[SERIES_LINE];
+    uint8_t lineLength;
+    uint8_t lineOffset;
+};
+
+class EvseWiFiTimeSeries {
+public:
+    void ICACHE_FLASH_ATTR begin();
+    void ICACHE_FLASH_ATTR start(uint32_t epoch);
+    void ICACHE_FLASH_ATTR stop();
+    void ICACHE_FLASH_ATTR add(float watts, float currentP1, float currentP2, float currentP3, float voltageP1, float voltageP2, float voltageP3);
+    bool ICACHE_FLASH_ATTR get(uint8_t tier, uint32_t sequence, s_seriesSample& sample);
+    uint32_t ICACHE_FLASH_ATTR getTotal(uint8_t tier);
+    uint16_t ICACHE_FLASH_ATTR getPeriod(uint8_t tier);
+    void ICACHE_FLASH_ATTR openCsv(s_seriesCursor& cursor, int tier);
+    size_t ICACHE_FLASH_ATTR readCsv(s_seriesCursor& cursor, uint8_t* buffer, size_t maxLen);
+
+private:
+    void ICACHE_FLASH_ATTR flush(s_seriesTier& tier);
+    uint32_t ICACHE_FLASH_ATTR getOldest(uint8_t tier);
+
+    s_seriesTier tiers[SERIES_TIERS];
+    s_seriesSample samples5s[60];   // 5 minutes
+    s_seriesSample samples1m[60];   // 1 hour
+    s_seriesSample samples15m[48];  // 12 hours
+    uint32_t epoch = 0;             // session start, 0 without NTP
+    unsigned long millisStart = 0;
+    bool running = false;
+};
+
+#endif /* TIMESERIES_H_ */
@@ -0,0 +1,221 @@
+/*
+ * userdb.h
+ *
+ * RFID users in one file of fixed-size records sorted by UID; a lookup is
+ * a binary search with a handful of reads. Changes do not rewrite that
+ * file: they are appended to a small log and kept in RAM, sorted as
+ * well, and merged into a new file by compact() - from the main loop when
+ * the bus is idle, soon after the log is full; until then further changes
+ * are refused. The new file only
+ * replaces the old one when it is complete, a power loss during the merge
+ * leaves the old file and the log.
+ *
+ * The one-file-per-UID users of /P/ of earlier versions are taken over by
+ * begin() and removed afterwards.
+ *
+ * getPage() lists the users a page at a time, filtered by the start of
+ * the UID or name. A page continues behind the last user of the previous
+ * one: in UID order it starts with a binary search, sorted by name or
+ * expiry one pass over the file picks the next users.
+ *
+ * Bulk import takes CSV or JSON Lines in pieces of any size, as they come
+ * in over HTTP. Parsed users are sorted in RAM a batch at a time and each
+ * full batch goes to a staging file as a sorted run. commitImport() merges
+ * the user file, the log and all runs into a new file in one pass, and
+ * only then puts it in place - an import goes in completely or not at all.
+ * Of the same UID the last line wins. Input already sorted by UID, like an
+ * export, counts as a single run.
+ *
+ * An export is read a piece at a time from the web server. While one is
+ * open the database is not written, so it sees one state from start to
+ * end; one that stops reading is dropped after USERDB_EXPORT_TIMEOUT.
+ */
+
+#ifndef USERDB_H_
+#define USERDB_H_
+
+#include <Arduino.h>
+#include <memory>
+#include "storage.h"
+
+#define USERDB_FILE "/users.bin"
+#define USERDB_TEMP "/users.tmp"
+#define USERDB_TEMP2 "/users.tm2"       // second merge target of an import
+#define USERDB_IMPORT "/users.imp"
+#define USERDB_LOG "/users.log"
+#define USERDB_LEGACY "/P"
+#ifdef ESP8266
+#define USERDB_CHANGES 16           // log entries, then the log is merged
+#else
+#define USERDB_CHANGES 64
+#endif
+#define USERDB_COMPACT_DELAY 60000  // ms without changes before a background merge
+#define USERDB_FULL_DELAY 1000      // ms after the change that filled the log, or a failed merge
+#define USERDB_PAGE 15              // users per page if the client asks for no size
+#ifdef ESP8266
+#define USERDB_PAGE_MAX 25
+#else
+#define USERDB_PAGE_MAX 100
+#endif
+#define USERDB_LINE 224
+#ifdef ESP8266
+#define USERDB_BATCH 32             // imported users sorted in RAM, one run of the staging file
+#define USERDB_RUNS 32              // runs merged per pass
+#else
+#define USERDB_BATCH 128
+#define USERDB_RUNS 64
+#endif
+#define USERDB_IMPORT_TIMEOUT 10000 // ms without data before an upload is dropped
+#define USERDB_EXPORT_TIMEOUT 10000 // ms without a read before an export is dropped
+
+enum UserFormat {
+    USER_FORMAT_CSV,        // uid,username,acctype,validuntil
+    USER_FORMAT_JSONL       // one user object per line, like the user list
+};
+
+enum UserSort {
+    USER_SORT_UID,
+    USER_SORT_NAME,
+    USER_SORT_EXPIRY
+};
+
+struct s_userRecord {
+    char uid[21];           // key, records are sorted by strcmp()
+    char user[50];
+    uint8_t acctype;        // 1 active, 99 admin, 0 disabled
+    uint8_t removed;        // log entries only
+    uint32_t validuntil;    // Unix time
+    uint32_t check;
+};
+
+// Merged walk over the file and the changes, in UID order
+struct s_userCursor {
+    File file;
+    uint32_t index;         // next record of the file
+    uint32_t count;
+    uint8_t change;         // next change
+    s_userRecord next;      // read from the file, not returned yet
+    bool hasNext;
+};
+
+struct s_userQuery {
+    uint8_t sort;           // UserSort
+    char filter[21];        // start of the UID or the name in any case, empty for all
+    uint8_t limit;          // 1..USERDB_PAGE_MAX
+    bool hasAfter;
+    s_userRecord after;     // last user of the previous page, uid, user and validuntil are used
+};
+
+struct s_userImport {
+    bool active;
+    File file;              // USERDB_IMPORT, runs of USERDB_BATCH users
+    std::unique_ptr<s_userRecord[]> batch;
+    uint16_t batchCount;
+    uint32_t staged;        // users in the file
+    bool writeFailed;       // the file misses users, the commit fails
+    uint32_t count;         // lines taken
+    uint32_t failed;        // lines that were no user
+    uint32_t lines;
+    bool sorted;            // every UID above the one before, the file is one run
+    char lastUid[21];
+    char line[USERDB_LINE];
+    uint16_t lineLength;
+    bool lineTooLong;
+    unsigned long millisData;
+};
+
+// A sorted run of the staging file during the merge
+struct s_userRun {
+    uint32_t next;          // record index in USERDB_IMPORT
+    uint32_t end;
+    s_userRecord head;
+    bool hasHead;
+};
+
+// What merge() lays over the user file: the changes or runs of an import
+struct s_userMerge {
+    const s_userRecord* batch;
+    uint16_t count;
+    uint16_t index;
+    File* staging;
+    s_userRun* runs;        // NULL for batch
+    uint8_t runCount;
+};
+
+struct s_userExport {
+    s_userCursor cursor;
+    uint32_t generation;    // of the export, a later one ends this one
+    uint8_t format;         // UserFormat
+    uint8_t part;           // 0 head, 1 users, 2 done
+    char line[USERDB_LINE];
+    uint16_t lineLength;
+    uint16_t lineOffset;
+};
+
+class EvseWiFiUserDb {
+public:
+    bool ICACHE_FLASH_ATTR begin();
+    bool ICACHE_FLASH_ATTR find(const char* uid, s_userRecord& record);
+    bool ICACHE_FLASH_ATTR put(const char* uid, const char* user, uint8_t acctype, uint32_t validuntil);
+    bool ICACHE_FLASH_ATTR remove(const char* uid);
+    bool ICACHE_FLASH_ATTR clear();
+    bool ICACHE_FLASH_ATTR isCompactionDue();
+    bool ICACHE_FLASH_ATTR isLogFull();
+    bool ICACHE_FLASH_ATTR compact();
+    void ICACHE_FLASH_ATTR openList(s_userCursor& cursor, const char* after = NULL);
+    bool ICACHE_FLASH_ATTR nextUser(s_userCursor& cursor, s_userRecord& record);
+    uint8_t ICACHE_FLASH_ATTR getPage(const s_userQuery& query, s_userRecord* page, bool& more);
+    static size_t ICACHE_FLASH_ATTR formatUser(const s_userRecord& record, bool separator, char* line, size_t size);
+    bool ICACHE_FLASH_ATTR beginImport();
+    void ICACHE_FLASH_ATTR importData(const uint8_t* data, size_t len);
+    bool ICACHE_FLASH_ATTR commitImport();
+    void ICACHE_FLASH_ATTR abortImport();
+    bool ICACHE_FLASH_ATTR isImporting();
+    bool ICACHE_FLASH_ATTR isImportStalled();
+    uint32_t ICACHE_FLASH_ATTR getImportCount();
+    uint32_t ICACHE_FLASH_ATTR getImportFailed();
+    bool ICACHE_FLASH_ATTR openExport(s_userExport& cursor, uint8_t format);
+    size_t ICACHE_FLASH_ATTR readExport(s_userExport& cursor, uint8_t* buffer, size_t maxLen);
+    bool ICACHE_FLASH_ATTR isExporting();
+
+private:
+    bool ICACHE_FLASH_ATTR beginWrite();
+    void ICACHE_FLASH_ATTR endWrite();
+    bool ICACHE_FLASH_ATTR isExportAlive(unsigned long now);
+    bool ICACHE_FLASH_ATTR change(s_userRecord& record, bool log);
+    bool ICACHE_FLASH_ATTR addChange(const s_userRecord& record);
+    int ICACHE_FLASH_ATTR findChange(const char* uid);
+    bool ICACHE_FLASH_ATTR readLog();
+    bool ICACHE_FLASH_ATTR migrate();
+    bool ICACHE_FLASH_ATTR merge(const char* source, const char* target, s_userMerge& changes);
+    bool ICACHE_FLASH_ATTR nextChange(s_userMerge& changes, s_userRecord& record);
+    bool ICACHE_FLASH_ATTR replace(const char* name);
+    bool ICACHE_FLASH_ATTR mergeImport();
+    void ICACHE_FLASH_ATTR importLine();
+    bool ICACHE_FLASH_ATTR stage(const s_userRecord& record);
+    bool ICACHE_FLASH_ATTR flushBatch();
+    static bool ICACHE_FLASH_ATTR parseCsv(char* line, s_userRecord& record);
+    static bool ICACHE_FLASH_ATTR parseJson(const char* line, s_userRecord& record);
+    static size_t ICACHE_FLASH_ATTR formatCsv(const s_userRecord& record, char* line, size_t size);
+    static size_t ICACHE_FLASH_ATTR quote(const char* text, char* line, size_t size);
+    static bool ICACHE_FLASH_ATTR makeRecord(s_userRecord& record, const char* uid, const char* user, uint8_t acctype, uint32_t validuntil);
+    static bool ICACHE_FLASH_ATTR readRecord(File& file, uint32_t index, s_userRecord& record);
+    static uint32_t ICACHE_FLASH_ATTR checksum(const s_userRecord& record);
+    static int ICACHE_FLASH_ATTR compare(const s_userRecord& a, const s_userRecord& b, uint8_t sort);
+    static bool ICACHE_FLASH_ATTR matches(const s_userRecord& record, const char* filter);
+    static size_t ICACHE_FLASH_ATTR escape(const char* text, char* line, size_t size);
+
+    s_userRecord changes[USERDB_CHANGES];
+    uint8_t changeCount = 0;
+    uint8_t logCount = 0;               // entries in USERDB_LOG, more than changes if a UID changed twice
+    unsigned long millisChanged = 0;
+    s_userImport upload;
+    uint8_t writing = 0;                // nested writes of the main loop
+    bool exportOpen = false;
+    uint32_t exportGeneration = 0;
+    unsigned long millisExport = 0;     // last read of the open export
+};
+
+extern EvseWiFiUserDb userDb;
+
+#endif /* USERDB_H_ */
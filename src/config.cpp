@@ -14,7 +14,7 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::loadConfig(String givenConfig) {
     }
     else {
         Serial.println("loadConfig: no config string given -> check config file");
-        File configFile = SPIFFS.open("/config.json", "r");
+        File configFile = storage.open("/config.json", "r");
         #ifdef ESP8266
         if (!configFile) {
             Serial.println("loading config file failed");
@@ -37,7 +37,7 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::loadConfig(String givenConfig) {
         }
     }
 
-    DynamicJsonDocument jsonDoc(2000);
+    DynamicJsonDocument jsonDoc(2500);
     DeserializationError error = deserializeJson(jsonDoc, jsonString);
     if (error) {
         Serial.println("parsing config file failed");
@@ -79,6 +79,7 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::loadConfig(String givenConfig) {
     rfidConfig.userfid = jsonDoc["rfid"]["userfid"];
     rfidConfig.sspin = jsonDoc["rfid"]["sspin"];
     rfidConfig.rfidgain = jsonDoc["rfid"]["rfidgain"];
+    rfidConfig.irqpin = jsonDoc["rfid"]["irqpin"] | -1;
     Serial.println("RFID loaded");
 
     // ntpConfig
@@ -103,7 +104,6 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::loadConfig(String givenConfig) {
     systemConfig.wsauth = jsonDoc["system"]["wsauth"];
     systemConfig.debug = jsonDoc["system"]["debug"];
     systemConfig.maxinstall = jsonDoc["system"]["maxinstall"];
-    systemConfig.evsecount = jsonDoc["system"]["evsecount"];
     systemConfig.configversion = jsonDoc["configversion"];
     if (jsonDoc["system"].containsKey("logging")) {
         systemConfig.logging = jsonDoc["system"]["logging"];
@@ -119,47 +119,81 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::loadConfig(String givenConfig) {
     }
     Serial.println("SYSTEM loaded");
 
-   // evseConfig
-    evseConfig[0].mbid = 1;
-    evseConfig[0].alwaysactive = jsonDoc["evse"][0]["alwaysactive"];
-    
-    //evseConfig[0].ledconfig = jsonDoc["evse"][0]["ledconfig"];
+    // evseConfig
+    JsonArray evseArray = jsonDoc["evse"];
+    systemConfig.evsecount = constrain(evseArray.size(), (size_t)1, (size_t)EVSE_MAX_COUNT);
+    if (jsonDoc["system"].containsKey("evsecount")) {
+        uint8_t evsecount = jsonDoc["system"]["evsecount"];
+        systemConfig.evsecount = constrain(evsecount, (uint8_t)1, systemConfig.evsecount);
+    }
+    // Slave ids are unique on the bus and must not take the meter's id, which
+    // also routes Modbus TCP requests - the first EVSE is kept regardless
+    bool modbusMeter = meterConfig[0].usemeter && String(meterConfig[0].metertype).startsWith("SDM");
+    uint8_t evseItems = systemConfig.evsecount;
+    systemConfig.evsecount = 0;
+    for (uint8_t i = 0; i < evseItems; i++) {
+        JsonObject evseItem = evseArray[i];
+        uint8_t n = systemConfig.evsecount;
+        if (evseItem.containsKey("mbid")) {
+            evseConfig[n].mbid = evseItem["mbid"];
+        }
+        else {
+            evseConfig[n].mbid = i + 1 < SDM_MBID ? i + 1 : i + 2;
+        }
+        if (n > 0) {
+            bool clash = modbusMeter && evseConfig[n].mbid == SDM_MBID;
+            for (uint8_t j = 0; j < n; j++) {
+                clash |= evseConfig[j].mbid == evseConfig[n].mbid;
+            }
+            if (clash) {
+                Serial.println("EVSE " + String(i) + " skipped, Modbus id " + String(evseConfig[n].mbid) + " already in use");
+                continue;
+            }
+        }
+        else if (modbusMeter && evseConfig[n].mbid == SDM_MBID) {
+            Serial.println("EVSE 0 shares Modbus id " + String(SDM_MBID) + " with the meter");
+        }
+        evseConfig[n].alwaysactive = evseItem["alwaysactive"];
+
+        //evseConfig[i].ledconfig = evseItem["ledconfig"];
 
-    evseConfig[0].resetcurrentaftercharge = jsonDoc["evse"][0]["resetcurrentaftercharge"];
-    evseConfig[0].maxcurrent =  jsonDoc["evse"][0]["maxinstall"];
-    evseConfig[0].avgconsumption = jsonDoc["evse"][0]["avgconsumption"];
+        evseConfig[n].resetcurrentaftercharge = evseItem["resetcurrentaftercharge"];
+        evseConfig[n].maxcurrent =  evseItem["maxinstall"];
+        evseConfig[n].avgconsumption = evseItem["avgconsumption"];
 
-    if (jsonDoc["evse"][0].containsKey("disableled")) {
-        bool disableled = jsonDoc["evse"][0]["disableled"];
-        Serial.println(disableled);
-        if (disableled == true) {
-            evseConfig[0].ledconfig = 1;
+        if (evseItem.containsKey("disableled")) {
+            bool disableled = evseItem["disableled"];
+            Serial.println(disableled);
+            if (disableled == true) {
+                evseConfig[n].ledconfig = 1;
+            }
+            else {
+                evseConfig[n].ledconfig = 3;
+            }
         }
-        else {
-            evseConfig[0].ledconfig = 3;
+        else{
+            evseConfig[n].ledconfig = evseItem["ledconfig"];
         }
-    }
-    else{
-        evseConfig[0].ledconfig = jsonDoc["evse"][0]["ledconfig"];
-    }
 
-    if (jsonDoc["evse"][0].containsKey("rsevalue")) {
-        evseConfig[0].rseValue = jsonDoc["evse"][0]["rsevalue"];
-    }
-    else {
-        evseConfig[0].rseValue = 100;
-    }
-    if (jsonDoc["evse"][0].containsKey("rseactive")) {
-        evseConfig[0].rseActive = jsonDoc["evse"][0]["rseactive"];
-    }
-    else {
-        evseConfig[0].rseActive = false;
-    }
-    if (jsonDoc["evse"][0].containsKey("remote")) {
-        evseConfig[0].remote = jsonDoc["evse"][0]["remote"];
-    }
-    else {
-        evseConfig[0].remote = false;
+        if (evseItem.containsKey("rsevalue")) {
+            evseConfig[n].rseValue = evseItem["rsevalue"];
+        }
+        else {
+            evseConfig[n].rseValue = 100;
+        }
+        if (evseItem.containsKey("rseactive")) {
+            evseConfig[n].rseActive = evseItem["rseactive"];
+        }
+        else {
+            evseConfig[n].rseActive = false;
+        }
+        if (evseItem.containsKey("remote")) {
+            evseConfig[n].remote = evseItem["remote"];
+        }
+        else {
+            evseConfig[n].remote = false;
+        }
+        systemConfig.evsecount++;
     }
     Serial.println("EVSE loaded");
     Serial.println("loadConfig.. Check!");
@@ -178,21 +212,15 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::loadConfiguration() {
             useSMeter = true;
             Serial.println("Use S0");
         }
-        else if (type == "SDM120") {
-            mMeterTypeSDM120 = true;
-            useMMeter = true;
-            Serial.println("Use SDM120");
-        }
-        else if (type == "SDM630") {
-            mMeterTypeSDM630 = true;
+        else if (type.startsWith("SDM")) {   // SDM120, SDM220, SDM630, SDM72
             useMMeter = true;
-            Serial.println("Use SDM630");
+            Serial.println("Use " + type);
         }
     }
     return true;
 }
 bool ICACHE_FLASH_ATTR EvseWiFiConfig::printConfigFile() {
-    File configFile = SPIFFS.open("/config.json", "r");
+    File configFile = storage.open("/config.json", "r");
     if (!configFile) {
         return false;
     }
@@ -236,6 +264,7 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::printConfig() {
     Serial.println("userfid: " + String(getRfidActive()));
     Serial.println("sspin: " + String(getRfidPin()));
     Serial.println("rfidgain: " + String(getRfidGain()));
+    Serial.println("irqpin: " + String(getRfidIrqPin()));
     Serial.println();
     Serial.println("// NTP Config");
     Serial.println("timezone: " + String(getNtpTimezone()));
@@ -256,16 +285,18 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::printConfig() {
     Serial.println("logging: " + String(getSystemLogging()));
     Serial.println("api: " + String(getSystemApi()));
     Serial.println("configversion: " + String(getSystemConfigVersion()));
-    Serial.println("// EVSE Config");
-    Serial.println("mbid: " + String(getEvseMbid(0)));
-    Serial.println("alwaysactive: " + String(getEvseAlwaysActive(0)));
-    Serial.println("remote: " + String(getEvseRemote(0)));
-    Serial.println("ledconfig: " + String(getEvseLedConfig(0)));
-    Serial.println("resetcurrentaftercharge: " + String(getEvseResetCurrentAfterCharge(0)));
-    Serial.println("evseinstall: " + String(getEvseMaxCurrent(0)));
-    Serial.println("avgconsumption: " + String(getEvseAvgConsumption(0)));
-    Serial.println("rseactive: " + String(getEvseRseActive(0)));
-    Serial.println("rsevalue: " + String(getEvseRseValue(0)));
+    for (uint8_t i = 0; i < getSystemEvseCount(); i++) {
+        Serial.println("// EVSE Config " + String(i));
+        Serial.println("mbid: " + String(getEvseMbid(i)));
+        Serial.println("alwaysactive: " + String(getEvseAlwaysActive(i)));
+        Serial.println("remote: " + String(getEvseRemote(i)));
+        Serial.println("ledconfig: " + String(getEvseLedConfig(i)));
+        Serial.println("resetcurrentaftercharge: " + String(getEvseResetCurrentAfterCharge(i)));
+        Serial.println("evseinstall: " + String(getEvseMaxCurrent(i)));
+        Serial.println("avgconsumption: " + String(getEvseAvgConsumption(i)));
+        Serial.println("rseactive: " + String(getEvseRseActive(i)));
+        Serial.println("rsevalue: " + String(getEvseRseValue(i)));
+    }
     Serial.println("--- End of Config...");
     return true;
 }
@@ -285,7 +316,7 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::renewConfigFile() {
     return false;
 }
 String ICACHE_FLASH_ATTR EvseWiFiConfig::getConfigJson() {
-    DynamicJsonDocument rootDoc(2000);
+    DynamicJsonDocument rootDoc(2500);
     rootDoc["configversion"] = ACTUAL_CONFIG_VERSION;
     #ifdef ESP8266
     rootDoc["hardwarerev"] = "ESP8266";
@@ -327,6 +358,7 @@ String ICACHE_FLASH_ATTR EvseWiFiConfig::getConfigJson() {
     rfidItem["userfid"] = this->getRfidActive();
     rfidItem["sspin"] = this->getRfidPin();
     rfidItem["rfidgain"] = this->getRfidGain();
+    rfidItem["irqpin"] = this->getRfidIrqPin();
 
     JsonObject ntpItem = rootDoc.createNestedObject("ntp");
     ntpItem["timezone"] = this->getNtpTimezone();
@@ -349,22 +381,49 @@ String ICACHE_FLASH_ATTR EvseWiFiConfig::getConfigJson() {
     systemItem["api"] = this->getSystemApi();
 
     JsonArray evseArray = rootDoc.createNestedArray("evse");
-    JsonObject evseObject_0 = evseArray.createNestedObject();
-    evseObject_0["mbid"] = this->getEvseMbid(0);
-    evseObject_0["alwaysactive"] = this->getEvseAlwaysActive(0);
-    evseObject_0["remote"] = this->getEvseRemote(0);
-    evseObject_0["ledconfig"] = this->getEvseLedConfig(0);
-    evseObject_0["resetcurrentaftercharge"] = this->getEvseResetCurrentAfterCharge(0);
-    evseObject_0["evseinstall"] = this->getEvseMaxCurrent(0);
-    evseObject_0["avgconsumption"] = this->getEvseAvgConsumption(0);
-    evseObject_0["rseactive"] = this->getEvseRseActive(0);
-    evseObject_0["rsevalue"] = this->getEvseRseValue(0);
+    for (uint8_t i = 0; i < this->getSystemEvseCount(); i++) {
+        evseConfigToJson(evseArray.createNestedObject(), i);
+    }
     
     String sReturn;
     serializeJsonPretty(rootDoc, sReturn);
     return sReturn;
 }
+void ICACHE_FLASH_ATTR EvseWiFiConfig::evseConfigToJson(JsonObject item, uint8_t evseId) {
+    item["mbid"] = this->getEvseMbid(evseId);
+    item["alwaysactive"] = this->getEvseAlwaysActive(evseId);
+    item["remote"] = this->getEvseRemote(evseId);
+    item["ledconfig"] = this->getEvseLedConfig(evseId);
+    item["resetcurrentaftercharge"] = this->getEvseResetCurrentAfterCharge(evseId);
+    item["evseinstall"] = this->getEvseMaxCurrent(evseId);
+    item["avgconsumption"] = this->getEvseAvgConsumption(evseId);
+    item["rseactive"] = this->getEvseRseActive(evseId);
+    item["rsevalue"] = this->getEvseRseValue(evseId);
+}
+// The web UI only edits the first EVSE - carry the others over
+String ICACHE_FLASH_ATTR EvseWiFiConfig::keepEvseConfig(String jsonConfig) {
+    if (getSystemEvseCount() <= 1) {
+        return jsonConfig;
+    }
+    DynamicJsonDocument jsonDoc(2500);
+    DeserializationError error = deserializeJson(jsonDoc, jsonConfig);
+    if (error) {
+        return jsonConfig;
+    }
+    JsonArray evseArray = jsonDoc["evse"];
+    if (evseArray.size() != 1) {
+        return jsonConfig;
+    }
+    for (uint8_t i = 1; i < getSystemEvseCount(); i++) {
+        evseConfigToJson(evseArray.createNestedObject(), i);
+    }
+    jsonDoc["system"]["evsecount"] = getSystemEvseCount();
+    String sReturn;
+    serializeJson(jsonDoc, sReturn);
+    return sReturn;
+}
 bool ICACHE_FLASH_ATTR EvseWiFiConfig::updateConfig(String jsonConfig) {
+    jsonConfig = keepEvseConfig(jsonConfig);
     if(loadConfig(jsonConfig)) {
         if (saveConfigFile(jsonConfig)) {
             return true;
@@ -373,11 +432,11 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::updateConfig(String jsonConfig) {
     return false;
 }
 bool ICACHE_FLASH_ATTR EvseWiFiConfig::saveConfigFile(String jsonConfig) {
-    DynamicJsonDocument jsonDoc(1800);
+    DynamicJsonDocument jsonDoc(2500);
     DeserializationError error = deserializeJson(jsonDoc, jsonConfig);
     if (error) return false;
 
-    File configFile = SPIFFS.open("/config.json", "w+");
+    File configFile = storage.open("/config.json", "w+");
     if (configFile) {
         if (jsonDoc.containsKey("command")) {
             jsonDoc.remove("command");
@@ -386,7 +445,7 @@ bool ICACHE_FLASH_ATTR EvseWiFiConfig::saveConfigFile(String jsonConfig) {
         configFile.close();
 
         //Check config file exists
-        configFile = SPIFFS.open("/config.json", "r");
+        configFile = storage.open("/config.json", "r");
         if (configFile) {
             if (systemConfig.debug) {
                 Serial.println("[ SYSTEM ] New config file created:");
@@ -504,6 +563,10 @@ int8_t ICACHE_FLASH_ATTR EvseWiFiConfig::getRfidGain() {
     return 112;
 }
 
+int8_t ICACHE_FLASH_ATTR EvseWiFiConfig::getRfidIrqPin() {
+    return rfidConfig.irqpin;
+}
+
 // ntpConfig getter/setter
 int8_t ICACHE_FLASH_ATTR EvseWiFiConfig::getNtpTimezone() {
     return ntpConfig.timezone;
@@ -549,6 +612,7 @@ uint8_t ICACHE_FLASH_ATTR EvseWiFiConfig::getSystemMaxInstall() {
     return 10;
 }
 uint8_t ICACHE_FLASH_ATTR EvseWiFiConfig::getSystemEvseCount() {
+    if (systemConfig.evsecount) return systemConfig.evsecount;
     return 1;
 }
 bool ICACHE_FLASH_ATTR EvseWiFiConfig::getSystemLogging() {
@@ -585,7 +649,7 @@ uint8_t ICACHE_FLASH_ATTR EvseWiFiConfig::getEvseMaxCurrent(uint8_t evseId) {
     return evseConfig[evseId].maxcurrent;
 }
 float ICACHE_FLASH_ATTR EvseWiFiConfig::getEvseAvgConsumption(uint8_t evseId) {
-    if (evseConfig[evseId].avgconsumption) return evseConfig[0].avgconsumption;
+    if (evseConfig[evseId].avgconsumption) return evseConfig[evseId].avgconsumption;
     return 15.0;
 }
 uint8_t ICACHE_FLASH_ATTR EvseWiFiConfig::getEvseCpIntPin(uint8_t evseId) {
@@ -0,0 +1,107 @@
+#include "energy.h"
+
+// Returns false when there is no record yet
+bool ICACHE_FLASH_ATTR EvseWiFiEnergyCounter::begin() {
+  s_energyRecord record;
+  bool clean = true;
+  bool found = readLast(ENERGY_FILE, record, clean);
+  if (!clean) {
+    records = ENERGY_RECORDS_PER_FILE;  // do not append behind a torn record, rotate first
+  }
+  if (!found) {
+    bool cleanOld;
+    found = readLast(ENERGY_FILE_OLD, record, cleanOld);
+  }
+  if (!found) {
+    wattHours = 0;
+    sequence = 0;
+    return false;
+  }
+  wattHours = record.wattHours;
+  sequence = record.sequence;
+  return true;
+}
+
+uint32_t ICACHE_FLASH_ATTR EvseWiFiEnergyCounter::getWattHours() {
+  return wattHours;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiEnergyCounter::save(uint32_t wattHours) {
+  if (wattHours == this->wattHours && sequence > 0) {
+    return true;
+  }
+  if (records >= ENERGY_RECORDS_PER_FILE) {
+    storage.remove(ENERGY_FILE_OLD);
+    storage.rename(ENERGY_FILE, ENERGY_FILE_OLD);
+    records = 0;
+  }
+  s_energyRecord record;
+  record.sequence = sequence + 1;
+  record.wattHours = wattHours;
+  record.check = checksum(record);
+
+  File file = storage.open(ENERGY_FILE, "a");
+  if (!file) {
+    return false;
+  }
+  size_t written = file.write((const uint8_t*)&record, sizeof(record));
+  file.close();
+  if (written != sizeof(record)) {
+    records = ENERGY_RECORDS_PER_FILE;
+    return false;
+  }
+  records++;
+  sequence = record.sequence;
+  this->wattHours = wattHours;
+  return true;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiEnergyCounter::reset() {
+  storage.remove(ENERGY_FILE);
+  storage.remove(ENERGY_FILE_OLD);
+  wattHours = 0;
+  sequence = 0;
+  records = 0;
+}
+
+// Only the tail of the file is read, boot time does not grow with the file
+bool ICACHE_FLASH_ATTR EvseWiFiEnergyCounter::readLast(const char* path, s_energyRecord& record, bool& clean) {
+  clean = true;
+  if (!storage.exists(path)) {
+    return false;
+  }
+  File file = storage.open(path, "r");
+  if (!file) {
+    return false;
+  }
+  size_t size = file.size();
+  size_t count = size / sizeof(s_energyRecord);
+  if (strcmp(path, ENERGY_FILE) == 0) {
+    records = count;
+  }
+  clean = (size % sizeof(s_energyRecord)) == 0;
+  bool found = false;
+  while (count > 0 && !found) {
+    count--;
+    file.seek(count * sizeof(s_energyRecord));
+    found = file.read((uint8_t*)&record, sizeof(record)) == sizeof(record) && record.check == checksum(record);
+    if (!found) {
+      clean = false;
+    }
+  }
+  file.close();
+  return found;
+}
+
+// CRC-32 of sequence and value
+uint32_t ICACHE_FLASH_ATTR EvseWiFiEnergyCounter::checksum(const s_energyRecord& record) {
+  const uint8_t* data = (const uint8_t*)&record;
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < offsetof(s_energyRecord, check); i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+  }
+  return ~crc;
+}
@@ -17,17 +17,14 @@
 #include <ESP8266WiFi.h>              // Whole thing is about using Wi-Fi networks
 #include <ESP8266mDNS.h>              // Zero-config Library (Bonjour, Avahi)
 #include <ESPAsyncTCP.h>              // Async TCP Library is mandatory for Async Web Server
-#include <FS.h>                       // SPIFFS Library for storing web files to serve to web browsers
 #include <WiFiUdp.h>                  // Library for manipulating UDP packets which is used by NTP Client to get Timestamps
 
 #else
 #include <WiFi.h>
 #include <ESPmDNS.h>
-#include <SPIFFS.h>
 #include "Update.h"
 #include "esp_err.h"
 #include "esp_log.h"
-#include "esp_spiffs.h"
 #include "esp_wifi.h"
 #include "oled.h"
 
@@ -51,9 +48,18 @@ uint8_t temprature_sens_read();
 #include <ESPAsyncWebServer.h>        // Async Web Server with built-in WebSocket Plug-in
 #include <SPIFFSEditor.h>             // This creates a web page on server which can be used to edit text based files
 #include <SoftwareSerial.h>           // Using GPIOs for Serial Modbus communication
-#include <ModbusMaster.h>
 
 #include <string.h>
+#include "modbus.h"
+#include "regcache.h"
+#include "sdm.h"
+#include "modbustcp.h"
+#include "s0meter.h"
+#include "storage.h"
+#include "userdb.h"
+#include "energy.h"
+#include "timeseries.h"
+#include "sessionlog.h"
 #include "proto.h"
 #include "ntp.h"
 #include "websrc.h"
@@ -72,21 +78,12 @@ String swVersion = "2.0.1";
 ///////       Variables For Whole Scope
 //////////////////////////////////////////////////////////////////////////////////////////
 //EVSE Variables
-unsigned long millisStartCharging = 0;
-unsigned long millisStopCharging = 0;
-bool manualStop = false;
-uint8_t currentToSet = 6;
-uint8_t evseStatus = 0;
 bool evseSessionTimeOut = false;
-bool evseActive = false;
-bool vehicleCharging = false;
 int buttonState = HIGH;
 int prevButtonState = HIGH;
 AsyncWebParameter* awp;
 AsyncWebParameter* awp2;
-const char * initLog = "{\"type\":\"latestlog\",\"list\":[]}";
 bool sliderStatus = true;
-uint8_t evseErrorCount = 0;
 
 #ifndef ESP8266
 unsigned long millisInterruptCp = 0;
@@ -99,54 +96,70 @@ uint8_t currentBeforeRse = 0;
 bool showLedRfidDecline = false;
 bool showLedRfidGrant = false;
 unsigned long millisRfidLedAction = 0;
-unsigned long millisRfidReset = 0;
 
 //Metering
-float meterReading = 0.0;
-float meteredKWh = 0.0;
+int64_t meterReadingWh = 0;     // energy is kept in integer Wh, kWh only at the JSON boundary
+int64_t meteredWh = 0;
 float currentKW = 0.0;
 
 //Metering S0
-uint8_t meterTimeout = 10; //sec
-volatile unsigned long numberOfMeterImps = 0;
-unsigned long meterImpMillis = 0;
-unsigned long previousMeterMillis = 0;
-volatile uint8_t meterInterrupt = 0;
+EvseWiFiS0Meter s0Meter;
+EvseWiFiEnergyCounter energyCounter;  // lifetime S0 energy, startTotalWh of every session
+unsigned long millisSaveEnergy = 0;
+int64_t energyToSave = -1;      // queued for the write-behind in loop(), -1 = nothing
 
 //Metering Modbus
 unsigned long millisUpdateMMeter = 0;
 unsigned long millisUpdateSMeter = 0;
-bool mMeterTypeSDM120 = false;
-bool mMeterTypeSDM630 = false;
-float startTotal;
+int64_t startTotalWh = 0;
+bool sessionMetered = false;     // session energy not yet taken over by closeMeteredSession()
 float currentP1 = 0.0;
 float currentP2 = 0.0;
 float currentP3 = 0.0;
 float voltageP1 = 0.0;
 float voltageP2 = 0.0;
 float voltageP3 = 0.0;
+EvseWiFiTimeSeries timeSeries;  // power, currents and voltages of the latest session
+EvseWiFiSessionLog sessionLog;  // ring of fixed-size records in /sessions.bin
 
 //objects and instances
 #ifdef ESP8266
+#define EVSE_SOFTWARE_SERIAL    // no spare UART with RX on ESP8266
 SoftwareSerial SoftSer(D1, D2); //SoftwareSerial object (RX, TX)
 #else
+#ifdef EVSE_SOFTWARE_SERIAL
 SoftwareSerial SoftSer(22, 21); //SoftwareSerial object (RX, TX)
 //SoftwareSerial SoftSer(32, 27); //SoftwareSerial object (RX, TX)
+#else
+HardwareSerial SoftSer(2);      //UART2 on RX 22, TX 21 - interrupt driven RX buffer, keeps running during flash access
+#endif
 //oLED
 unsigned long millisUpdateOled = 0;
 U8G2_SSD1327_WS_128X128_F_4W_HW_SPI u8g2(U8G2_R0, /* cs=*/ 12, /* dc=*/ 13, /* reset=*/ 33);
 EvseWiFiOled oled;
 #endif
 
-ModbusMaster evseNode;
-ModbusMaster meterNode;
+EvseWiFiModbus evseBus;
+#ifdef ESP8266
+EvseWiFiModbus meterBus;      // Meter is connected to the hardware serial on ESP8266
+#else
+EvseWiFiModbus& meterBus = evseBus;
+#endif
+EvseWiFiSdmMeter sdmMeter;
+EvseWiFiModbusTcp modbusTcp;  // Modbus TCP server on port 502, answers from the register cache
+#define EVSE_BLOCK_STATUS 0       // registers 1000..1007
+#define EVSE_BLOCK_CONFIG 1       // registers 2000..2017
+#define EVSE_STATUS_MAX_AGE 3000  // ms
+#define EVSE_CONFIG_MAX_AGE 60000 // ms
+#define EVSE_POLL_FAST 1000       // ms, right after state changes and commands
+#define EVSE_POLL_IDLE 10000      // ms, no vehicle connected
+#define EVSE_FAST_POLL_TIME 15000 // ms to stay on the fast cadence after a change
 AsyncWebServer server(80);    // Create AsyncWebServer instance on port "80"
 AsyncWebSocket ws("/ws");     // Create WebSocket instance on URL "/ws"
 NtpClient ntp;
 EvseWiFiConfig config = EvseWiFiConfig();
 EvseWiFiRfid rfid;
 
-unsigned long lastModbusAction = 0;
 unsigned long evseQueryTimeOut = 0;
 unsigned long buttonTimer = 0;
 
@@ -156,30 +169,85 @@ unsigned long previousMillis = 0;
 unsigned long previousLoopMillis = 0;
 unsigned long previousLedAction = 0;
 unsigned long reconnectTimer = 0;
+unsigned long maxLoopMicros = 0;
 uint16_t toChangeLedOnTime = 0;
 uint16_t toChangeLedOffTime = 0;
 uint16_t ledOnTime = 100;
 uint16_t ledOffTime = 4000;
 bool wifiInterrupted = false;
 bool ledStatus = false;
-bool toSetEVSEcurrent = false;
-bool toActivateEVSE = false;
-bool toDeactivateEVSE = false;
+// EVSE commands - one write at a time per EVSE, each confirmed by reading it back
+enum EvseCommand {
+  EVSE_CMD_NONE,
+  EVSE_CMD_ACTIVATE,
+  EVSE_CMD_DEACTIVATE,
+  EVSE_CMD_CURRENT
+};
+#define EVSE_CURRENT_INTERVAL 1000    // ms between two writes of register 1000
+#define EVSE_CONFIRM_TIMEOUT 5000     // ms to read back a written value
 bool toSendStatus = false;
 bool toReboot = false;
 bool updateRunning = false;
 bool fsWorking = false;
-
-//EVSE Modbus Registers
-uint16_t evseAmpsConfig;     //Register 1000
-uint16_t evseAmpsOutput;     //Register 1001
-uint16_t evseVehicleState;  //Register 1002
-uint16_t evseAmpsPP;         //Register 1003
-uint16_t evseTurnOff;        //Register 1004
-uint16_t evseFirmware;       //Register 1005
-uint16_t evseEvseState;          //Register 1006
-uint16_t evseRcdStatus;          //Register 1007
-uint16_t evseAmpsAfterboot; 
+bool toBenchStorage = false;
+bool toCommitImport = false;
+AsyncWebServerRequest* importRequest = NULL;    // the upload the staged users belong to
+bool toResetUserData = false;
+bool toFactoryReset = false;
+bool toInitLog = false;
+bool storageBenched = false;
+s_storageTiming storageTimings[STORAGE_OPERATIONS];
+
+//User changes of the WebSocket, applied by loop() - the handlers run in
+//network context (ESP8266) or on the network task (ESP32)
+#define USER_CHANGE_QUEUE 4                     // power of two
+s_userRecord userChanges[USER_CHANGE_QUEUE];    // removed set for a removal
+volatile uint8_t userChangeHead = 0;            // written by the handlers only
+volatile uint8_t userChangeTail = 0;            // written by loop() only
+
+//User list page asked for over the WebSocket, built by loop() as well
+s_userQuery userListQuery;
+uint32_t userListClient = 0;
+volatile bool toSendUserList = false;
+
+//Session log page asked for over the WebSocket, read by loop() as well
+s_sessionQuery latestLogQuery;
+uint32_t latestLogClient = 0;
+volatile bool toSendLatestLog = false;
+
+//EVSE runtime state, indexed like the evse config - RFID, button, LED and
+//metering belong to the first EVSE
+struct s_evse {
+  EvseWiFiRegisterCache registers;
+  uint16_t ampsConfig;          //Register 1000
+  uint16_t ampsOutput;          //Register 1001
+  uint16_t vehicleState;        //Register 1002
+  uint16_t ampsPP;              //Register 1003
+  uint16_t turnOff;             //Register 1004
+  uint16_t firmware;            //Register 1005
+  uint16_t evseState;           //Register 1006
+  uint16_t ampsAfterboot;       //Register 2000
+  uint8_t status;
+  uint8_t errorCount;
+  bool active;
+  bool vehicleCharging;
+  bool manualStop;
+  unsigned long millisStartCharging;
+  unsigned long millisStopCharging;
+  unsigned long millisFastPoll;
+  uint8_t command;              // pending (de)activation, the latest request wins
+  uint8_t commandInFlight;
+  bool commandWritten;          // waiting for the read-back
+  uint16_t commandValue;
+  bool toSetCurrent;
+  uint8_t currentToSet;         // latest requested current
+  bool logUpdate;
+  unsigned long millisRetry;
+  unsigned long millisCommandDeadline;
+  unsigned long millisCurrentWritten;
+};
+s_evse evse[EVSE_MAX_COUNT];
+uint8_t evsePoll = 0;           // EVSE whose registers are refreshed next
 
 //Settings
 bool useRFID = false;
@@ -204,21 +272,21 @@ String msg = ""; //WS communication
 #ifndef ESP8266
 void ICACHE_FLASH_ATTR handleRse() {
   if (rseActive) { //RSE goes activated
-    toSetEVSEcurrent = true;
-    currentBeforeRse = evseAmpsConfig;
-    currentToSet = int(float(evseAmpsConfig) / 100.0 * float(config.getEvseRseValue(0)));
-    if (currentToSet > 0 && currentToSet < 6) currentToSet = 6;
-    if (config.getEvseRseValue(0) == 0) currentToSet = 0;
+    evse[0].toSetCurrent = true;
+    currentBeforeRse = evse[0].ampsConfig;
+    evse[0].currentToSet = int(float(evse[0].ampsConfig) / 100.0 * float(config.getEvseRseValue(0)));
+    if (evse[0].currentToSet > 0 && evse[0].currentToSet < 6) evse[0].currentToSet = 6;
+    if (config.getEvseRseValue(0) == 0) evse[0].currentToSet = 0;
     sliderStatus = false;
     if (config.getSystemDebug()) Serial.print("[ SYSTEM ] RSE Interrupted! Setting current to ");
-    if (config.getSystemDebug()) Serial.println(currentToSet);
+    if (config.getSystemDebug()) Serial.println(evse[0].currentToSet);
   }
   else { //RSE goes deactivated
-    toSetEVSEcurrent = true;
-    currentToSet = currentBeforeRse;
+    evse[0].toSetCurrent = true;
+    evse[0].currentToSet = currentBeforeRse;
     if (!config.getEvseRemote(0)) sliderStatus = true;
     if (config.getSystemDebug()) Serial.print("[ SYSTEM ] RSE Released! Setting current back to ");
-    if (config.getSystemDebug()) Serial.println(currentToSet);
+    if (config.getSystemDebug()) Serial.println(evse[0].currentToSet);
   }
 }
 #endif
@@ -312,118 +380,185 @@ void ICACHE_FLASH_ATTR parseBytes(const char* str, char sep, byte* bytes, int ma
 }
 
 void ICACHE_RAM_ATTR handleMeterInt() {  //interrupt routine for metering
-  if (meterImpMillis < millis()) {
-    meterImpMillis = millis() + (config.getMeterImpLen(0) + 10);
-    meterInterrupt ++;
-    numberOfMeterImps ++;
-  }
+  s0Meter.pulse();
 }
 
+// Called once a second with the power over the last pulses
 void ICACHE_FLASH_ATTR updateS0MeterData() {
-  if (vehicleCharging) {
-    currentKW = 3600.0 / float(meterImpMillis - previousMeterMillis) / float(config.getMeterImpKwh(0) / 1000.0) * (float)config.getMeterFactor(0) ;  //Calculating kW
-    previousMeterMillis = meterImpMillis;
-    meteredKWh = float(numberOfMeterImps) / float(config.getMeterImpKwh(0) / 1000.0) / 1000.0 * float(config.getMeterFactor(0));
+  currentKW = s0Meter.getPower();
+  timeSeries.add(currentKW * 1000.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0);
+  if (evse[0].vehicleCharging) {
+    meteredWh = s0Meter.getWattHours();
   }
-  meterInterrupt = 0;
+}
+
+// kWh with two decimals, straight from the integer - no float rounding on large meter totals
+String ICACHE_FLASH_ATTR formatKWh(int64_t wattHours) {
+  uint64_t magnitude = (wattHours < 0 ? -wattHours : wattHours) + 5;
+  char buffer[24];
+  snprintf(buffer, sizeof(buffer), "%s%lu.%02u", wattHours < 0 ? "-" : "",
+      (unsigned long)(magnitude / 1000), (unsigned)(magnitude % 1000 / 10));
+  return String(buffer);
 }
 
 void ICACHE_FLASH_ATTR updateMMeterData() {
-  if (config.mMeterTypeSDM120 == true) {
-    currentKW = readMeter(0x000C) / 1000.0;
-    meterReading = readMeter(0x0156);
-  }
-  else if (config.mMeterTypeSDM630 == true) {
-    currentKW = readMeter(0x0034) / 1000.0;
-    meterReading = readMeter(0x0156);
-  }
-  if (meterReading != 0.0 &&
-      vehicleCharging == true) {
-    meteredKWh = meterReading - startTotal;
-  }
-  if (startTotal == 0) {
-    meteredKWh = 0.0;
-  }
-  updateSDMMeterCurrent();
+  sdmMeter.poll(onMeterData);
   millisUpdateMMeter = millis() + 5000;
 }
 
-void ICACHE_FLASH_ATTR updateSDMMeterCurrent() {
-  const int regsToRead = 12;
-  uint8_t result;
-  uint16_t iaRes[regsToRead];
-  meterNode.clearTransmitBuffer();
-  meterNode.clearResponseBuffer();
-  delay(50);
-  result = meterNode.readInputRegisters(0x0000, regsToRead); // read 6 registers starting at 0x0000
-
+void ICACHE_FLASH_ATTR onMeterData(uint8_t result) {
   if (result != 0) {
     Serial.print("[ ModBus ] Error ");
     Serial.print(result, HEX);
-    Serial.println(" occured while getting current Meter Data");
+    Serial.println(" occured while getting Meter Data");
     if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 300);
-    return;
   }
 
-  for (int i = 0; i < regsToRead; i++) {
-    iaRes[i] = meterNode.getResponseBuffer(i);
-  
+  if (sdmMeter.isUpdated(SDM_POWER_TOTAL)) {
+    currentKW = sdmMeter.get(SDM_POWER_TOTAL) / 1000.0;
   }
-  ((uint16_t*)&voltageP1)[1]= iaRes[0];
-  ((uint16_t*)&voltageP1)[0]= iaRes[1];
-  ((uint16_t*)&voltageP2)[1]= iaRes[2];
-  ((uint16_t*)&voltageP2)[0]= iaRes[3];
-  ((uint16_t*)&voltageP3)[1]= iaRes[4];
-  ((uint16_t*)&voltageP3)[0]= iaRes[5];
-
-  ((uint16_t*)&currentP1)[1]= iaRes[6];
-  ((uint16_t*)&currentP1)[0]= iaRes[7];
-  ((uint16_t*)&currentP2)[1]= iaRes[8];
-  ((uint16_t*)&currentP2)[0]= iaRes[9];
-  ((uint16_t*)&currentP3)[1]= iaRes[10];
-  ((uint16_t*)&currentP3)[0]= iaRes[11];
+  if (sdmMeter.isUpdated(SDM_ENERGY_TOTAL)) {
+    meterReadingWh = (int64_t)((double)sdmMeter.get(SDM_ENERGY_TOTAL) * 1000.0 + 0.5);
+    if (meterReadingWh != 0 &&
+        evse[0].vehicleCharging == true) {
+      meteredWh = meterReadingWh - startTotalWh;
+    }
+    if (startTotalWh == 0) {
+      meteredWh = 0;
+    }
+  }
+  if (sdmMeter.isUpdated(SDM_CURRENT_P1)) {
+    voltageP1 = sdmMeter.get(SDM_VOLTAGE_P1);
+    voltageP2 = sdmMeter.get(SDM_VOLTAGE_P2);
+    voltageP3 = sdmMeter.get(SDM_VOLTAGE_P3);
+    currentP1 = sdmMeter.get(SDM_CURRENT_P1);
+    currentP2 = sdmMeter.get(SDM_CURRENT_P2);
+    currentP3 = sdmMeter.get(SDM_CURRENT_P3);
+  }
+  timeSeries.add(currentKW * 1000.0, currentP1, currentP2, currentP3, voltageP1, voltageP2, voltageP3);
 }
 
-unsigned long ICACHE_FLASH_ATTR getChargingTime() {
+unsigned long ICACHE_FLASH_ATTR getChargingTime(uint8_t evseId) {
   unsigned long iTime;
-  if (vehicleCharging == true) {
-    iTime = millis() - millisStartCharging;
+  if (evse[evseId].vehicleCharging == true) {
+    iTime = millis() - evse[evseId].millisStartCharging;
   }
   else {
-    iTime = millisStopCharging - millisStartCharging;
+    iTime = evse[evseId].millisStopCharging - evse[evseId].millisStartCharging;
   }
   return iTime;
 }
 
-bool ICACHE_FLASH_ATTR resetUserData() {
-  SoftSer.end();
-  #ifdef ESP8266
-  Dir userdir = SPIFFS.openDir("/P/");
-  while(userdir.next()){
-    Serial.println(userdir.fileName());
-    SPIFFS.remove(userdir.fileName());
+bool ICACHE_FLASH_ATTR isEvseDeactivating() {
+  for (uint8_t i = 0; i < config.getSystemEvseCount(); i++) {
+    if (evse[i].command == EVSE_CMD_DEACTIVATE || evse[i].commandInFlight == EVSE_CMD_DEACTIVATE) {
+      return true;
+    }
   }
-  #else
-  File userdir = SPIFFS.open("/P/");
-  while(userdir.openNextFile()){
-    Serial.println(userdir.name());
-    SPIFFS.remove(userdir.name());
+  return false;
+}
+
+bool ICACHE_FLASH_ATTR isVehicleCharging() {
+  for (uint8_t i = 0; i < config.getSystemEvseCount(); i++) {
+    if (evse[i].vehicleCharging) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// EVSEs are told apart by their Modbus id
+uint8_t ICACHE_FLASH_ATTR getEvseId(uint8_t slave) {
+  for (uint8_t i = 0; i < config.getSystemEvseCount(); i++) {
+    if (config.getEvseMbid(i) == slave) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+// The status LED belongs to the first EVSE
+void ICACHE_FLASH_ATTR changeEvseLedTimes(uint8_t evseId, uint16_t onTime, uint16_t offTime) {
+  if (evseId == 0 && config.getEvseLedConfig(0) == 3) {
+    changeLedTimes(onTime, offTime);
   }
+}
+
+// SoftwareSerial bit-banging does not survive flash access - stop it around
+// file system work. A hardware UART keeps receiving into its ring buffer.
+void ICACHE_FLASH_ATTR suspendModbusSerial() {
+  #ifdef EVSE_SOFTWARE_SERIAL
+  SoftSer.end();
+  #endif
+}
+
+void ICACHE_FLASH_ATTR resumeModbusSerial() {
+  #ifdef EVSE_SOFTWARE_SERIAL
+  SoftSer.begin(MODBUS_BAUD);
+  evseBus.retransmit();   // a frame on the wire got lost
   #endif
-  SoftSer.begin(9600);
+}
+
+bool ICACHE_FLASH_ATTR resetUserData() {
+  suspendModbusSerial();
+  bool success = userDb.clear();
+  rfid.clearUsers();
+  resumeModbusSerial();
+  return success;
+}
+
+// From the WebSocket handler; refused while an import is open or the queue is full
+bool ICACHE_FLASH_ATTR queueUserChange(const char* uid, const char* user, uint8_t acctype, uint32_t validuntil, bool remove) {
+  uint8_t head = userChangeHead;
+  uint8_t next = (head + 1) & (USER_CHANGE_QUEUE - 1);
+  s_userRecord& record = userChanges[head];
+  if (uid == NULL || uid[0] == '\0' || strlen(uid) >= sizeof(record.uid) || next == userChangeTail || userDb.isImporting()) {
+    return false;
+  }
+  memset(&record, 0, sizeof(record));
+  strcpy(record.uid, uid);
+  snprintf(record.user, sizeof(record.user), "%s", user ? user : "");
+  record.acctype = acctype;
+  record.validuntil = validuntil;
+  record.removed = remove;
+  userChangeHead = next;
   return true;
 }
 
+// The oldest queued change into the database and the RFID table
+void ICACHE_FLASH_ATTR applyUserChange() {
+  const s_userRecord& record = userChanges[userChangeTail];
+  fsWorking = true;
+  suspendModbusSerial();
+  bool success = record.removed ? userDb.remove(record.uid) : userDb.put(record.uid, record.user, record.acctype, record.validuntil);
+  resumeModbusSerial();
+  fsWorking = false;
+  if (success && record.removed) {
+    rfid.removeUser(record.uid);
+  }
+  else if (success) {
+    if (config.getSystemDebug()) Serial.println("[ DEBUG ] User saved!");
+    rfid.setUser(record.uid, record.user, record.acctype, record.validuntil);
+  }
+  if (!record.removed) {
+    ws.textAll(success ? "{\"command\":\"result\",\"resultof\":\"userfile\",\"result\": true}" :
+                         "{\"command\":\"result\",\"resultof\":\"userfile\",\"result\": false}");
+  }
+  userChangeTail = (userChangeTail + 1) & (USER_CHANGE_QUEUE - 1);
+}
+
 bool ICACHE_FLASH_ATTR factoryReset() {
-  SoftSer.end();
+  suspendModbusSerial();
   if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Factory Reset...");
-  SPIFFS.remove("/config.json");
+  storage.remove("/config.json");
   initLogFile();
+  energyCounter.reset();
+  energyToSave = -1;
   if (resetUserData()) {
     if (config.getSystemDebug()) Serial.println("[ SYSTEM ] ...successfully done - going to reboot");
   }
   toReboot = true;
-  SoftSer.begin(9600);
+  resumeModbusSerial();
   return true;
 }
 
@@ -443,9 +578,8 @@ bool ICACHE_FLASH_ATTR reconnectWiFi() {
 //////////////////////////////////////////////////////////////////////////////////////////
 void ICACHE_FLASH_ATTR rfidloop() {
   
-  scanResult scan = rfid.readPicc();
-  
-  if (scan.read) {
+  scanResult scan;
+  if (rfid.getScan(scan)) {
     Serial.print("UID: ");
     Serial.println(scan.uid);
     Serial.print("User: ");
@@ -476,11 +610,11 @@ void ICACHE_FLASH_ATTR rfidloop() {
 
     if (scan.valid) {  // PICC valid
       Serial.println("PICC valid");
-      if (evseActive) {
-        toDeactivateEVSE = true;
+      if (evse[0].active) {
+        evse[0].command = EVSE_CMD_DEACTIVATE;
       }
       else {
-        toActivateEVSE = true;
+        evse[0].command = EVSE_CMD_ACTIVATE;
       }
       #ifndef ESP8266
       millisUpdateOled = millis() + 3000;
@@ -505,82 +639,42 @@ void ICACHE_FLASH_ATTR rfidloop() {
       ws.textAll(buffer);
     }
   }
-  if (millisRfidReset < millis() && config.getRfidActive() && !config.getEvseAlwaysActive(0)) {
-    rfid.reset();
-    millisRfidReset = millis() + 1000;
-  }
 }
 
-s_addEvseData ICACHE_FLASH_ATTR getAdditionalEVSEData() {
-  // Getting additional Modbus data
-  s_addEvseData addEvseData;
-  evseNode.clearTransmitBuffer();
-  evseNode.clearResponseBuffer();
-  uint8_t result = evseNode.readHoldingRegisters(0x07D0, 10);  // read 10 registers starting at 0x07D0 (2000)
-  
+void ICACHE_FLASH_ATTR onAdditionalEVSEData(uint8_t result, uint8_t slave, uint16_t address, const uint16_t* values) {
+  uint8_t evseId = getEvseId(slave);
   if (result != 0) {
     // error occured
-    evseErrorCount ++;
-    evseVehicleState = 0;
+    evse[evseId].errorCount ++;
+    evse[evseId].vehicleState = 0;
     Serial.print("[ ModBus ] Error ");
     Serial.print(result, HEX);
-    Serial.println(" occured while getting additional EVSE data");
-    if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 300);
-    lastModbusAction = millis();
-    return addEvseData;
+    Serial.println(" occured while getting additional data of EVSE " + String(evseId));
+    changeEvseLedTimes(evseId, 300, 300);
   }
-    evseErrorCount = 0;
+  else {
+    evse[evseId].errorCount = 0;
     // register successfully read
-    if (config.getSystemDebug()) Serial.println("[ ModBus ] got additional EVSE data successfully ");
-
-    //process answer
-    for (int i = 0; i < 10; i++) {
-      switch(i) {
-      case 0:
-        addEvseData.evseAmpsAfterboot  = evseNode.getResponseBuffer(i);    //Register 2000
-        evseAmpsAfterboot = addEvseData.evseAmpsAfterboot;
-        break;
-      case 1:
-        addEvseData.evseModbusEnabled = evseNode.getResponseBuffer(i);     //Register 2001
-        break;
-      case 2:
-        addEvseData.evseAmpsMin = evseNode.getResponseBuffer(i);           //Register 2002
-        break;
-      case 3:
-        addEvseData.evseAnIn = evseNode.getResponseBuffer(i);             //Reg 2003
-        break;
-      case 4:
-        addEvseData.evseAmpsPowerOn = evseNode.getResponseBuffer(i);      //Reg 2004
-        break;
-      case 5:
-        addEvseData.evseReg2005 = evseNode.getResponseBuffer(i);          //Reg 2005
-        break;
-      case 6:
-        addEvseData.evseShareMode = evseNode.getResponseBuffer(i);        //Reg 2006
-        break;
-      case 7:
-        addEvseData.evsePpDetection = evseNode.getResponseBuffer(i);       //Register 2007
-        break;
-      case 9:
-        addEvseData.evseBootFirmware = evseNode.getResponseBuffer(i);       //Register 2009
-        break;
-      }
-    }
-  return addEvseData;
+    if (config.getSystemDebug()) Serial.println("[ ModBus ] got additional data of EVSE " + String(evseId) + " successfully");
+    evse[evseId].ampsAfterboot = values[0];  //Register 2000
+  }
+  // Answer pending status requests with whatever we have now
+  if (evseId == 0 && toSendStatus) {
+    toSendStatus = false;
+    sendStatus();
+  }
 }
 
 void ICACHE_FLASH_ATTR sendStatus() {
-  // Getting additional Modbus data
+  // No bus access here: loop() refreshes the register caches of all EVSEs
+  // in turn, the status shows the first one (getevsedata has the others)
   #ifdef ESP8266
   struct ip_info info;
-  FSInfo fsinfo;
-  if (!SPIFFS.info(fsinfo)) {
-  #else
-  size_t total = 0, used = 0;
-  esp_err_t spiffsret = esp_spiffs_info(NULL, &total, &used);
-  if (spiffsret != ESP_OK) {
   #endif
-    Serial.print(F("[ WARN ] Error getting info on SPIFFS"));
+  size_t total = storage.getTotalBytes();
+  size_t used = storage.getUsedBytes();
+  if (total == 0) {
+    Serial.print(F("[ WARN ] Error getting info on the file system"));
   }
   StaticJsonDocument<1000> jsonDoc;
   jsonDoc["command"] = "status";
@@ -588,16 +682,14 @@ void ICACHE_FLASH_ATTR sendStatus() {
   jsonDoc["availsize"] = ESP.getFreeSketchSpace();
   jsonDoc["cpu"] = ESP.getCpuFreqMHz();
   jsonDoc["uptime"] = ntp.getDeviceUptimeString();
+  jsonDoc["availspiffs"] = total - used;
+  jsonDoc["spiffssize"] = total;
   
   #ifdef ESP8266
   jsonDoc["chipid"] = String(ESP.getChipId(), HEX);
-  jsonDoc["availspiffs"] = fsinfo.totalBytes - fsinfo.usedBytes;
-  jsonDoc["spiffssize"] = fsinfo.totalBytes;
   jsonDoc["hardwarerev"] = "ESP8266";
   #else
   jsonDoc["chipid"] = String((uint16_t)(ESP.getEfuseMac()>>32) + (uint32_t)ESP.getEfuseMac(), HEX);
-  jsonDoc["availspiffs"] = total - used;
-  jsonDoc["spiffssize"] = total;
   jsonDoc["hardwarerev"] = "ESP32";
   #endif
 
@@ -654,28 +746,33 @@ void ICACHE_FLASH_ATTR sendStatus() {
   jsonDoc["int_temp"] = String(((temprature_sens_read() - 32) / 1.8), 2);
   #endif
 
-  s_addEvseData addEvseData = getAdditionalEVSEData();
   jsonDoc["gateway"] = printIP(gwaddr);
-  jsonDoc["evse_amps_conf"] = evseAmpsConfig;          //Reg 1000
-  jsonDoc["evse_amps_out"] = evseAmpsOutput;           //Reg 1001
-  jsonDoc["evse_vehicle_state"] = evseVehicleState;   //Reg 1002
-  jsonDoc["evse_pp_limit"] = evseAmpsPP;               //Reg 1003
-  jsonDoc["evse_turn_off"] = evseTurnOff;              //Reg 1004
-  jsonDoc["evse_firmware"] = evseFirmware;             //Reg 1005
-  jsonDoc["evse_state"] = evseEvseState;                   //Reg 1006
-  jsonDoc["evse_rcd"] = 0;                   //Reg 1007
-  jsonDoc["evse_amps_afterboot"] = addEvseData.evseAmpsAfterboot;  //Reg 2000
-  jsonDoc["evse_modbus_enabled"] = addEvseData.evseModbusEnabled;  //Reg 2001
-  jsonDoc["evse_amps_min"] = addEvseData.evseAmpsMin;              //Reg 2002
-  jsonDoc["evse_analog_input"] = addEvseData.evseAnIn;             //Reg 2003
-  jsonDoc["evse_amps_poweron"] = addEvseData.evseAmpsPowerOn;      //Reg 2004
-  jsonDoc["evse_2005"] = addEvseData.evseReg2005;                  //Reg 2005
-  jsonDoc["evse_sharing_mode"] = addEvseData.evseShareMode;        //Reg 2006
-  jsonDoc["evse_pp_detection"] = addEvseData.evsePpDetection;      //Reg 2007
+  EvseWiFiRegisterCache& registers = evse[0].registers;
+  jsonDoc["evse_amps_conf"] = evse[0].ampsConfig;          //Reg 1000
+  jsonDoc["evse_amps_out"] = evse[0].ampsOutput;           //Reg 1001
+  jsonDoc["evse_vehicle_state"] = evse[0].vehicleState;   //Reg 1002
+  jsonDoc["evse_pp_limit"] = evse[0].ampsPP;               //Reg 1003
+  jsonDoc["evse_turn_off"] = evse[0].turnOff;              //Reg 1004
+  jsonDoc["evse_firmware"] = evse[0].firmware;             //Reg 1005
+  jsonDoc["evse_state"] = evse[0].evseState;                   //Reg 1006
+  jsonDoc["evse_rcd"] = registers.get(1007);               //Reg 1007
+  jsonDoc["evse_amps_afterboot"] = registers.get(2000);     //Reg 2000
+  jsonDoc["evse_modbus_enabled"] = registers.get(2001);     //Reg 2001
+  jsonDoc["evse_amps_min"] = registers.get(2002);           //Reg 2002
+  jsonDoc["evse_analog_input"] = registers.get(2003);       //Reg 2003
+  jsonDoc["evse_amps_poweron"] = registers.get(2004);       //Reg 2004
+  jsonDoc["evse_2005"] = registers.get(2005);               //Reg 2005
+  jsonDoc["evse_sharing_mode"] = registers.get(2006);       //Reg 2006
+  jsonDoc["evse_pp_detection"] = registers.get(2007);       //Reg 2007
+  jsonDoc["evse_count"] = config.getSystemEvseCount();
+  jsonDoc["loop_max_us"] = maxLoopMicros;
+  jsonDoc["bus_load_evse"] = evseBus.getLoad(config.getEvseMbid(0));   // % of the last minute
+  if (config.useMMeter) {
+    jsonDoc["bus_load_meter"] = meterBus.getLoad(SDM_MBID);
+  }
+  maxLoopMicros = 0;
   if (config.useMMeter) {
-      delay(10);
-      updateMMeterData();
-      jsonDoc["meter_total"] = meterReading;
+      jsonDoc["meter_total"] = serialized(formatKWh(meterReadingWh));
       jsonDoc["meter_p1"] = currentP1;
       jsonDoc["meter_p2"] = currentP2;
       jsonDoc["meter_p3"] = currentP3;
@@ -721,595 +818,800 @@ void ICACHE_FLASH_ATTR printScanResult(int networksFound) {
 //////////////////////////////////////////////////////////////////////////////////////////
 ///////       Log Functions
 //////////////////////////////////////////////////////////////////////////////////////////
+// Session start and end only queue the record, flushSessionLog() writes it
+// once the bus is idle - the EVSE state change never waits for the flash
 void ICACHE_FLASH_ATTR logLatest(String uid, String username) {
   if (!config.getSystemLogging()) {
     return;
   }
-  fsWorking = true;
-  SoftSer.end();
-  delay(30);
-  File logFile = SPIFFS.open("/latestlog.json", "r");
-  if (!logFile) {
-    // Can not open file create it.
-    File logFile = SPIFFS.open("/latestlog.json", "w");
-    StaticJsonDocument<35> jsonDoc;
-    jsonDoc["type"] = "latestlog";
-    jsonDoc.createNestedArray("list");
-    deserializeJson(jsonDoc, logFile);
-    logFile.close();
-    logFile = SPIFFS.open("/latestlog.json", "w+");
-  }
-  if (logFile) {
-    size_t size = logFile.size();
-    if (config.getSystemDebug()) Serial.println(size);
-
-    std::unique_ptr<char[]> buf (new char[size]);
-    logFile.readBytes(buf.get(), size);
-    
-    #ifndef ESP8266
-    DynamicJsonDocument jsonDoc2(12000);
-    #else
-    DynamicJsonDocument jsonDoc2(6000);
-    #endif
-    DeserializationError error = deserializeJson(jsonDoc2, buf.get());
-    JsonArray list = jsonDoc2["list"];
-    if (error) {
-      if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Impossible to read log file");
+  s_sessionRecord record;
+  memset(&record, 0, sizeof(record));
+  record.timestamp = ntp.getUtcTimeNow();
+  record.price = config.getMeterEnergyPrice(0);
+  record.state = SESSION_RUNNING;
+  strncpy(record.uid, uid.c_str(), sizeof(record.uid) - 1);
+  strncpy(record.username, username.c_str(), sizeof(record.username) - 1);
+  if (sessionLog.isFull()) {
+    flushSessionLog();    // backlog is bounded, only then the caller waits
+  }
+  if (!sessionLog.append(record)) {
+    Serial.println("[ SYSTEM ] Cannot write session log");
+  }
+}
+
+void ICACHE_FLASH_ATTR updateLog(bool e) {
+  if (!config.getSystemLogging()) {
+    return;
+  }
+  s_sessionRecord record;
+  if (sessionLog.getLatest(record) && record.state == SESSION_RUNNING) {
+    if (!e) {
+      record.duration = getChargingTime(0);
+      record.energy = (uint32_t)constrain(meteredWh, (int64_t)0, (int64_t)UINT32_MAX);
+      record.price = config.getMeterEnergyPrice(0);
+      record.state = SESSION_FINISHED;
     }
     else {
-      logFile.close();
-      #ifndef ESP8266
-      if (list.size() >= 100) {
-      #else
-      if (list.size() >= 50) {
-      #endif
-        list.remove(0);
-      }
-      logFile = SPIFFS.open("/latestlog.json", "w");
-      StaticJsonDocument<200> jsonDoc3;
-      jsonDoc3["uid"] = uid;
-      jsonDoc3["username"] = username;
-      jsonDoc3["timestamp"] = ntp.getUtcTimeNow();
-      jsonDoc3["duration"] = 0;
-      jsonDoc3["energy"] = 0;
-      jsonDoc3["price"] = config.getMeterEnergyPrice(0);
-      list.add(jsonDoc3);
-
-      String jsonSizeCalc = "";
-      serializeJson(jsonDoc2, jsonSizeCalc);
-      size_t logfileSize;
-
-      for (int i = 0; i < 2; i++) {
-        logfileSize = serializeJson(jsonDoc2, logFile);
-        if (logfileSize == jsonSizeCalc.length()) {
-          if (config.getSystemDebug()) Serial.println("LogFile verified!");
-          break;
-        }
-        else {
-          Serial.println("Error while writing LogFile... Trying 3 times");
-          delay(50);
-        }
-      }
+      record.state = SESSION_FAILED;
+    }
+    if (sessionLog.isFull()) {
+      flushSessionLog();
+    }
+    if (!sessionLog.update(record)) {
+      Serial.println("[ SYSTEM ] Cannot update session log");
     }
-    logFile.close();
   }
   else {
-    if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Cannot create Logfile");
+    if (config.getSystemDebug()) Serial.println("[ SYSTEM ] No running session in log");
+  }
+  evse[0].millisStartCharging = 0;
+  evse[0].millisStopCharging = 0;
+  meteredWh = 0;
+  currentKW = 0.0;
+}
+
+// All queued session records in one go, with the bus released. While a
+// download is open they stay queued.
+void ICACHE_FLASH_ATTR flushSessionLog() {
+  fsWorking = true;
+  suspendModbusSerial();
+  if (!sessionLog.flush() && !sessionLog.isReading()) {
+    Serial.println("[ SYSTEM ] Cannot write session log");
   }
-  delay(70);
+  resumeModbusSerial();
   fsWorking = false;
-  if (config.getSystemDebug()) Serial.println("reactivating SoftSer");
-  SoftSer.begin(9600);
 }
 
-void ICACHE_FLASH_ATTR updateLog(bool e) {
-  if (!config.getSystemLogging()) {
-    return;
+void ICACHE_FLASH_ATTR compactUserDb() {
+  fsWorking = true;
+  suspendModbusSerial();
+  if (!userDb.compact()) {
+    Serial.println("[ SYSTEM ] Cannot write user database");
   }
+  resumeModbusSerial();
+  fsWorking = false;
+}
+
+// All staged users in one merge, the RFID table is rebuilt from the new file
+void ICACHE_FLASH_ATTR commitUserImport() {
   fsWorking = true;
-  SoftSer.end();
-  delay(30);
-  File logFile = SPIFFS.open("/latestlog.json", "r");
-  size_t size = logFile.size();
-  std::unique_ptr<char[]> buf (new char[size]);
-  logFile.readBytes(buf.get(), size);
-  #ifndef ESP8266
-  DynamicJsonDocument jsonDoc(12000);
-  #else
-  DynamicJsonDocument jsonDoc(6000);
-  #endif
-  DeserializationError error = deserializeJson(jsonDoc, buf.get());
-  JsonArray list = jsonDoc["list"];
-  if (error) {
-    if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Impossible to update log file");
-    Serial.print("[ SYSTEM ] Impossible to parse Log file: ");
-    Serial.println(error.c_str());
+  suspendModbusSerial();
+  bool success = userDb.commitImport();
+  resumeModbusSerial();
+  fsWorking = false;
+  if (success) {
+    rfid.loadUsers();
+    if (config.getSystemDebug()) Serial.printf("[ SYSTEM ] %u users imported\n", userDb.getImportCount());
   }
   else {
-    logFile.close();
-    const char* uid = list[(list.size()-1)]["uid"];
-    const char* username = list[(list.size()-1)]["username"];
-    long timestamp = (long)list[(list.size()-1)]["timestamp"];
-
-    list.remove(list.size() - 1); // delete newest log
+    Serial.println("[ SYSTEM ] Cannot import users");
+  }
+  ws.textAll("{\"command\":\"result\",\"resultof\":\"importusers\",\"result\":" + String(success ? "true" : "false") +
+             ",\"count\":" + String(userDb.getImportCount()) + ",\"failed\":" + String(userDb.getImportFailed()) + "}");
+}
 
-    StaticJsonDocument<270> jsonDoc2;
-    jsonDoc2["uid"] = uid;
-    jsonDoc2["username"] = username;
-    jsonDoc2["timestamp"] = timestamp;
-    if (!e) {
-      jsonDoc2["duration"] = getChargingTime();
-      jsonDoc2["energy"] = float(int((meteredKWh + 0.005) * 100.0)) / 100.0;
-      jsonDoc2["price"] = config.getMeterEnergyPrice(0);
+// Body and file upload of /importUsers; the first piece opens the import.
+// Only the staging file is written here, in its own short serial pause.
+// An upload that breaks off is dropped here as well, loop() only commits.
+void ICACHE_FLASH_ATTR importUserData(AsyncWebServerRequest* request, size_t index, uint8_t* data, size_t len) {
+  if (index == 0) {
+    if (!request->authenticate("admin", config.getSystemPass()) || toCommitImport) {
+      return;
     }
-    else {
-      jsonDoc2["duration"] = String("e");
-      jsonDoc2["energy"] = String("e");
-      jsonDoc2["price"] = String("e");
-    }
-    list.add(jsonDoc2);
-    logFile = SPIFFS.open("/latestlog.json", "w");
-    if (logFile) {
-      String jsonSizeCalc = "";
-      serializeJson(jsonDoc, jsonSizeCalc);
-      size_t logfileSize;
-
-      for (int i = 0; i < 2; i++) {
-        logfileSize = serializeJson(jsonDoc, logFile);
-        if (logfileSize == jsonSizeCalc.length()) {
-          if (config.getSystemDebug()) Serial.println("LogFile verified!");
-          break;
-        }
-        else {
-          Serial.println("Error while writing LogFile... Trying 3 times");
-          delay(50);
-        }
-      }
+    if (importRequest != NULL && userDb.isImportStalled()) {
+      importRequest = NULL;
+      suspendModbusSerial();
+      userDb.abortImport();
+      resumeModbusSerial();
+    }
+    if (importRequest != NULL) {
+      return;
+    }
+    suspendModbusSerial();
+    bool started = userDb.beginImport();
+    resumeModbusSerial();
+    if (!started) {
+      return;
     }
+    importRequest = request;
+    request->onDisconnect([request]() {
+      if (request == importRequest) {   // gone before the upload was complete
+        importRequest = NULL;
+        suspendModbusSerial();
+        userDb.abortImport();
+        resumeModbusSerial();
+      }
+    });
   }
-  logFile.close();
-  millisStartCharging = 0;
-  millisStopCharging = 0;
-  meteredKWh = 0.0;
-  currentKW = 0.0;
-  delay(70);
+  if (request == importRequest) {
+    suspendModbusSerial();
+    userDb.importData(data, len);
+    resumeModbusSerial();
+  }
+}
+
+// Blocks the loop for a moment, only started without a charging session
+void ICACHE_FLASH_ATTR benchStorage() {
+  fsWorking = true;
+  suspendModbusSerial();
+  storage.benchmark(storageTimings);
+  resumeModbusSerial();
   fsWorking = false;
-  if (config.getSystemDebug()) Serial.println("reactivating SoftSer");
-  SoftSer.begin(9600);
+  storageBenched = true;
+  if (config.getSystemDebug()) Serial.println(F("[ SYSTEM ] Storage benchmark done"));
 }
 
-float ICACHE_FLASH_ATTR getS0MeterReading() {
-  float fMeterReading = 0.0;
+// Sum of the session log in Wh - only used once to seed the energy counter
+int64_t ICACHE_FLASH_ATTR getS0MeterReading() {
   if (!config.getSystemLogging()) {
-    return fMeterReading;
+    return 0;
   }
+  return (int64_t)sessionLog.getEnergy();
+}
 
-  SoftSer.end();
-  File logFile = SPIFFS.open("/latestlog.json", "r");
-
-  if (logFile) {
-    size_t size = logFile.size();
-    std::unique_ptr<char[]> buf (new char[size]);
-    logFile.readBytes(buf.get(), size);
+// latestlog.json of earlier versions is taken over once, then removed -
+// one that cannot be parsed is kept as latestlog.bak
+void ICACHE_FLASH_ATTR importLogFile() {
+  File logFile = storage.open("/latestlog.json", "r");
+  if (!logFile) {
+    return;
+  }
+  bool parsed = true;
+  if (sessionLog.getLast() == 0) {
     #ifndef ESP8266
     DynamicJsonDocument jsonDoc(12000);
     #else
     DynamicJsonDocument jsonDoc(6000);
     #endif
-    DeserializationError error = deserializeJson(jsonDoc, buf.get());
-    JsonArray list = jsonDoc["list"];
+    DeserializationError error = deserializeJson(jsonDoc, logFile);
     if (error) {
-      if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Impossible to read log file");
+      Serial.print("[ SYSTEM ] Impossible to parse Log file: ");
+      Serial.println(error.c_str());
+      parsed = false;
     }
     else {
-      logFile.close();
-      for (size_t i = 0; i < list.size(); i++) {
-        JsonObject line = list.getElement(i);
-        if (line["energy"] != "e") {
-          fMeterReading += (float)line["energy"];
+      JsonArray list = jsonDoc["list"];
+      for (JsonObject line : list) {
+        s_sessionRecord record;
+        memset(&record, 0, sizeof(record));
+        strncpy(record.uid, line["uid"] | "", sizeof(record.uid) - 1);
+        strncpy(record.username, line["username"] | "", sizeof(record.username) - 1);
+        record.timestamp = line["timestamp"];
+        if (line["energy"] == "e") {
+          record.state = SESSION_FAILED;
         }
+        else {
+          record.duration = line["duration"];
+          record.energy = (uint32_t)((float)line["energy"] * 1000.0 + 0.5);
+          record.price = line["price"];
+          record.state = SESSION_FINISHED;
+        }
+        if (sessionLog.isFull()) {
+          flushSessionLog();
+        }
+        sessionLog.append(record);
       }
+      flushSessionLog();
+      if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Log file imported: " + String(list.size()) + " sessions");
     }
   }
-  SoftSer.begin(9600);
-  return fMeterReading;
+  logFile.close();
+  if (parsed) {
+    storage.remove("/latestlog.json");
+  }
+  else {
+    storage.remove("/latestlog.bak");
+    storage.rename("/latestlog.json", "/latestlog.bak");
+  }
 }
 
-bool ICACHE_FLASH_ATTR initLogFile() {
-  fsWorking = true;
-  SoftSer.end();
-  if (config.getSystemDebug())Serial.println("[ SYSTEM ] Going to delete Log File...");
-  File logFile = SPIFFS.open("/latestlog.json", "w");
-  if (logFile) {
-    StaticJsonDocument<35> jsonDoc;
-    jsonDoc["type"] = "latestlog";
-    jsonDoc.createNestedArray("list");
-    serializeJson(jsonDoc, logFile);
-    logFile.close();
-    if (config.getSystemDebug())Serial.println("[ SYSTEM ] ... Success!");
+void ICACHE_FLASH_ATTR saveEnergyTotal(int64_t wattHours) {
+  suspendModbusSerial();
+  if (!energyCounter.save((uint32_t)constrain(wattHours, (int64_t)0, (int64_t)UINT32_MAX))) {
+    Serial.println("[ SYSTEM ] Could not save energy counter");
+  }
+  resumeModbusSerial();
+  millisSaveEnergy = millis();
+}
+
+// From Modbus callbacks - the counter is written once the bus is idle
+void ICACHE_FLASH_ATTR queueEnergyTotal(int64_t wattHours) {
+  energyToSave = wattHours;
+  millisSaveEnergy = millis();
+}
+
+// Every path that ends a session on the first EVSE: settles meteredWh and, with the S0
+// meter, carries it into the lifetime counter - before updateLog() clears it
+void ICACHE_FLASH_ATTR closeMeteredSession() {
+  if (!sessionMetered) {
+    return;
+  }
+  sessionMetered = false;
+  if (config.useMMeter) {
+    meteredWh = meterReadingWh - startTotalWh;
   }
   else {
-    if (config.getSystemDebug())Serial.println("[ SYSTEM ] ... Failure!");
-    fsWorking = false;
-    SoftSer.begin(9600);
-    return false;
+    startTotalWh += meteredWh;
+    queueEnergyTotal(startTotalWh);
   }
-  SoftSer.begin(9600);
+}
+
+bool ICACHE_FLASH_ATTR initLogFile() {
+  fsWorking = true;
+  suspendModbusSerial();
+  if (config.getSystemDebug())Serial.println("[ SYSTEM ] Going to delete Log File...");
+  bool success = sessionLog.clear();
+  if (config.getSystemDebug())Serial.println(success ? "[ SYSTEM ] ... Success!" : "[ SYSTEM ] ... Failure!");
+  resumeModbusSerial();
   fsWorking = false;
-  return true;
+  return success;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
-///////       Meter Modbus functions
+///////       EVSE Modbus functions
 //////////////////////////////////////////////////////////////////////////////////////////
-float ICACHE_FLASH_ATTR readMeter(uint16_t reg) {
-  uint8_t result;
-  uint16_t iaRes[2];
-  float fResponse = 0.0;
-  meterNode.clearTransmitBuffer();
-  meterNode.clearResponseBuffer();
-  delay(50);
-  result = meterNode.readInputRegisters(reg, 2);  // read 7 registers starting at 0x0000
-  
-  if (result != 0) {
-    Serial.print("[ ModBus ] Error ");
-    Serial.print(result, HEX);
-    Serial.println(" occured while getting Meter Data");
-    if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 300);
+bool ICACHE_FLASH_ATTR queryEVSE(uint8_t evseId) {
+  return evse[evseId].registers.refresh(EVSE_BLOCK_STATUS);  // registers 1000..1007
+}
+
+void ICACHE_FLASH_ATTR onQueryEVSE(uint8_t result, uint8_t slave, uint16_t address, const uint16_t* values) {
+  uint8_t evseId = getEvseId(slave);
+  uint16_t previousVehicleState = evse[evseId].vehicleState;
+  uint16_t previousEvseState = evse[evseId].evseState;
+  uint16_t previousAmpsConfig = evse[evseId].ampsConfig;
+  processEVSEData(evseId, result, values);
+  if (result == 0) {
+    adaptEvsePolling(evseId, evse[evseId].vehicleState != previousVehicleState ||
+                             evse[evseId].evseState != previousEvseState ||
+                             evse[evseId].ampsConfig != previousAmpsConfig);
+    if (evse[evseId].commandWritten) {
+      confirmEvseCommand(evseId, isEvseCommandConfirmed(evseId));
+    }
   }
-  else {
-    iaRes[0] = meterNode.getResponseBuffer(0);
-    iaRes[1] = meterNode.getResponseBuffer(1);
-    ((uint16_t*)&fResponse)[1]= iaRes[0];
-    ((uint16_t*)&fResponse)[0]= iaRes[1];
+  if (evseSessionTimeOut == false) {
+    sendEVSEdata(evseId);
   }
-  return (fResponse);
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////
-///////       EVSE Modbus functions
-//////////////////////////////////////////////////////////////////////////////////////////
-bool ICACHE_FLASH_ATTR queryEVSE() {
-  uint8_t result;
-  evseNode.clearTransmitBuffer();
-  evseNode.clearResponseBuffer();
-  result = evseNode.readHoldingRegisters(0x03E8, 7);  // read 7 registers starting at 0x03E8 (1000)
+// Poll fast around transitions, slow when nobody is plugged in. Bus errors
+// are backed off by the register cache itself.
+void ICACHE_FLASH_ATTR adaptEvsePolling(uint8_t evseId, bool changed) {
+  if (changed) {
+    evse[evseId].millisFastPoll = millis() + EVSE_FAST_POLL_TIME;
+  }
+  unsigned long interval = EVSE_STATUS_MAX_AGE;
+  if ((long)(evse[evseId].millisFastPoll - millis()) > 0) {
+    interval = EVSE_POLL_FAST;
+  }
+  else if (evse[evseId].vehicleState == 1) {
+    interval = EVSE_POLL_IDLE;
+  }
+  evse[evseId].registers.setMaxAge(EVSE_BLOCK_STATUS, interval);
+}
 
-  if (config.getEvseLedConfig(0) != 1) changeLedTimes(100, 10000);
+bool ICACHE_FLASH_ATTR processEVSEData(uint8_t evseId, uint8_t result, const uint16_t* response) {
+  s_evse& e = evse[evseId];
+  if (evseId == 0 && config.getEvseLedConfig(0) != 1) changeLedTimes(100, 10000);
 
   if (result != 0) {
-    if (evseErrorCount > 2) {
-      evseVehicleState = 0;
-      evseStatus = 0;
-      if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 300);
+    if (e.errorCount > 2) {
+      e.vehicleState = 0;
+      e.status = 0;
+      changeEvseLedTimes(evseId, 300, 300);
     }
-    evseErrorCount ++;
+    e.errorCount ++;
     Serial.print("[ ModBus ] Error ");
     Serial.print(result, HEX);
-    Serial.println(" occured while getting EVSE data - trying again...");
-    evseNode.clearTransmitBuffer();
-    evseNode.clearResponseBuffer();
-    delay(500);
-    lastModbusAction = millis();
+    Serial.println(" occured while getting data of EVSE " + String(evseId) + " - trying again...");
     return false;
   }
-  evseErrorCount = 0;
-  lastModbusAction = millis();
+  e.errorCount = 0;
   // register successfully read
   // process answer
   for (int i = 0; i < 7; i++) {
     switch(i) {
     case 0:
-      evseAmpsConfig = evseNode.getResponseBuffer(i);     //Register 1000
+      e.ampsConfig = response[i];     //Register 1000
       break;
     case 1:
-      evseAmpsOutput = evseNode.getResponseBuffer(i);     //Register 1001
+      e.ampsOutput = response[i];     //Register 1001
       break;
     case 2:
-      evseVehicleState = evseNode.getResponseBuffer(i);   //Register 1002
+      e.vehicleState = response[i];   //Register 1002
       break;
     case 3:
-      evseAmpsPP = evseNode.getResponseBuffer(i);          //Register 1003
+      e.ampsPP = response[i];          //Register 1003
       break;
     case 4:
-      evseTurnOff = evseNode.getResponseBuffer(i);          //Register 1004
+      e.turnOff = response[i];          //Register 1004
       break;
     case 5:
-      evseFirmware = evseNode.getResponseBuffer(i);        //Register 1005
+      e.firmware = response[i];        //Register 1005
       break;
     case 6:
-      evseEvseState = evseNode.getResponseBuffer(i);      //Register 1006
+      e.evseState = response[i];      //Register 1006
       break;
-    //case 7:
-    //  evseRcdStatus = evseNode.getResponseBuffer(i);      //Register 1007
-    //  break;
     }
   }
 
   // Maximum slider value is independant of PP Limit - to activate PP-Limit for slider's max value uncomment here:
-  //if (evseAmpsPP > config.getSystemMaxInstall()) {
+  //if (e.ampsPP > config.getSystemMaxInstall()) {
     maxCurrent = config.getSystemMaxInstall();
   //}
   //else {
-  //  maxCurrent = evseAmpsPP;
+  //  maxCurrent = e.ampsPP;
   //}
   
   // Normal Mode
-  if (!config.getEvseAlwaysActive(0)) {
-    if (evseVehicleState == 0) {
-      evseStatus = 0; //modbus communication failed
-      if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 300);
-    }
-    if (evseEvseState == 3) {     //EVSE not Ready
-      if (evseVehicleState == 2 ||
-          evseVehicleState == 3 ||
-          evseVehicleState == 4) {
-        evseStatus = 2; //vehicle detected
-        if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 2000);
+  if (!config.getEvseAlwaysActive(evseId)) {
+    if (e.vehicleState == 0) {
+      e.status = 0; //modbus communication failed
+      changeEvseLedTimes(evseId, 300, 300);
+    }
+    if (e.evseState == 3) {     //EVSE not Ready
+      if (e.vehicleState == 2 ||
+          e.vehicleState == 3 ||
+          e.vehicleState == 4) {
+        e.status = 2; //vehicle detected
+        changeEvseLedTimes(evseId, 300, 2000);
       }
       else {
-        evseStatus = 1; // EVSE deactivated
+        e.status = 1; // EVSE deactivated
       }
-      if (vehicleCharging == true && manualStop == false) {   //vehicle interrupted charging
-        millisStopCharging = millis();
-        vehicleCharging = false;
-        if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Vehicle interrupted charging");
-        updateLog(false);
+      if (e.vehicleCharging == true && e.manualStop == false) {   //vehicle interrupted charging
+        e.millisStopCharging = millis();
+        e.vehicleCharging = false;
+        if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Vehicle interrupted charging on EVSE " + String(evseId));
+        if (evseId == 0) {
+          closeMeteredSession();
+          updateLog(false);
+        }
       }
-      evseActive = false;
+      e.active = false;
       return true;
     }
 
-    if (evseVehicleState == 1) {
-      evseStatus = 1;  // ready
+    if (e.vehicleState == 1) {
+      e.status = 1;  // ready
     }
-    else if (evseVehicleState == 2) {
-      evseStatus = 2; //vehicle detected
-      if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 2000);
+    else if (e.vehicleState == 2) {
+      e.status = 2; //vehicle detected
+      changeEvseLedTimes(evseId, 300, 2000);
     }
-    else if (evseVehicleState == 3 || evseVehicleState == 4) {
-      evseStatus = 3; //charging
-      if (config.getEvseLedConfig(0) == 3) changeLedTimes(2000, 1000);
+    else if (e.vehicleState == 3 || e.vehicleState == 4) {
+      e.status = 3; //charging
+      changeEvseLedTimes(evseId, 2000, 1000);
     }
-    else if (evseVehicleState == 5) {
-      evseStatus = 5;
+    else if (e.vehicleState == 5) {
+      e.status = 5;
     }
   }
   
   // Always Active Mode
   else {
-    if (evseVehicleState == 5) {
-      evseStatus = 5;
-    }
-    if (evseEvseState == 1) { // Steady 12V
-      if (vehicleCharging) { // EV interrupted charging
-        millisStopCharging = millis();
-        vehicleCharging = false;
-        toDeactivateEVSE = true;
+    if (e.vehicleState == 5) {
+      e.status = 5;
+    }
+    if (e.evseState == 1) { // Steady 12V
+      if (e.vehicleCharging) { // EV interrupted charging
+        e.millisStopCharging = millis();
+        e.vehicleCharging = false;
+        e.command = EVSE_CMD_DEACTIVATE;
         lastUID = "vehicle";
         lastUsername = "vehicle";
-        if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Vehicle interrupted charging");
+        if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Vehicle interrupted charging on EVSE " + String(evseId));
       }
-      evseStatus = 1; // ready
-      evseActive = true;
+      e.status = 1; // ready
+      e.active = true;
     }
-    else if (evseEvseState == 2) { // PWM is being generated
-      if (evseVehicleState == 2) { // EV is present
-        if (vehicleCharging) {  // EV interrupted charging
-          millisStopCharging = millis();
-          vehicleCharging = false;
-          toDeactivateEVSE = true;
+    else if (e.evseState == 2) { // PWM is being generated
+      if (e.vehicleState == 2) { // EV is present
+        if (e.vehicleCharging) {  // EV interrupted charging
+          e.millisStopCharging = millis();
+          e.vehicleCharging = false;
+          e.command = EVSE_CMD_DEACTIVATE;
           lastUID = "vehicle";
           lastUsername = "vehicle";
-          if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Vehicle interrupted charging");
+          if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Vehicle interrupted charging on EVSE " + String(evseId));
         }
-        evseStatus = 2; //vehicle detected
-        evseActive = true;
-        if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 2000);
-      }
-      else if (evseVehicleState == 3 || evseVehicleState == 4) {  // EV is charging
-        if (!vehicleCharging) { // EV starts charging
-          millisStartCharging = millis();
-          vehicleCharging = true;
-          toActivateEVSE = true;
+        e.status = 2; //vehicle detected
+        e.active = true;
+        changeEvseLedTimes(evseId, 300, 2000);
+      }
+      else if (e.vehicleState == 3 || e.vehicleState == 4) {  // EV is charging
+        if (!e.vehicleCharging) { // EV starts charging
+          e.millisStartCharging = millis();
+          e.vehicleCharging = true;
+          e.command = EVSE_CMD_ACTIVATE;
           lastUID = "vehicle";
           lastUsername = "vehicle";
         }
-        evseStatus = 3; //charging
-        evseActive = true;
-        if (config.getEvseLedConfig(0) == 3) changeLedTimes(2000, 1000);
-      }
-    }
-    else if (evseEvseState == 3) {     //EVSE not Ready
-      if (evseVehicleState == 2 ||
-          evseVehicleState == 3 ||
-          evseVehicleState == 4) {
-        evseStatus = 2; //vehicle detected
-        if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 2000);
-        if (vehicleCharging && evseAmpsConfig == 0) { //Current Set to 0 - deactivate
-          millisStopCharging = millis();
-          vehicleCharging = false;
-          toDeactivateEVSE = true;
+        e.status = 3; //charging
+        e.active = true;
+        changeEvseLedTimes(evseId, 2000, 1000);
+      }
+    }
+    else if (e.evseState == 3) {     //EVSE not Ready
+      if (e.vehicleState == 2 ||
+          e.vehicleState == 3 ||
+          e.vehicleState == 4) {
+        e.status = 2; //vehicle detected
+        changeEvseLedTimes(evseId, 300, 2000);
+        if (e.vehicleCharging && e.ampsConfig == 0) { //Current Set to 0 - deactivate
+          e.millisStopCharging = millis();
+          e.vehicleCharging = false;
+          e.command = EVSE_CMD_DEACTIVATE;
           lastUID = "API";
           lastUsername = "API";
-          if (config.getSystemDebug()) Serial.println("[ SYSTEM ] API interrupted charging");
+          if (config.getSystemDebug()) Serial.println("[ SYSTEM ] API interrupted charging on EVSE " + String(evseId));
         }
       }
       else {
-        evseStatus = 1; // EVSE deactivated
+        e.status = 1; // EVSE deactivated
       }
-      if (vehicleCharging == true && manualStop == false) {   //vehicle interrupted charging
-        millisStopCharging = millis();
-        vehicleCharging = false;
+      if (e.vehicleCharging == true && e.manualStop == false) {   //vehicle interrupted charging
+        e.millisStopCharging = millis();
+        e.vehicleCharging = false;
         lastUID = "vehicle";
         lastUsername = "vehicle";
-        if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Vehicle interrupted charging");
-        updateLog(false);
+        if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Vehicle interrupted charging on EVSE " + String(evseId));
+        if (evseId == 0) {
+          closeMeteredSession();
+          updateLog(false);
+        }
       }
-      evseActive = false;
+      e.active = false;
       return true;
     }
   }
   return true;
 }
 
-bool ICACHE_FLASH_ATTR activateEVSE() {
-  if (!config.getEvseAlwaysActive(0)) {
-    static uint16_t iTransmit;
-
-    if (config.useMMeter) {
-      if (millisUpdateMMeter - millis() < 50) {
-        delay(50);
-      }
-    }
-    if (evseEvseState == 3 &&
-      evseVehicleState != 0) {    //no modbus error occured
-      iTransmit = 8192;         // disable EVSE after charge
+bool ICACHE_FLASH_ATTR activateEVSE(uint8_t evseId) {
+  if (!config.getEvseAlwaysActive(evseId)) {
+    if (evse[evseId].evseState == 3 &&
+      evse[evseId].vehicleState != 0) {    //no modbus error occured
+      uint16_t iTransmit = 8192;         // disable EVSE after charge
       iTransmit += 32;         // auto reset EVSE after RCD error (30s)
 
-      uint8_t result;
-      evseNode.clearTransmitBuffer();
-      evseNode.setTransmitBuffer(0, iTransmit); // set word 0 of TX buffer (bits 15..0)
-      result = evseNode.writeMultipleRegisters(0x07D5, 1);  // write register 0x07D5 (2005)
-
-      if (result != 0) {
-        // error occured
-        Serial.print("[ ModBus ] Error ");
-        Serial.print(result, HEX);
-        Serial.println(" occured while activating EVSE - trying again...");
-        if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 300);
-        delay(500);
+      if (!evseBus.writeRegister(config.getEvseMbid(evseId), 0x07D5, iTransmit, onActivateEVSE)) {  // write register 0x07D5 (2005)
         return false;
       }
+      evse[evseId].commandInFlight = EVSE_CMD_ACTIVATE;
+      evse[evseId].commandValue = iTransmit;
+      return true;
+    }
+  }
+  finishActivateEVSE(evseId);
+  sendCommandResult(evseId, EVSE_CMD_ACTIVATE, true);
+  return true;
+}
 
-      millisStartCharging = millis();
-      manualStop = false;
-      // register successfully written
-      if (config.getSystemDebug()) Serial.println("[ ModBus ] EVSE successfully activated");
+void ICACHE_FLASH_ATTR onActivateEVSE(uint8_t result, const s_modbusRequest* request, const uint16_t* response) {
+  uint8_t evseId = getEvseId(request->slave);
+  if (result != 0) {
+    // error occured
+    Serial.print("[ ModBus ] Error ");
+    Serial.print(result, HEX);
+    Serial.println(" occured while activating EVSE " + String(evseId) + " - trying again...");
+    changeEvseLedTimes(evseId, 300, 300);
+    evse[evseId].commandInFlight = EVSE_CMD_NONE;
+    if (evse[evseId].command == EVSE_CMD_NONE) {   // unless superseded meanwhile
+      evse[evseId].command = EVSE_CMD_ACTIVATE;
     }
+    evse[evseId].millisRetry = millis() + 500;
+    return;
   }
-  toActivateEVSE = false;
-  evseActive = true;
-  logLatest(lastUID, lastUsername);
-  vehicleCharging = true;
-  if (config.useMMeter) {
-    millisUpdateMMeter += 5000;
-    startTotal = meterReading;
-    meteredKWh = 0.0;
+
+  evse[evseId].millisStartCharging = millis();
+  evse[evseId].manualStop = false;
+  evse[evseId].registers.set(request->address, request->value);
+  // register successfully written
+  if (config.getSystemDebug()) Serial.println("[ ModBus ] EVSE " + String(evseId) + " successfully activated");
+  adaptEvsePolling(evseId, true);
+  awaitReadBack(evseId);
+  finishActivateEVSE(evseId);
+}
+
+void ICACHE_FLASH_ATTR finishActivateEVSE(uint8_t evseId) {
+  evse[evseId].active = true;
+  evse[evseId].vehicleCharging = true;
+  if (evseId == 0) {    // sessions are metered and logged for the first EVSE
+    logLatest(lastUID, lastUsername);
+    timeSeries.start(ntp.getUtcTimeNow());
+    if (config.useMMeter) {
+      millisUpdateMMeter += 5000;
+      startTotalWh = meterReadingWh;
+      meteredWh = 0;
+    }
+    else {
+      startTotalWh = energyToSave >= 0 ? energyToSave : energyCounter.getWattHours();  // last session may be queued
+      meteredWh = 0;
+      millisSaveEnergy = millis();
+    }
+    s0Meter.resetEnergy();
+    sessionMetered = true;
   }
-  else {
-    startTotal = getS0MeterReading();
-    meteredKWh = 0.0;
+  sendEVSEdata(evseId);
+}
+
+bool ICACHE_FLASH_ATTR deactivateEVSE(uint8_t evseId, bool logUpdate) {
+  evse[evseId].logUpdate = logUpdate;
+  if (!config.getEvseAlwaysActive(evseId)) {
+    uint16_t iTransmit = 16384;  // deactivate evse
+    iTransmit += 32;         // auto reset EVSE after RCD error (30s)
+
+    if (!evseBus.writeRegister(config.getEvseMbid(evseId), 0x07D5, iTransmit, onDeactivateEVSE)) {  // write register 0x07D5 (2005)
+      return false;
+    }
+    evse[evseId].commandInFlight = EVSE_CMD_DEACTIVATE;
+    evse[evseId].commandValue = iTransmit;
+    return true;
+  }
+  finishDeactivateEVSE(evseId);
+  sendCommandResult(evseId, EVSE_CMD_DEACTIVATE, true);
+  return true;
+}
+
+void ICACHE_FLASH_ATTR onDeactivateEVSE(uint8_t result, const s_modbusRequest* request, const uint16_t* response) {
+  uint8_t evseId = getEvseId(request->slave);
+  if (result != 0) {
+    // error occured
+    Serial.print("[ ModBus ] Error ");
+    Serial.print(result, HEX);
+    Serial.println(" occured while deactivating EVSE " + String(evseId) + " - trying again...");
+    changeEvseLedTimes(evseId, 300, 300);
+    evse[evseId].commandInFlight = EVSE_CMD_NONE;
+    if (!toReboot && evse[evseId].command == EVSE_CMD_NONE) {
+      evse[evseId].command = EVSE_CMD_DEACTIVATE;
+      evse[evseId].millisRetry = millis() + 500;
+    }
+    return;
+  }
+
+  // register successfully written
+  if (config.getSystemDebug()) Serial.println("[ ModBus ] EVSE " + String(evseId) + " successfully deactivated");
+  adaptEvsePolling(evseId, true);
+  awaitReadBack(evseId);
+  evse[evseId].registers.set(request->address, request->value);
+  evse[evseId].active = false;
+  evse[evseId].millisStopCharging = millis();
+  finishDeactivateEVSE(evseId);
+}
+
+void ICACHE_FLASH_ATTR finishDeactivateEVSE(uint8_t evseId) {
+  evse[evseId].manualStop = true;
+  if (evseId == 0) {
+    timeSeries.stop();
+    closeMeteredSession();
+    if (evse[0].logUpdate) {
+      updateLog(false);
+    }
+  }
+  evse[evseId].vehicleCharging = false;
+  
+  if (config.getEvseResetCurrentAfterCharge(evseId) == true) {
+    evse[evseId].currentToSet = evse[evseId].ampsAfterboot;
+    evse[evseId].toSetCurrent = true;
+  }
+  sendEVSEdata(evseId);
+}
+
+bool ICACHE_FLASH_ATTR setEVSEcurrent(uint8_t evseId) {  // telegram 1: write EVSE current
+  if (!evseBus.writeRegister(config.getEvseMbid(evseId), 0x03E8, evse[evseId].currentToSet, onSetEVSEcurrent)) {  // write register 0x03E8 (1000 - Actual configured amps value)
+    return false;
+  }
+  evse[evseId].toSetCurrent = false;
+  evse[evseId].commandInFlight = EVSE_CMD_CURRENT;
+  evse[evseId].commandValue = evse[evseId].currentToSet;
+  evse[evseId].millisCurrentWritten = millis();
+  return true;
+}
+
+void ICACHE_FLASH_ATTR onSetEVSEcurrent(uint8_t result, const s_modbusRequest* request, const uint16_t* response) {
+  uint8_t evseId = getEvseId(request->slave);
+  if (result != 0) {
+    // error occured
+    Serial.print("[ ModBus ] Error ");
+    Serial.print(result, HEX);
+    Serial.println(" occured while setting current in EVSE " + String(evseId) + " - trying again...");
+    changeEvseLedTimes(evseId, 300, 300);
+    evse[evseId].commandInFlight = EVSE_CMD_NONE;
+    evse[evseId].toSetCurrent = true;    // currentToSet may already hold a newer value
+    evse[evseId].millisRetry = millis() + 500;
+    return;
+  }
+
+  // register successfully written
+  if (config.getSystemDebug()) Serial.println("[ ModBus ] Current of EVSE " + String(evseId) + " successfully set");
+  adaptEvsePolling(evseId, true);
+  awaitReadBack(evseId);
+  evse[evseId].ampsConfig = request->value;  //foce update in WebUI
+  evse[evseId].registers.set(request->address, request->value);
+  sendEVSEdata(evseId);               //foce update in WebUI
+}
+
+// Issues the next command of an EVSE: (de)activation first, then the latest current
+void ICACHE_FLASH_ATTR processEvseCommands(uint8_t evseId) {
+  s_evse& e = evse[evseId];
+  if (e.commandInFlight != EVSE_CMD_NONE) {
+    if (e.commandWritten && millis() >= e.millisCommandDeadline) {
+      confirmEvseCommand(evseId, false);
+    }
+    return;
+  }
+  if (millis() < e.millisRetry) {
+    return;
+  }
+  uint8_t command = e.command;
+  if (command == EVSE_CMD_ACTIVATE || command == EVSE_CMD_DEACTIVATE) {
+    e.command = EVSE_CMD_NONE;
+    bool queued = (command == EVSE_CMD_ACTIVATE) ? activateEVSE(evseId) : deactivateEVSE(evseId, true);
+    if (!queued) {
+      e.command = command;
+      e.millisRetry = millis() + 500;
+    }
+  }
+  else if (e.toSetCurrent && millis() - e.millisCurrentWritten >= EVSE_CURRENT_INTERVAL) {
+    if (e.registers.isValid(EVSE_BLOCK_STATUS) && e.currentToSet == e.ampsConfig) {
+      e.toSetCurrent = false;   // slider ended where it started
+      sendCommandResult(evseId, EVSE_CMD_CURRENT, true);
+    }
+    else {
+      setEVSEcurrent(evseId);
+    }
   }
-  numberOfMeterImps = 0;
-  sendEVSEdata();
-  return true;
 }
 
-bool ICACHE_FLASH_ATTR deactivateEVSE(bool logUpdate) {
-  if (!config.getEvseAlwaysActive(0)) {
-    //New ModBus Master Library
-    static uint16_t iTransmit = 16384;  // deactivate evse
-    iTransmit += 32;         // auto reset EVSE after RCD error (30s)
-
-    uint8_t result;
-
-    if (config.useMMeter) {
-      if (millisUpdateMMeter - millis() < 50) {
-        delay(50);
-      }
-    }
+// The write went through - confirm it with the next status read
+void ICACHE_FLASH_ATTR awaitReadBack(uint8_t evseId) {
+  evse[evseId].commandWritten = true;
+  evse[evseId].millisCommandDeadline = millis() + EVSE_CONFIRM_TIMEOUT;
+  evse[evseId].registers.refresh(EVSE_BLOCK_STATUS);
+}
 
-    evseNode.clearTransmitBuffer();
-    evseNode.setTransmitBuffer(0, iTransmit); // set word 0 of TX buffer (bits 15..0)
-    result = evseNode.writeMultipleRegisters(0x07D5, 1);  // write register 0x07D5 (2005)
+bool ICACHE_FLASH_ATTR isEvseCommandConfirmed(uint8_t evseId) {
+  switch (evse[evseId].commandInFlight) {
+  case EVSE_CMD_ACTIVATE:
+    return evse[evseId].evseState != 3;
+  case EVSE_CMD_DEACTIVATE:
+    return evse[evseId].evseState == 3;
+  case EVSE_CMD_CURRENT:
+    return evse[evseId].ampsConfig == evse[evseId].commandValue;
+  }
+  return false;
+}
 
-    if (result != 0) {
-      // error occured
-      Serial.print("[ ModBus ] Error ");
-      Serial.print(result, HEX);
-      Serial.println(" occured while deactivating EVSE - trying again...");
-      if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 300);
-      delay(500);
-      return false;
-    }
+void ICACHE_FLASH_ATTR confirmEvseCommand(uint8_t evseId, bool confirmed) {
+  if (!confirmed) {
+    Serial.println("[ ModBus ] EVSE " + String(evseId) + " did not take over command " + String(evse[evseId].commandInFlight) + " (value " + String(evse[evseId].commandValue) + ")");
+  }
+  sendCommandResult(evseId, evse[evseId].commandInFlight, confirmed);
+  evse[evseId].commandInFlight = EVSE_CMD_NONE;
+  evse[evseId].commandWritten = false;
+}
 
-    // register successfully written
-    if (config.getSystemDebug()) Serial.println("[ ModBus ] EVSE successfully deactivated");
-    evseActive = false;
-    millisStopCharging = millis();
+void ICACHE_FLASH_ATTR sendCommandResult(uint8_t evseId, uint8_t command, bool result) {
+  StaticJsonDocument<140> jsonDoc;
+  jsonDoc["command"] = "result";
+  if (command == EVSE_CMD_ACTIVATE) {
+    jsonDoc["resultof"] = "activateevse";
   }
-  manualStop = true;
-  if (config.useMMeter) {
-    meteredKWh = meterReading - startTotal;
+  else if (command == EVSE_CMD_DEACTIVATE) {
+    jsonDoc["resultof"] = "deactivateevse";
   }
   else {
-    startTotal += meteredKWh;
-  }  
-  if (logUpdate) {
-    updateLog(false);
+    jsonDoc["resultof"] = "setcurrent";
+    jsonDoc["value"] = evse[evseId].ampsConfig;
   }
-  vehicleCharging = false;
-  toDeactivateEVSE = false;
-  
-  if (config.getEvseResetCurrentAfterCharge(0) == true) {
-    currentToSet = evseAmpsAfterboot;
-    toSetEVSEcurrent = true;
+  jsonDoc["evse"] = evseId;
+  jsonDoc["result"] = result;
+  size_t len = measureJson(jsonDoc);
+  AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len);
+  if (buffer) {
+    serializeJson(jsonDoc, (char *)buffer->get(), len + 1);
+    ws.textAll(buffer);
   }
-  sendEVSEdata();
-  return true;
 }
 
-bool ICACHE_FLASH_ATTR setEVSEcurrent() {  // telegram 1: write EVSE current
-  //New ModBus Master Library
-  uint8_t result;
-
-  if (config.useMMeter) {
-    if (millisUpdateMMeter - millis() < 50) {
-      delay(50);
-    }
-  }
-
-  evseNode.clearTransmitBuffer();
-  evseNode.setTransmitBuffer(0, currentToSet); // set word 0 of TX buffer (bits 15..0)
-  result = evseNode.writeMultipleRegisters(0x03E8, 1);  // write register 0x03E8 (1000 - Actual configured amps value)
+bool ICACHE_FLASH_ATTR setEVSERegister(uint8_t evseId, uint16_t reg, uint16_t val, ModbusCallback callback, void* context) {
+  return evseBus.writeRegister(config.getEvseMbid(evseId), reg, val, callback, context);  // write given register
+}
 
+void ICACHE_FLASH_ATTR onSetEVSERegister(uint8_t result, const s_modbusRequest* request, const uint16_t* response) {
+  uint8_t evseId = getEvseId(request->slave);
+  uint16_t reg = request->address;
+  uint16_t val = request->value;
   if (result != 0) {
     // error occured
     Serial.print("[ ModBus ] Error ");
     Serial.print(result, HEX);
-    Serial.println(" occured while setting current in EVSE - trying again...");
-    if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 300);
-    delay(500);
-    return false;
+    Serial.println(" occured while setting Register " + (String)reg + " of EVSE " + String(evseId) + " to " + (String)val);
+    changeEvseLedTimes(evseId, 300, 300);
+    return;
   }
 
   // register successfully written
-  if (config.getSystemDebug()) Serial.println("[ ModBus ] Current successfully set");
-  evseAmpsConfig = currentToSet;  //foce update in WebUI
-  sendEVSEdata();               //foce update in WebUI
-  toSetEVSEcurrent = false;
-  return true;
+  if (config.getSystemDebug()) Serial.println("[ ModBus ] Register " + (String)reg + " of EVSE " + String(evseId) + " successfully set to " + (String)val);
+  evse[evseId].registers.set(reg, val);
 }
 
-bool ICACHE_FLASH_ATTR setEVSERegister(uint16_t reg, uint16_t val) {
-  uint8_t result;
-  evseNode.clearTransmitBuffer();
-  evseNode.setTransmitBuffer(0, val); // set word 0 of TX buffer (bits 15..0)
-  result = evseNode.writeMultipleRegisters(reg, 1);  // write given register
+//////////////////////////////////////////////////////////////////////////////////////////
+///////       Modbus TCP
+//////////////////////////////////////////////////////////////////////////////////////////
+// Unit ids are the RS485 ids - EVSEs answer holding registers, the meter input registers.
+// Reads never touch the bus, they see what the background polling has cached.
+uint8_t ICACHE_FLASH_ATTR onModbusTcpRead(uint8_t unit, uint8_t function, uint16_t address, uint16_t quantity, uint16_t* values) {
+  if (function == MODBUS_READ_INPUT_REGISTERS) {
+    if (!config.useMMeter || unit != SDM_MBID) {
+      return MODBUS_GATEWAY_PATH_UNAVAILABLE;
+    }
+    for (uint16_t i = 0; i < quantity; i++) {
+      if (!sdmMeter.getRegister(address + i, values[i])) {
+        return MODBUS_ILLEGAL_DATA_ADDRESS;
+      }
+    }
+    return MODBUS_SUCCESS;
+  }
+  for (uint8_t id = 0; id < config.getSystemEvseCount(); id++) {
+    if (config.getEvseMbid(id) != unit) {
+      continue;
+    }
+    for (uint16_t i = 0; i < quantity; i++) {
+      uint16_t reg = address + i;
+      if (!evse[id].registers.contains(reg)) {
+        return MODBUS_ILLEGAL_DATA_ADDRESS;
+      }
+      if (!evse[id].registers.isValid(reg < 2000 ? EVSE_BLOCK_STATUS : EVSE_BLOCK_CONFIG)) {
+        return MODBUS_GATEWAY_TARGET_FAILED;  // not read from the EVSE yet
+      }
+      values[i] = evse[id].registers.get(reg);
+    }
+    return MODBUS_SUCCESS;
+  }
+  return MODBUS_GATEWAY_PATH_UNAVAILABLE;
+}
 
-  if (result != 0) {
-    // error occured
-    Serial.print("[ ModBus ] Error ");
-    Serial.print(result, HEX);
-    Serial.println(" occured while setting EVSE Register " + (String)reg + " to " + (String)val);
-    if (config.getEvseLedConfig(0) == 3) changeLedTimes(300, 300);
-    return false;
+// Writes are queued like /setRegister, the TCP answer follows once the EVSE confirmed
+uint8_t ICACHE_FLASH_ATTR onModbusTcpWrite(uint8_t unit, uint16_t address, uint16_t value, void* token) {
+  for (uint8_t id = 0; id < config.getSystemEvseCount(); id++) {
+    if (config.getEvseMbid(id) != unit) {
+      continue;
+    }
+    if (!evse[id].registers.contains(address)) {
+      return MODBUS_ILLEGAL_DATA_ADDRESS;
+    }
+    if (!setEVSERegister(id, address, value, onModbusTcpWritten, token)) {
+      return MODBUS_SERVER_DEVICE_BUSY;
+    }
+    return MODBUS_SUCCESS;
   }
+  return MODBUS_GATEWAY_PATH_UNAVAILABLE;
+}
 
-  // register successfully written
-  if (config.getSystemDebug()) Serial.println("[ ModBus ] Register " + (String)reg + " successfully set to " + (String)val);
-  return true;
+void ICACHE_FLASH_ATTR onModbusTcpWritten(uint8_t result, const s_modbusRequest* request, const uint16_t* response) {
+  onSetEVSERegister(result, request, response);
+  modbusTcp.complete(request->context, result);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -1328,36 +1630,47 @@ void ICACHE_FLASH_ATTR pushSessionTimeOut() {
   }
 }
 
-void ICACHE_FLASH_ATTR sendEVSEdata() {
-  if (evseSessionTimeOut == false) {
-    StaticJsonDocument<480> jsonDoc;
-    jsonDoc["command"] = "getevsedata";
-    jsonDoc["evse_vehicle_state"] = evseStatus;
-    jsonDoc["evse_active"] = evseActive;
-    jsonDoc["evse_current_limit"] = evseAmpsConfig;
-    jsonDoc["evse_slider_status"] = sliderStatus;
-    #ifndef ESP8266
-    jsonDoc["evse_rse_status"] = rseActive;
-    jsonDoc["evse_rse_current_before"] = currentBeforeRse;
-    #endif
-    jsonDoc["evse_rse_value"] = config.getEvseRseValue(0);
-    jsonDoc["evse_current"] = String(currentKW, 2);
-    jsonDoc["evse_charging_time"] = getChargingTime();
-    jsonDoc["evse_always_active"] = config.getEvseAlwaysActive(0);
-    jsonDoc["evse_charged_kwh"] = String(meteredKWh, 2);
-    jsonDoc["evse_charged_amount"] = String((meteredKWh * float(config.getMeterEnergyPrice(0)) / 100.0), 2);
-    jsonDoc["evse_maximum_current"] = maxCurrent;
-    if (meteredKWh == 0.0) {
-      jsonDoc["evse_charged_mileage"] = "0.0";
+// The web UI shows the first EVSE and gets its data pushed. Data of the
+// other EVSEs only goes to the client that asked for it.
+void ICACHE_FLASH_ATTR sendEVSEdata(uint8_t evseId, AsyncWebSocketClient * client) {
+  if (client == NULL && (evseId != 0 || evseSessionTimeOut == true)) {
+    return;
+  }
+  int64_t energyWh = evseId == 0 ? meteredWh : 0;   // only the first EVSE is metered
+  float energy = energyWh / 1000.0;
+  StaticJsonDocument<500> jsonDoc;
+  jsonDoc["command"] = "getevsedata";
+  jsonDoc["evse"] = evseId;
+  jsonDoc["evse_vehicle_state"] = evse[evseId].status;
+  jsonDoc["evse_active"] = evse[evseId].active;
+  jsonDoc["evse_current_limit"] = evse[evseId].ampsConfig;
+  jsonDoc["evse_slider_status"] = sliderStatus;
+  #ifndef ESP8266
+  jsonDoc["evse_rse_status"] = rseActive;
+  jsonDoc["evse_rse_current_before"] = currentBeforeRse;
+  #endif
+  jsonDoc["evse_rse_value"] = config.getEvseRseValue(evseId);
+  jsonDoc["evse_current"] = String(evseId == 0 ? currentKW : 0.0, 2);
+  jsonDoc["evse_charging_time"] = getChargingTime(evseId);
+  jsonDoc["evse_always_active"] = config.getEvseAlwaysActive(evseId);
+  jsonDoc["evse_charged_kwh"] = formatKWh(energyWh);
+  jsonDoc["evse_charged_amount"] = String((energy * float(config.getMeterEnergyPrice(0)) / 100.0), 2);
+  jsonDoc["evse_maximum_current"] = maxCurrent;
+  if (energyWh == 0) {
+    jsonDoc["evse_charged_mileage"] = "0.0";
+  }
+  else {
+    jsonDoc["evse_charged_mileage"] = String((energy * 100.0 / config.getEvseAvgConsumption(evseId)), 1);
+  }
+  jsonDoc["ap_mode"] = inAPMode;
+  size_t len = measureJson(jsonDoc);
+  AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len);
+  if (buffer) {
+    serializeJson(jsonDoc, (char *)buffer->get(), len + 1);
+    if (client) {
+      client->text(buffer);
     }
     else {
-      jsonDoc["evse_charged_mileage"] = String((meteredKWh * 100.0 / config.getEvseAvgConsumption(0)), 1);
-    }
-    jsonDoc["ap_mode"] = inAPMode;
-    size_t len = measureJson(jsonDoc);
-    AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len);
-    if (buffer) {
-      serializeJson(jsonDoc, (char *)buffer->get(), len + 1);
       ws.textAll(buffer);
     }
   }
@@ -1378,27 +1691,90 @@ void ICACHE_FLASH_ATTR sendTime() {
 
 void ICACHE_FLASH_ATTR sendStartupInfo(AsyncWebSocketClient * client) {
   #ifdef ESP8266
-  String message = "{\"command\":\"startupinfo\",\"hw_rev\":\"ESP8266\",\"sw_rev\":\"" + swVersion + "\",\"pp_limit\":\"" + (String)evseAmpsPP + "\"}";
+  String message = "{\"command\":\"startupinfo\",\"hw_rev\":\"ESP8266\",\"sw_rev\":\"" + swVersion + "\",\"pp_limit\":\"" + (String)evse[0].ampsPP + "\"}";
   #else
-  String message = "{\"command\":\"startupinfo\",\"hw_rev\":\"ESP32\",\"sw_rev\":\"" + swVersion + "\",\"pp_limit\":\"" + (String)evseAmpsPP + "\"}";
+  String message = "{\"command\":\"startupinfo\",\"hw_rev\":\"ESP32\",\"sw_rev\":\"" + swVersion + "\",\"pp_limit\":\"" + (String)evse[0].ampsPP + "\"}";
   #endif
   client->text(message);
 }
 
-void ICACHE_FLASH_ATTR sendUserList(int page, AsyncWebSocketClient * client) {
-  DynamicJsonDocument jsonDoc(3000);
-  jsonDoc = rfid.getUserList(page);
-  size_t len = measureJson(jsonDoc);
+// One page of the session log, only to the asking client. It asks again while
+// "more" is set. One pass to measure, one to fill - records are read from
+// flash, never parsed
+void ICACHE_FLASH_ATTR sendLatestLog(const s_sessionQuery& query, AsyncWebSocketClient * client) {
+  if (client == NULL) {   // gone before loop() got to the page
+    return;
+  }
+  const char* uid = query.uid[0] != '\0' ? query.uid : NULL;
+  uint8_t scratch[64];
+  size_t len = 0;
+  size_t chunk;
+  s_sessionCursor cursor;
+  sessionLog.openJson(cursor, query.since, query.limit, query.from, query.to, uid);   // loop() does not write meanwhile
+  while ((chunk = sessionLog.readJson(cursor, scratch, sizeof(scratch))) > 0) {
+    len += chunk;
+  }
   AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len);
   if (buffer) {
-    serializeJson(jsonDoc, (char *)buffer->get(), len + 1);
-    if (client) {
-      client->text(buffer);
-      client->text("{\"command\":\"result\",\"resultof\":\"userlist\",\"result\": true}");
-    } else {
-      ws.textAll("{\"command\":\"result\",\"resultof\":\"userlist\",\"result\": false}");
+    sessionLog.openJson(cursor, query.since, query.limit, query.from, query.to, uid);
+    len = sessionLog.readJson(cursor, buffer->get(), len);
+    buffer->get()[len] = '\0';
+    client->text(buffer);
+  }
+  else {
+    Serial.println("[ SYSTEM ] Error while reading log file");
+  }
+}
+
+// One page of users, only to the asking client. It asks again with "after"
+// set to "next" while "more" is set. Measured first, then written into a
+// buffer of just that size
+void ICACHE_FLASH_ATTR sendUserList(const s_userQuery& query, AsyncWebSocketClient * client) {
+  if (client == NULL) {   // gone before loop() got to the page
+    return;
+  }
+  std::unique_ptr<s_userRecord[]> page(new s_userRecord[query.limit + 1]);
+  bool more;
+  uint8_t count = userDb.getPage(query, page.get(), more);
+  size_t len = formatUserList(page.get(), count, more, NULL);
+  AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len);
+  if (buffer) {
+    formatUserList(page.get(), count, more, (char *)buffer->get());
+    buffer->get()[len] = '\0';
+    client->text(buffer);
+    client->text("{\"command\":\"result\",\"resultof\":\"userlist\",\"result\": true}");
+  }
+  else {
+    client->text("{\"command\":\"result\",\"resultof\":\"userlist\",\"result\": false}");
+  }
+}
+
+// Without out only the length
+size_t ICACHE_FLASH_ATTR formatUserList(const s_userRecord* page, uint8_t count, bool more, char* out) {
+  char line[USERDB_LINE];
+  size_t len = 0;
+  for (int i = -1; i <= count; i++) {
+    size_t lineLength;
+    if (i < 0) {
+      lineLength = snprintf(line, sizeof(line), "{\"command\":\"userlist\",\"list\":[");
+    }
+    else if (i < count) {
+      lineLength = EvseWiFiUserDb::formatUser(page[i], i > 0, line, sizeof(line));
+    }
+    else if (more) {
+      lineLength = snprintf(line, sizeof(line), "],\"more\":true,\"next\":");
+      lineLength += EvseWiFiUserDb::formatUser(page[count - 1], false, &line[lineLength], sizeof(line) - lineLength - 1);
+      line[lineLength++] = '}';
     }
+    else {
+      lineLength = snprintf(line, sizeof(line), "],\"more\":false}");
+    }
+    if (out) {
+      memcpy(&out[len], line, lineLength);
+    }
+    len += lineLength;
   }
+  return len;
 }
 
 #ifndef ESP8266
@@ -1454,14 +1830,18 @@ void ICACHE_FLASH_ATTR onWsEvent(AsyncWebSocket * server, AsyncWebSocketClient *
 
 void ICACHE_FLASH_ATTR processWsEvent(JsonDocument& root, AsyncWebSocketClient * client) {
   const char * command = root["command"];
+  uint8_t evseId = 0;    // EVSE commands address the first EVSE by default
+  if (root.containsKey("evse")) {
+    evseId = root["evse"];
+  }
+  if (evseId >= config.getSystemEvseCount()) {
+    if (config.getSystemDebug()) Serial.println("[ WebSocket ] Unknown EVSE " + String(evseId));
+    msg = "";
+    return;
+  }
   //File configFile;
   if (strcmp(command, "remove") == 0) {
-    const char* uid = root["uid"];
-    String filename = "/P/";
-    filename += uid;
-    SoftSer.end();
-    SPIFFS.remove(filename);
-    SoftSer.begin(9600);
+    queueUserChange(root["uid"], "", 0, 0, true);   // refused during an import
   }
   else if (strcmp(command, "configfile") == 0) {
     if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Try to update config.json...");
@@ -1469,57 +1849,57 @@ void ICACHE_FLASH_ATTR processWsEvent(JsonDocument& root, AsyncWebSocketClient *
     serializeJson(root, configString);
     if (config.updateConfig(configString)) {
       if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Success - going to reboot now");
-      if (vehicleCharging) {
-        deactivateEVSE(true);
-        delay(100);
+      for (uint8_t i = 0; i < config.getSystemEvseCount(); i++) {
+        if (evse[i].vehicleCharging) {
+          evse[i].command = EVSE_CMD_DEACTIVATE;  // loop() reboots after the sessions are closed
+        }
       }
-      #ifdef ESP8266
-      ESP.reset();
-      #else
-      ESP.restart();
-      #endif
+      toReboot = true;
     }
     else {
       if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Could not save config.json");
     }
   }
   else if (strcmp(command, "userlist") == 0) {
-    int page = root["page"];
-    sendUserList(page, client);
+    if (toSendUserList) {   // one page at a time
+      client->text("{\"command\":\"result\",\"resultof\":\"userlist\",\"result\": false}");
+    }
+    else {
+      s_userQuery& query = userListQuery;
+      memset(&query, 0, sizeof(query));
+      const char* sort = root["sort"] | "uid";
+      query.sort = strcmp(sort, "name") == 0 ? USER_SORT_NAME : strcmp(sort, "expiry") == 0 ? USER_SORT_EXPIRY : USER_SORT_UID;
+      snprintf(query.filter, sizeof(query.filter), "%s", root["filter"] | "");
+      query.limit = constrain(root["limit"] | USERDB_PAGE, 1, USERDB_PAGE_MAX);
+      JsonObject after = root["after"];
+      if (!after.isNull()) {
+        query.hasAfter = true;
+        snprintf(query.after.uid, sizeof(query.after.uid), "%s", after["uid"] | "");
+        snprintf(query.after.user, sizeof(query.after.user), "%s", after["username"] | "");
+        query.after.validuntil = after["validuntil"] | 0UL;
+      }
+      userListClient = client->id();
+      toSendUserList = true;
+    }
   }
   else if (strcmp(command, "status") == 0) {
     toSendStatus = true;
   }
-  else if (strcmp(command, "userfile") == 0) {
-    const char* uid = root["uid"];
-    String filename = "/P/";
-    filename += uid;
-    SoftSer.end();
-    File userFile = SPIFFS.open(filename, "w+");
-    // Check if we created the file
-    if (userFile) {
-      userFile.print(msg);
-      if (config.getSystemDebug()) Serial.println("[ DEBUG ] Userfile written!");
-    }
-    userFile.close();
-    SoftSer.begin(9600);
-    ws.textAll("{\"command\":\"result\",\"resultof\":\"userfile\",\"result\": true}");
+  else if (strcmp(command, "userfile") == 0) {   // loop() sends the result once it is saved
+    if (!queueUserChange(root["uid"], root["user"], root["acctype"], root["validuntil"], false)) {
+      ws.textAll("{\"command\":\"result\",\"resultof\":\"userfile\",\"result\": false}");
+    }
   }
   else if (strcmp(command, "latestlog") == 0) {
-    if (!fsWorking) {
-      File logFile = SPIFFS.open("/latestlog.json", "r");
-      if (logFile) {
-        size_t len = logFile.size();
-        AsyncWebSocketMessageBuffer * buffer = ws.makeBuffer(len);
-        if (buffer) {
-          logFile.readBytes((char *)buffer->get(), len + 1);
-          ws.textAll(buffer);
-        }
-        logFile.close();
-      }
-      else {
-        Serial.println("[ SYSTEM ] Error while reading log file");
-      }
+    if (!toSendLatestLog) {   // one page at a time
+      s_sessionQuery& query = latestLogQuery;
+      query.since = root["since"] | 0UL;
+      query.limit = constrain(root["limit"] | SESSIONLOG_PAGE, 1, SESSIONLOG_PAGE);
+      query.from = root["from"] | 0UL;
+      query.to = root["to"] | 0UL;
+      snprintf(query.uid, sizeof(query.uid), "%s", root["uid"] | "");
+      latestLogClient = client->id();
+      toSendLatestLog = true;
     }
   }
   else if (strcmp(command, "scan") == 0) {
@@ -1543,45 +1923,45 @@ void ICACHE_FLASH_ATTR processWsEvent(JsonDocument& root, AsyncWebSocketClient *
     ws.textAll(config.getConfigJson());
   }
   else if (strcmp(command, "getevsedata") == 0) {
-    sendEVSEdata();
-    evseQueryTimeOut = millis() + 10000; //Timeout for pushing data in loop
-    evseSessionTimeOut = false;
+    if (evseId == 0) {
+      evseQueryTimeOut = millis() + 10000; //Timeout for pushing data in loop
+      evseSessionTimeOut = false;
+    }
+    sendEVSEdata(evseId, client);
     if (config.getSystemDebug()) Serial.println("[ WebSocket ] Data sent to UI");
   }
   else if (strcmp(command, "setcurrent") == 0) {
-    currentToSet = root["current"];
+    evse[evseId].currentToSet = root["current"];
     if (config.getSystemDebug()) Serial.print("[ WebSocket ] Call setEVSECurrent() ");
-    if (config.getSystemDebug()) Serial.println(currentToSet);
-    toSetEVSEcurrent = true;
+    if (config.getSystemDebug()) Serial.println(evse[evseId].currentToSet);
+    evse[evseId].toSetCurrent = true;
   }
   else if (strcmp(command, "activateevse") == 0) {
-    toActivateEVSE = true;
-    if (config.getSystemDebug()) Serial.println("[ WebSocket ] Activate EVSE via WebSocket");
+    evse[evseId].command = EVSE_CMD_ACTIVATE;
+    if (config.getSystemDebug()) Serial.println("[ WebSocket ] Activate EVSE " + String(evseId) + " via WebSocket");
     lastUID = "GUI";
     lastUsername = "GUI";
   }
   else if (strcmp(command, "deactivateevse") == 0) {
-    toDeactivateEVSE = true;
-    if (config.getSystemDebug()) Serial.println("[ WebSocket ] Deactivate EVSE via WebSocket");
+    evse[evseId].command = EVSE_CMD_DEACTIVATE;
+    if (config.getSystemDebug()) Serial.println("[ WebSocket ] Deactivate EVSE " + String(evseId) + " via WebSocket");
     lastUID = "GUI";
     lastUsername = "GUI";
   }
   else if (strcmp(command, "setevsereg") == 0) {
     uint16_t reg = atoi(root["register"]);
     uint16_t val = atoi(root["value"]);
-    setEVSERegister(reg, val);
+    setEVSERegister(evseId, reg, val);
   }
   else if (strcmp(command, "factoryreset") == 0) {
-    factoryReset();
+    toFactoryReset = true;
   }
   else if (strcmp(command, "resetuserdata") == 0) {
-    if (resetUserData()) {
-      if (config.getSystemDebug()) Serial.println("[ WebSocket ] User Data Reset successfully done");
-    }
+    toResetUserData = true;
   }
   else if (strcmp(command, "initlog") == 0) {
     if (config.getSystemDebug())Serial.println("[ SYSTEM ] Websocket Command \"initlog\"...");
-    initLogFile();
+    toInitLog = true;
   }
   else if (strcmp(command, "getstartup") == 0) {
     sendStartupInfo(client);
@@ -1675,6 +2055,10 @@ bool ICACHE_FLASH_ATTR loadConfiguration(String configString = "") {
     if (!config.loadConfig(configString)) return false;
   }
   config.loadConfiguration();
+  if (config.useMMeter && !sdmMeter.begin(&meterBus, SDM_MBID, config.getMeterType(0))) {
+    Serial.println("[ WARNING ] Unknown meter type " + String(config.getMeterType(0)));
+    config.useMMeter = false;
+  }
   if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Check for old config version and renew it");
   config.renewConfigFile();
 
@@ -1705,56 +2089,65 @@ bool ICACHE_FLASH_ATTR loadConfiguration(String configString = "") {
     if (config.getSystemDebug())Serial.println("[ Websocket ] Use Basic Authentication for Websocket");
   }
   #ifdef ESP8266
-  server.addHandler(new SPIFFSEditor("admin", config.getSystemPass()));
+  server.addHandler(new SPIFFSEditor("admin", config.getSystemPass(), storage.getFS()));
   #else
-  server.addHandler(new SPIFFSEditor(SPIFFS, "admin", config.getSystemPass()));
+  server.addHandler(new SPIFFSEditor(storage.getFS(), "admin", config.getSystemPass()));
   #endif
 
-  while (!queryEVSE()) {
-    delay(500);
-    if (evseErrorCount > 2) {
-      break;
+  for (uint8_t id = 0; id < config.getSystemEvseCount(); id++) {
+    evse[id].registers.begin(&evseBus, config.getEvseMbid(id));
+    evse[id].registers.addBlock(1000, 8, 7, EVSE_STATUS_MAX_AGE, onQueryEVSE);    // 1007 (RCD) needs newer EVSE firmware
+    evse[id].registers.addBlock(2000, 18, 10, EVSE_CONFIG_MAX_AGE, onAdditionalEVSEData);
+
+    for (uint8_t i = 0; i < 3; i++) {
+      queryEVSE(id);
+      evseBus.flush(MODBUS_RESPONSE_TIMEOUT * 2);
+      if (evse[id].errorCount == 0) {
+        break;
+      }
+      delay(500);
     }
-  }
-  delay(50);
 
-  s_addEvseData addEvseData = getAdditionalEVSEData();
-  while (evseErrorCount != 0) {
-    delay(500);
-    addEvseData = getAdditionalEVSEData();
-    if (evseErrorCount > 2) {
-      break;
+    for (uint8_t i = 0; i < 3; i++) {
+      evse[id].registers.refresh(EVSE_BLOCK_CONFIG);
+      evseBus.flush(MODBUS_RESPONSE_TIMEOUT * 2);
+      if (evse[id].errorCount == 0) {
+        break;
+      }
+      delay(500);
     }
-  }
-  delay(50);
 
-  if (vehicleCharging) {
-    updateLog(true);
-  }
+    if (id == 0 && evse[0].vehicleCharging) {
+      closeMeteredSession();
+      updateLog(true);
+    }
 
-  if (evseAmpsConfig == 0 && 
-    !config.getEvseAlwaysActive(0) && !config.getEvseRemote(0)) {
-      currentToSet = evseAmpsAfterboot;
-      toSetEVSEcurrent = true;
-  }
+    if (evse[id].ampsConfig == 0 && 
+      !config.getEvseAlwaysActive(id) && !config.getEvseRemote(id)) {
+        evse[id].currentToSet = evse[id].ampsAfterboot;
+        evse[id].toSetCurrent = true;
+    }
 
-  if (config.getEvseAlwaysActive(0)) {
-    evseActive = true;
-    if (addEvseData.evseReg2005 != 0) {
-      delay(50);
-      setEVSERegister(2005, 0);
+    if (config.getEvseAlwaysActive(id)) {
+      evse[id].active = true;
+      if (evse[id].registers.get(2005) != 0) {
+        setEVSERegister(id, 2005, 0);
+      }
+      if (config.getSystemDebug()) Serial.println("[ INFO ] EVSE " + String(id) + " runs in always active mode");
     }
-    if (config.getSystemDebug()) Serial.println(F("[ INFO ] EVSE-WiFi runs in always active mode"));
   }
 
   if (config.getRfidActive() == true && config.getEvseAlwaysActive(0) == false) {
     if (config.getSystemDebug()) Serial.println(F("[ INFO ] Trying to setup RFID hardware"));
-    rfid.begin(config.getRfidPin(), config.getRfidUsePN532(), config.getRfidGain(), &ntp, config.getSystemDebug());
+    rfid.begin(config.getRfidPin(), config.getRfidUsePN532(), config.getRfidGain(), config.getRfidIrqPin(), &ntp, config.getSystemDebug());
   }
 
-  deactivateEVSE(false);  //initial deactivation
-  millisStopCharging = 0;
-  vehicleCharging = false;
+  for (uint8_t id = 0; id < config.getSystemEvseCount(); id++) {
+    deactivateEVSE(id, false);  //initial deactivation
+    evseBus.flush(MODBUS_RESPONSE_TIMEOUT * 2);
+    evse[id].millisStopCharging = 0;
+    evse[id].vehicleCharging = false;
+  }
   
   if (config.getWifiWmode() == 1) {
     if (config.getSystemDebug()) Serial.println(F("[ INFO ] SimpleEVSE Wifi is running in AP Mode "));
@@ -1808,6 +2201,18 @@ bool ICACHE_FLASH_ATTR loadConfiguration(String configString = "") {
   return true;
 }
 
+// Optional "evse" parameter of the HTTP API, -1 for an unknown EVSE
+int ICACHE_FLASH_ATTR getEvseParam(AsyncWebServerRequest * request) {
+  if (!request->hasParam("evse")) {
+    return 0;
+  }
+  int evseId = request->getParam("evse")->value().toInt();
+  if (evseId < 0 || evseId >= config.getSystemEvseCount()) {
+    return -1;
+  }
+  return evseId;
+}
+
 void ICACHE_FLASH_ATTR setWebEvents() {
   server.on("/index.htm", HTTP_GET, [](AsyncWebServerRequest * request) {
     AsyncWebServerResponse * response = request->beginResponse_P(200, "text/html", WEBSRC_INDEX_HTM, WEBSRC_INDEX_HTM_LEN);
@@ -1869,54 +2274,68 @@ void ICACHE_FLASH_ATTR setWebEvents() {
   //getParameters
   if (config.getSystemApi()) {
     server.on("/getParameters", HTTP_GET, [](AsyncWebServerRequest * request) {
+      int evseId = getEvseParam(request);
+      if (evseId < 0) {
+        request->send(200, "text/plain", "E0_unknown EVSE");
+        return;
+      }
       AsyncResponseStream *response = request->beginResponseStream("application/json");
-      StaticJsonDocument<500> jsonDoc;
+      DynamicJsonDocument jsonDoc(500 * config.getSystemEvseCount());
       jsonDoc["type"] = "parameters";
       JsonArray list = jsonDoc.createNestedArray("list");
-      JsonObject items = list.createNestedObject();
-      items["vehicleState"] = evseStatus;
-      items["evseState"] = evseActive;
-      items["maxCurrent"] = maxCurrent;
-      items["actualCurrent"] = evseAmpsConfig;
-      items["actualPower"] =  float(int((currentKW + 0.005) * 100.0)) / 100.0;
-      items["duration"] = getChargingTime();
-      items["alwaysActive"] = config.getEvseAlwaysActive(0);
-      items["lastActionUser"] = lastUsername;
-      items["lastActionUID"] = lastUID;
-      items["energy"] = float(int((meteredKWh + 0.005) * 100.0)) / 100.0;
-      items["mileage"] = float(int(((meteredKWh * 100.0 / config.getEvseAvgConsumption(0)) + 0.05) * 10.0)) / 10.0;
-      if (config.useMMeter) {
-        items["meterReading"] = float(int((meterReading + 0.005) * 100.0)) / 100.0;
-        items["currentP1"] = currentP1;
-        items["currentP2"] = currentP2;
-        items["currentP3"] = currentP3;
-      }
-      else {
-        items["meterReading"] = float(int((startTotal + meteredKWh + 0.005) * 100.0)) / 100.0;;
-        if (config.getMeterPhaseCount(0) == 1) {
-          float fCurrent = float(int((currentKW / float(config.getMeterFactor(0)) / 0.227 + 0.005) * 100.0) / 100.0);
-          if (config.getMeterFactor(0) == 1) {
-            items["currentP1"] = fCurrent;
-              items["currentP2"] = 0.0;
-            items["currentP3"] = 0.0;
-          }
-          else if (config.getMeterFactor(0) == 2) {
-            items["currentP1"] = fCurrent;
-            items["currentP2"] = fCurrent;
-            items["currentP3"] = 0.0;
+      // Without "evse" all EVSEs are listed, the first one first
+      uint8_t first = request->hasParam("evse") ? evseId : 0;
+      uint8_t last = request->hasParam("evse") ? evseId : config.getSystemEvseCount() - 1;
+      for (uint8_t id = first; id <= last; id++) {
+        JsonObject items = list.createNestedObject();
+        items["evse"] = id;
+        items["vehicleState"] = evse[id].status;
+        items["evseState"] = evse[id].active;
+        items["maxCurrent"] = maxCurrent;
+        items["actualCurrent"] = evse[id].ampsConfig;
+        items["duration"] = getChargingTime(id);
+        items["alwaysActive"] = config.getEvseAlwaysActive(id);
+        if (id != 0) {    // no meter and no session log on further EVSEs
+          continue;
+        }
+        items["actualPower"] =  float(int((currentKW + 0.005) * 100.0)) / 100.0;
+        items["lastActionUser"] = lastUsername;
+        items["lastActionUID"] = lastUID;
+        items["energy"] = serialized(formatKWh(meteredWh));
+        items["mileage"] = float(int(((meteredWh / 10.0 / config.getEvseAvgConsumption(0)) + 0.05) * 10.0)) / 10.0;
+        if (config.useMMeter) {
+          items["meterReading"] = serialized(formatKWh(meterReadingWh));
+          items["currentP1"] = currentP1;
+          items["currentP2"] = currentP2;
+          items["currentP3"] = currentP3;
+        }
+        else {
+          items["meterReading"] = serialized(formatKWh(startTotalWh + meteredWh));
+          if (config.getMeterPhaseCount(0) == 1) {
+            float fCurrent = float(int((currentKW / float(config.getMeterFactor(0)) / 0.227 + 0.005) * 100.0) / 100.0);
+            if (config.getMeterFactor(0) == 1) {
+              items["currentP1"] = fCurrent;
+                items["currentP2"] = 0.0;
+              items["currentP3"] = 0.0;
+            }
+            else if (config.getMeterFactor(0) == 2) {
+              items["currentP1"] = fCurrent;
+              items["currentP2"] = fCurrent;
+              items["currentP3"] = 0.0;
+            }
+            else if (config.getMeterFactor(0) == 3) {
+              items["currentP1"] = fCurrent;
+              items["currentP2"] = fCurrent;
+              items["currentP3"] = fCurrent;
+            }
           }
-          else if (config.getMeterFactor(0) == 3) {
+          else {
+            float fCurrent = float(int((currentKW / 0.227 / float(config.getMeterFactor(0)) / 3.0 + 0.005) * 100.0) / 100.0);
             items["currentP1"] = fCurrent;
             items["currentP2"] = fCurrent;
             items["currentP3"] = fCurrent;
           }
         }
-        else {
-          float fCurrent = float(int((currentKW / 0.227 / float(config.getMeterFactor(0)) / 3.0 + 0.005) * 100.0) / 100.0);
-          items["currentP1"] = fCurrent;
-          items["currentP2"] = fCurrent;
-          items["currentP3"] = fCurrent;
-        }
       }
       serializeJson(jsonDoc, *response);
       request->send(response);
@@ -1924,29 +2343,153 @@ void ICACHE_FLASH_ATTR setWebEvents() {
 
     //getLog
     server.on("/getLog", HTTP_GET, [](AsyncWebServerRequest * request) {
-      AsyncWebServerResponse *response = request->beginResponse(SPIFFS, "/latestlog.json", "application/json");
+      uint32_t since = 0;
+      uint32_t limit = 0;
+      if (request->hasParam("since")) {
+        since = request->getParam("since")->value().toInt();
+      }
+      if (request->hasParam("limit")) {
+        limit = request->getParam("limit")->value().toInt();
+      }
+      uint32_t from = 0;
+      uint32_t to = 0;
+      String uid;
+      if (request->hasParam("from")) {
+        from = request->getParam("from")->value().toInt();
+      }
+      if (request->hasParam("to")) {
+        to = request->getParam("to")->value().toInt();
+      }
+      if (request->hasParam("uid")) {
+        uid = request->getParam("uid")->value();
+      }
+      s_sessionCursor cursor;
+      if (!sessionLog.openJson(cursor, since, limit, from, to, uid.c_str())) {   // the log is not written until it is read
+        request->send(503, "text/plain", "E1_session log is being written - try again");
+        return;
+      }
+      AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", [cursor](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+        return sessionLog.readJson(cursor, buffer, maxLen);
+      });
+      request->send(response);
+    });
+    //getTotals - per UID and month, from the totals files instead of the records
+    server.on("/getTotals", HTTP_GET, [](AsyncWebServerRequest * request) {
+      uint32_t fromMonth = 0;
+      uint32_t toMonth = 0;
+      String uid;
+      if (request->hasParam("from")) {
+        fromMonth = request->getParam("from")->value().toInt();
+      }
+      if (request->hasParam("to")) {
+        toMonth = request->getParam("to")->value().toInt();
+      }
+      if (request->hasParam("uid")) {
+        uid = request->getParam("uid")->value();
+      }
+      s_totalsCursor cursor;
+      if (!sessionLog.openTotals(cursor, fromMonth, toMonth, uid.c_str())) {   // no totals file changes until it is read
+        request->send(503, "text/plain", "E1_session log is being written - try again");
+        return;
+      }
+      AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", [cursor](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+        return sessionLog.readTotals(cursor, buffer, maxLen);
+      });
+      request->send(response);
+    });
+    //benchStorage - latencies of the file system, ?start=1 runs it again from the loop
+    server.on("/benchStorage", HTTP_GET, [](AsyncWebServerRequest * request) {
+      if (request->hasParam("start")) {
+        if (isVehicleCharging()) {
+          request->send(200, "text/plain", "E1_could not start benchmark - vehicle is charging");
+          return;
+        }
+        toBenchStorage = true;
+        storageBenched = false;
+      }
+      AsyncResponseStream *response = request->beginResponseStream("application/json");
+      StaticJsonDocument<600> jsonDoc;
+      jsonDoc["type"] = "storage";
+      jsonDoc["filesystem"] = storage.getName();
+      jsonDoc["runs"] = STORAGE_BENCH_RUNS;
+      jsonDoc["done"] = storageBenched;
+      if (storageBenched) {
+        for (uint8_t i = 0; i < STORAGE_OPERATIONS; i++) {
+          JsonObject item = jsonDoc.createNestedObject(EvseWiFiStorage::getOperationName(i));
+          item["average"] = storageTimings[i].average;
+          item["maximum"] = storageTimings[i].maximum;
+          item["errors"] = storageTimings[i].errors;
+        }
+      }
+      serializeJson(jsonDoc, *response);
+      request->send(response);
+    });
+    //exportUsers - all RFID users as CSV or, with ?format=jsonl, one JSON object per line
+    server.on("/exportUsers", HTTP_GET, [](AsyncWebServerRequest * request) {
+      if (!request->authenticate("admin", config.getSystemPass())) {
+        return request->requestAuthentication();
+      }
+      bool jsonl = request->hasParam("format") && request->getParam("format")->value() == "jsonl";
+      s_userExport cursor;
+      if (!userDb.openExport(cursor, jsonl ? USER_FORMAT_JSONL : USER_FORMAT_CSV)) {   // the users stay as they are until it is read
+        request->send(503, "text/plain", "E1_users are being written or exported - try again");
+        return;
+      }
+      AsyncWebServerResponse *response = request->beginChunkedResponse(jsonl ? "application/x-ndjson" : "text/csv", [cursor](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+        return userDb.readExport(cursor, buffer, maxLen);
+      });
+      request->send(response);
+    });
+    //importUsers - CSV or JSON Lines as body or file upload, added to the users in one batch
+    server.on("/importUsers", HTTP_POST, [](AsyncWebServerRequest * request) {
+      if (!request->authenticate("admin", config.getSystemPass())) {
+        return request->requestAuthentication();
+      }
+      if (request != importRequest) {
+        request->send(200, "text/plain", "E1_could not import users - no data or another import is running");
+        return;
+      }
+      importRequest = NULL;
+      toCommitImport = true;
+      request->send(200, "text/plain", "S0_received " + String(userDb.getImportCount()) + " users, " +
+                    String(userDb.getImportFailed()) + " lines failed - result follows on the websocket");
+    }, [](AsyncWebServerRequest * request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
+      importUserData(request, index, data, len);
+    }, [](AsyncWebServerRequest * request, uint8_t *data, size_t len, size_t index, size_t total) {
+      importUserData(request, index, data, len);
+    });
+    //getSeries - CSV of the latest session, streamed straight from the rings
+    server.on("/getSeries", HTTP_GET, [](AsyncWebServerRequest * request) {
+      int tier = -1;
+      if (request->hasParam("tier")) {
+        tier = request->getParam("tier")->value().toInt();
+      }
+      s_seriesCursor cursor;
+      timeSeries.openCsv(cursor, tier);
+      AsyncWebServerResponse *response = request->beginChunkedResponse("text/csv", [cursor](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+        return timeSeries.readCsv(cursor, buffer, maxLen);
+      });
       request->send(response);
     });
     //setCurrent (0,233)
     server.on("/setCurrent", HTTP_GET, [](AsyncWebServerRequest * request) {
         awp = request->getParam(0);
-        if (awp->name() == "current") {
+        int evseId = getEvseParam(request);
+        if (evseId < 0) {
+          request->send(200, "text/plain", "E3_could not set current - unknown EVSE");
+        }
+        else if (awp->name() == "current") {
           if ((atoi(awp->value().c_str()) <= config.getSystemMaxInstall() && atoi(awp->value().c_str()) >= 6) || 
             atoi(awp->value().c_str()) == 0) {
-            currentToSet = atoi(awp->value().c_str());
-            if (setEVSEcurrent()) {
-              request->send(200, "text/plain", "S0_set current to given value");
-            }
-            else {
-              request->send(200, "text/plain", "E0_could not set current - internal error");
-            }
+            evse[evseId].currentToSet = atoi(awp->value().c_str());
+            evse[evseId].toSetCurrent = true;
+            request->send(200, "text/plain", "S0_set current to given value");
           }
           else {
             if (atoi(awp->value().c_str()) >= config.getSystemMaxInstall()) {
-              currentToSet = config.getSystemMaxInstall();
-              if (setEVSEcurrent()) {
-                request->send(200, "text/plain", "S0_set current to maximum value");
-              }
+              evse[evseId].currentToSet = config.getSystemMaxInstall();
+              evse[evseId].toSetCurrent = true;
+              request->send(200, "text/plain", "S0_set current to maximum value");
             }
             else {
               request->send(200, "text/plain", ("E1_could not set current - give a value between 6 and " + (String)config.getSystemMaxInstall()));
@@ -1961,18 +2504,18 @@ void ICACHE_FLASH_ATTR setWebEvents() {
     //setStatus
     server.on("/setStatus", HTTP_GET, [](AsyncWebServerRequest * request) {
       awp = request->getParam(0);
-      if (awp->name() == "active" && config.getEvseAlwaysActive(0) == false) {
+      int evseId = getEvseParam(request);
+      if (evseId < 0) {
+        request->send(200, "text/plain", "E4_could not process - unknown EVSE");
+      }
+      else if (awp->name() == "active" && config.getEvseAlwaysActive(evseId) == false) {
         if (config.getSystemDebug()) Serial.println(awp->value().c_str());
         if (strcmp(awp->value().c_str(), "true") == 0) {
           lastUID = "API";
           lastUsername = "API";
-          if (!evseActive) {
-            if (activateEVSE()) {
-              request->send(200, "text/plain", "S0_EVSE successfully activated");
-            }
-            else {
-              request->send(200, "text/plain", "E0_could not activate EVSE - internal error!");
-            }
+          if (!evse[evseId].active) {
+            evse[evseId].command = EVSE_CMD_ACTIVATE;
+            request->send(200, "text/plain", "S0_EVSE successfully activated");
           }
           else {
             request->send(200, "text/plain", "E3_could not activate EVSE - EVSE already activated!");
@@ -1981,8 +2524,8 @@ void ICACHE_FLASH_ATTR setWebEvents() {
         else if (strcmp(awp->value().c_str(), "false") == 0) {
           lastUID = "API";
           lastUsername = "API";
-          if (evseActive) {
-            toDeactivateEVSE = true;
+          if (evse[evseId].active) {
+            evse[evseId].command = EVSE_CMD_DEACTIVATE;
             request->send(200, "text/plain", "S0_EVSE successfully deactivated");
           }
           else {
@@ -2100,14 +2643,18 @@ void ICACHE_FLASH_ATTR setWebEvents() {
     server.on("/setRegister", HTTP_GET, [](AsyncWebServerRequest * request) {
       awp = request->getParam(0);
       awp2 = request->getParam(1);
-      if (awp->name() == "reg") {
+      int evseId = getEvseParam(request);
+      if (evseId < 0) {
+        request->send(200, "text/plain", "E2_could not set EVSE register - unknown EVSE");
+      }
+      else if (awp->name() == "reg") {
         if ((atoi(awp->value().c_str()) >= 1000 && atoi(awp->value().c_str()) <= 1007) || 
             (atoi(awp->value().c_str()) >= 2000 && atoi(awp->value().c_str()) <= 2017)) {
           if (awp2->name() == "val") {
             if (atoi(awp2->value().c_str()) >= 0 && atoi(awp2->value().c_str()) <= 65535) {
               uint16_t reg = atoi(awp->value().c_str());
               uint16_t val = atoi(awp2->value().c_str());
-              if (setEVSERegister(reg, val)){
+              if (setEVSERegister(evseId, reg, val)){
                 request->send(200, "text/plain", "S0_EVSE Register successfully set");
               }
               else {
@@ -2203,25 +2750,34 @@ void ICACHE_FLASH_ATTR startWebserver() {
 ///////       Setup
 //////////////////////////////////////////////////////////////////////////////////////////
 void ICACHE_RAM_ATTR setup() {
-  Serial.begin(9600);
+  Serial.begin(MODBUS_BAUD);
   if (config.getSystemDebug()) Serial.println();
   if (config.getSystemDebug()) Serial.println("[ INFO ] SimpleEVSE WiFi");
   delay(500);
 
   SPI.begin();
-  SPIFFS.begin();
-  SoftSer.begin(9600);
-  evseNode.begin(1, SoftSer);
-  #ifdef ESP8266
-  meterNode.begin(2, Serial);
+  storage.begin();
+  #ifdef EVSE_SOFTWARE_SERIAL
+  SoftSer.begin(MODBUS_BAUD);
   #else
-  meterNode.begin(2, SoftSer);
+  SoftSer.setRxBufferSize(256);
+  SoftSer.begin(MODBUS_BAUD, SERIAL_8N1, 22, 21);
+  #endif
+  evseBus.begin(&SoftSer);
+  #ifdef ESP8266
+  meterBus.begin(&Serial);
   #endif
+  timeSeries.begin();
+  sessionLog.begin();
+  if (!userDb.begin()) {
+    Serial.println("[ SYSTEM ] Cannot read user database");
+  }
 
   if (!loadConfiguration()) {
     Serial.println("[ WARNING ] Going to fallback mode!");
     fallbacktoAPMode();
   }
+  importLogFile();
 
   // Setup LED
   if (config.getEvseLedConfig(0) != 1) {
@@ -2255,6 +2811,11 @@ void ICACHE_RAM_ATTR setup() {
 
   if (config.useSMeter) {
     pinMode(config.getMeterPin(0), INPUT_PULLUP);
+    s0Meter.begin(config.getMeterImpKwh(0), config.getMeterFactor(0), config.getMeterImpLen(0));
+    if (!energyCounter.begin()) {
+      saveEnergyTotal(getS0MeterReading());   // earlier versions summed up the session log
+    }
+    startTotalWh = energyCounter.getWattHours();
     attachInterrupt(digitalPinToInterrupt(config.getMeterPin(0)), handleMeterInt, FALLING);
     if (config.getSystemDebug()) Serial.print("[ Meter ] Use GPIO/Pin ");
     if (config.getSystemDebug()) Serial.println(config.getMeterPin(0));
@@ -2274,6 +2835,10 @@ void ICACHE_RAM_ATTR setup() {
 
   now();
   startWebserver();
+  if (config.getSystemApi()) {
+    modbusTcp.begin(onModbusTcpRead, onModbusTcpWrite);
+    if (config.getSystemDebug()) Serial.println("[ SYSTEM ] Modbus TCP server started on port " + String(MODBUSTCP_PORT));
+  }
   if (config.getSystemDebug()) Serial.println("[ SYSTEM ] End of setup routine");
   if (config.getEvseRemote(0)) sliderStatus = false;
 }
@@ -2282,6 +2847,7 @@ void ICACHE_RAM_ATTR setup() {
 ///////       Loop
 //////////////////////////////////////////////////////////////////////////////////////////
 void ICACHE_RAM_ATTR loop() {
+  unsigned long loopMicros = micros();
   currentMillis = millis();
   unsigned long uptime = ntp.getUptimeSec();
   previousLoopMillis = currentMillis;
@@ -2291,38 +2857,45 @@ void ICACHE_RAM_ATTR loop() {
   if (inFallbackMode && millis() > 600000) toReboot = true;
 
   if (uptime > 3888000) {   // auto restart after 45 days uptime
-    if (vehicleCharging == false) {
+    if (!isVehicleCharging()) {
       if (config.getSystemDebug()) Serial.println(F("[ UPDT ] Auto restarting..."));
       delay(1000);
       toReboot = true;
     }
   }
-  if (toReboot) {
+  if (toReboot && !isEvseDeactivating() && evseBus.isIdle() && !(sessionLog.isPending() && sessionLog.isReading())) {
+    if (energyToSave >= 0) {
+      saveEnergyTotal(energyToSave);
+    }
+    if (sessionLog.isPending()) {
+      flushSessionLog();
+    }
     if (config.getSystemDebug()) Serial.println(F("[ UPDT ] Rebooting..."));
     delay(100);
     ESP.restart();
   }
-  if (currentMillis >= rfid.cooldown && config.getRfidActive() == true && !updateRunning) {
+  if (config.getRfidActive() == true && !updateRunning) {
     rfidloop();
   }
 
   handleLed();
 
-  if (toActivateEVSE && !updateRunning) {
-    activateEVSE();
-    delay(300);
-  }
-  if (toDeactivateEVSE && !updateRunning) {
-    deactivateEVSE(true);
-    delay(300);
-  }
-  if (currentMillis > (lastModbusAction + 3000) && !updateRunning) { //Update Modbus data every 3000ms and send data to WebUI
-    queryEVSE();
-    if (evseSessionTimeOut == false) {
-      sendEVSEdata();
+  evseBus.loop();
+  #ifdef ESP8266
+  meterBus.loop();
+  #endif
+  modbusTcp.loop();
+
+  if (!updateRunning) {
+    for (uint8_t i = 0; i < config.getSystemEvseCount(); i++) {
+      processEvseCommands(i);
     }
   }
-  else if (currentMillis > evseQueryTimeOut &&    //Setting timeout for Evse poll / push to ws
+  if (!updateRunning) { //Refresh stale EVSE registers in the background, callbacks send data to WebUI
+    evse[evsePoll].registers.loop();    //one EVSE per pass, round robin
+    evsePoll = (evsePoll + 1) % config.getSystemEvseCount();
+  }
+  if (currentMillis > evseQueryTimeOut &&    //Setting timeout for Evse poll / push to ws
     evseSessionTimeOut == false && !updateRunning) {
     evseSessionTimeOut = true;
     pushSessionTimeOut();
@@ -2330,16 +2903,58 @@ void ICACHE_RAM_ATTR loop() {
   if (config.useMMeter && millisUpdateMMeter < millis() && !updateRunning) {
     updateMMeterData();
   }
-  if (meterInterrupt != 0) {
+  if (config.useSMeter && s0Meter.loop()) {
     updateS0MeterData();
   }
-  if (config.useSMeter && previousMeterMillis < millis() - (meterTimeout * 1000)) {  //Timeout when there is less than ~300 watt power consuption -> 10 sec of no interrupt from meter
-    if (previousMeterMillis != 0) {
-      currentKW = 0.0;
+  if (config.useSMeter && evse[0].vehicleCharging && millis() - millisSaveEnergy > ENERGY_SAVE_INTERVAL && !updateRunning) {
+    queueEnergyTotal(startTotalWh + meteredWh);
+  }
+  if (energyToSave >= 0 && evseBus.isIdle() && !updateRunning) {   //Write-behind of the S0 energy counter
+    saveEnergyTotal(energyToSave);
+    energyToSave = -1;
+  }
+  if (sessionLog.isPending() && evseBus.isIdle() && !updateRunning && !sessionLog.isReading()) {   //Write-behind of the session log
+    flushSessionLog();
+  }
+  if (toSendLatestLog && !updateRunning) {   //A page may open several segments
+    s_sessionQuery query = latestLogQuery;
+    uint32_t clientId = latestLogClient;
+    toSendLatestLog = false;
+    sendLatestLog(query, ws.client(clientId));
+  }
+  if (toInitLog && evseBus.isIdle() && !updateRunning && !sessionLog.isReading()) {
+    toInitLog = false;
+    initLogFile();
+  }
+  if (userDb.isCompactionDue() && evseBus.isIdle() && !updateRunning && !userDb.isExporting()) {   //Merge the user changes into the sorted file
+    compactUserDb();
+  }
+  if (toSendUserList && !updateRunning) {   //A page reads the whole user file if sorted by name or expiry
+    s_userQuery query = userListQuery;
+    uint32_t clientId = userListClient;
+    toSendUserList = false;     // the client may ask for the next page right away
+    sendUserList(query, ws.client(clientId));
+  }
+  if (userChangeTail != userChangeHead && !userDb.isLogFull() && evseBus.isIdle() && !updateRunning && !userDb.isExporting()) {   //One WebSocket user change per pass
+    applyUserChange();
+  }
+  if (toFactoryReset && evseBus.isIdle() && !updateRunning && !userDb.isExporting() && !sessionLog.isReading()) {   //Clears the users as well, then reboots
+    toFactoryReset = false;
+    factoryReset();
+  }
+  if (toResetUserData && evseBus.isIdle() && !updateRunning && !userDb.isExporting()) {
+    toResetUserData = false;
+    if (resetUserData()) {
+      if (config.getSystemDebug()) Serial.println("[ WebSocket ] User Data Reset successfully done");
     }
   }
-  if (toSetEVSEcurrent && !updateRunning) {
-    setEVSEcurrent();
+  if (toCommitImport && evseBus.isIdle() && !updateRunning && !userDb.isExporting()) {
+    commitUserImport();
+    toCommitImport = false;     // no new upload before, it would share the staging file
+  }
+  if (toBenchStorage && evseBus.isIdle() && !isVehicleCharging() && !updateRunning) {
+    toBenchStorage = false;
+    benchStorage();
   }
 
   if (wifiInterrupted && reconnectTimer < millis()) {
@@ -2363,11 +2978,11 @@ void ICACHE_RAM_ATTR loop() {
       if (config.getSystemDebug()) Serial.println("Button released");
       buttonState = HIGH;
       if (!config.getEvseAlwaysActive(0)) {
-        if (evseActive) {
-          toDeactivateEVSE = true;
+        if (evse[0].active) {
+          evse[0].command = EVSE_CMD_DEACTIVATE;
         }
         else {
-          toActivateEVSE = true;
+          evse[0].command = EVSE_CMD_ACTIVATE;
         }
         lastUsername = "Button";
         lastUID = "Button";
@@ -2400,14 +3015,20 @@ void ICACHE_RAM_ATTR loop() {
     toReboot = true;
   }
   if (toSendStatus == true) {
-    sendStatus();
-    toSendStatus = false;
+    // Serve from cache - only hit the bus if the configuration registers went stale
+    if (evse[0].registers.isFresh(EVSE_BLOCK_CONFIG)) {
+      sendStatus();
+      toSendStatus = false;
+    }
+    else {
+      evse[0].registers.refresh(EVSE_BLOCK_CONFIG);
+    }
   }
 
 #ifndef ESP8266
   if (millisUpdateOled < millis()) {
     delay(5);
-    oled.showDemo(evseStatus, getChargingTime(), evseAmpsConfig, maxCurrent, currentKW, meteredKWh, ntp.getUtcTimeNow(), &swVersion);
+    oled.showDemo(evse[0].status, getChargingTime(0), evse[0].ampsConfig, maxCurrent, currentKW, meteredWh / 1000.0, ntp.getUtcTimeNow(), &swVersion);
     millisUpdateOled = millis() + 3000;
   }
 
@@ -2432,4 +3053,9 @@ void ICACHE_RAM_ATTR loop() {
     }
   }
 #endif
+
+  unsigned long loopDuration = micros() - loopMicros;
+  if (loopDuration > maxLoopMicros) {
+    maxLoopMicros = loopDuration;
+  }
 }
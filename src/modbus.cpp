@@ -0,0 +1,309 @@
+#include "modbus.h"
+
+// Requests may be queued from the web server task on ESP32
+#ifdef ESP32
+static portMUX_TYPE modbusMux = portMUX_INITIALIZER_UNLOCKED;
+#define MODBUS_ENTER_CRITICAL() portENTER_CRITICAL(&modbusMux)
+#define MODBUS_EXIT_CRITICAL() portEXIT_CRITICAL(&modbusMux)
+#else
+#define MODBUS_ENTER_CRITICAL()
+#define MODBUS_EXIT_CRITICAL()
+#endif
+
+void ICACHE_FLASH_ATTR EvseWiFiModbus::begin(Stream* serial, unsigned long baud) {
+  this->serial = serial;
+  this->queueHead = 0;
+  this->queueCount = 0;
+  this->state = MODBUS_IDLE;
+  // 3.5 characters of 11 bits, fixed 1750us above 19200 baud (Modbus over serial line spec)
+  if (baud > 19200) {
+    this->frameGapMicros = 1750;
+  }
+  else {
+    this->frameGapMicros = 38500000UL / baud;
+  }
+  this->microsLastActivity = micros();
+  this->millisStatsWindow = millis();
+  this->statsCount = 0;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiModbus::readHoldingRegisters(uint8_t slave, uint16_t address, uint16_t quantity, ModbusCallback callback, void* context, uint8_t priority) {
+  s_modbusRequest request = {slave, MODBUS_READ_HOLDING_REGISTERS, address, quantity, 0, callback, context, priority};
+  return enqueue(request);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiModbus::readInputRegisters(uint8_t slave, uint16_t address, uint16_t quantity, ModbusCallback callback, void* context, uint8_t priority) {
+  s_modbusRequest request = {slave, MODBUS_READ_INPUT_REGISTERS, address, quantity, 0, callback, context, priority};
+  return enqueue(request);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiModbus::writeRegister(uint8_t slave, uint16_t address, uint16_t value, ModbusCallback callback, void* context, uint8_t priority) {
+  s_modbusRequest request = {slave, MODBUS_WRITE_MULTIPLE_REGISTERS, address, 1, value, callback, context, priority};
+  return enqueue(request);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiModbus::enqueue(const s_modbusRequest& request) {
+  if (request.quantity == 0 || request.quantity > MODBUS_MAX_REGS) {
+    return false;
+  }
+  MODBUS_ENTER_CRITICAL();
+  if (queueCount >= MODBUS_QUEUE_SIZE) {
+    MODBUS_EXIT_CRITICAL();
+    return false;
+  }
+  uint8_t pos = queueCount;
+  if (request.priority == MODBUS_PRIORITY_COMMAND) {
+    // Line up behind other commands, but never displace the request on the wire
+    pos = (state == MODBUS_IDLE) ? 0 : 1;
+    while (pos < queueCount && queue[(queueHead + pos) % MODBUS_QUEUE_SIZE].priority == MODBUS_PRIORITY_COMMAND) {
+      pos++;
+    }
+    for (uint8_t i = queueCount; i > pos; i--) {
+      queue[(queueHead + i) % MODBUS_QUEUE_SIZE] = queue[(queueHead + i - 1) % MODBUS_QUEUE_SIZE];
+    }
+  }
+  queue[(queueHead + pos) % MODBUS_QUEUE_SIZE] = request;
+  queueCount++;
+  MODBUS_EXIT_CRITICAL();
+  return true;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiModbus::isIdle() {
+  return queueCount == 0 && state == MODBUS_IDLE;
+}
+
+// Only meant for setup() - blocks until all queued requests are done
+bool ICACHE_FLASH_ATTR EvseWiFiModbus::flush(unsigned long timeout) {
+  unsigned long millisStart = millis();
+  while (!isIdle()) {
+    if (millis() - millisStart > timeout) {
+      return false;
+    }
+    loop();
+    yield();
+  }
+  return true;
+}
+
+// The serial line was re-initialized - send the request on the wire again
+void ICACHE_FLASH_ATTR EvseWiFiModbus::retransmit() {
+  if (state != MODBUS_IDLE) {
+    state = MODBUS_IDLE;
+    microsLastActivity = micros();
+  }
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbus::loop() {
+  if (serial == NULL) {
+    return;
+  }
+  if (millis() - millisStatsWindow >= MODBUS_STATS_WINDOW) {
+    rollStats();
+  }
+  if (state == MODBUS_IDLE) {
+    // Keep the line silent for 3.5 characters before the next frame
+    if (queueCount > 0 && micros() - microsLastActivity >= frameGapMicros) {
+      transmit();
+    }
+  }
+  else if (state == MODBUS_DISCARDING) {
+    discard();
+  }
+  else {
+    receive();
+  }
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbus::transmit() {
+  // Commands from other tasks may be inserted at the head until we are receiving
+  MODBUS_ENTER_CRITICAL();
+  s_modbusRequest request = queue[queueHead];
+  state = MODBUS_RECEIVING;
+  MODBUS_EXIT_CRITICAL();
+  uint8_t tx[9 + 2];
+  uint8_t len = 0;
+
+  // Discard leftovers of previous (broken) frames
+  while (serial->available()) {
+    serial->read();
+  }
+
+  tx[len++] = request.slave;
+  tx[len++] = request.function;
+  tx[len++] = highByte(request.address);
+  tx[len++] = lowByte(request.address);
+  tx[len++] = highByte(request.quantity);
+  tx[len++] = lowByte(request.quantity);
+  if (request.function == MODBUS_WRITE_MULTIPLE_REGISTERS) {
+    tx[len++] = 2;
+    tx[len++] = highByte(request.value);
+    tx[len++] = lowByte(request.value);
+  }
+  uint16_t crc = crc16(tx, len);
+  tx[len++] = lowByte(crc);
+  tx[len++] = highByte(crc);
+
+  frameLength = 0;
+  frameExpected = 0;
+  millisTransmit = millis();
+  microsTransmit = micros();
+
+  serial->write(tx, len);
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbus::receive() {
+  const s_modbusRequest& request = queue[queueHead];
+
+  while (serial->available() && frameLength < sizeof(frame)) {
+    frame[frameLength++] = serial->read();
+    microsLastActivity = micros();
+
+    if (frameLength == 3) {
+      if (frame[0] != request.slave) {
+        reject(MODBUS_INVALID_SLAVE_ID);
+        return;
+      }
+      if ((frame[1] & 0x7F) != request.function) {
+        reject(MODBUS_INVALID_FUNCTION);
+        return;
+      }
+      if (frame[1] & 0x80) {  // exception response
+        frameExpected = 5;
+      }
+      else if (request.function == MODBUS_WRITE_MULTIPLE_REGISTERS) {
+        frameExpected = 8;
+      }
+      else {
+        if (frame[2] != 2 * request.quantity) {
+          reject(MODBUS_INVALID_FUNCTION);
+          return;
+        }
+        frameExpected = 5 + frame[2];
+      }
+    }
+
+    if (frameExpected != 0 && frameLength == frameExpected) {
+      uint16_t crc = crc16(frame, frameLength - 2);
+      if (frame[frameLength - 2] != lowByte(crc) || frame[frameLength - 1] != highByte(crc)) {
+        finish(MODBUS_INVALID_CRC);
+        return;
+      }
+      if (frame[1] & 0x80) {
+        finish(frame[2]);
+        return;
+      }
+      if (request.function != MODBUS_WRITE_MULTIPLE_REGISTERS) {
+        for (uint16_t i = 0; i < request.quantity; i++) {
+          response[i] = word(frame[3 + 2 * i], frame[4 + 2 * i]);
+        }
+      }
+      finish(MODBUS_SUCCESS);
+      return;
+    }
+  }
+
+  if (frameLength == sizeof(frame)) {
+    reject(MODBUS_INVALID_CRC);
+    return;
+  }
+  if (millis() - millisTransmit > MODBUS_RESPONSE_TIMEOUT) {
+    finish(MODBUS_RESPONSE_TIMED_OUT);
+  }
+}
+
+// The rest of a frame that is not our answer is still coming in; finished
+// at once, it would be taken for the start of the next answer
+void ICACHE_FLASH_ATTR EvseWiFiModbus::reject(uint8_t result) {
+  rejectResult = result;
+  state = MODBUS_DISCARDING;
+  discard();
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbus::discard() {
+  while (serial->available()) {
+    serial->read();
+    microsLastActivity = micros();
+  }
+  if (micros() - microsLastActivity >= frameGapMicros || millis() - millisTransmit > MODBUS_RESPONSE_TIMEOUT) {
+    finish(rejectResult);
+  }
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbus::finish(uint8_t result) {
+  MODBUS_ENTER_CRITICAL();
+  s_modbusRequest request = queue[queueHead];
+  queueHead = (queueHead + 1) % MODBUS_QUEUE_SIZE;
+  queueCount--;
+  state = MODBUS_IDLE;
+  MODBUS_EXIT_CRITICAL();
+  if (result == MODBUS_RESPONSE_TIMED_OUT) {
+    microsLastActivity = micros();
+  }
+  account(request.slave, micros() - microsTransmit, result != MODBUS_SUCCESS);
+
+  // The callback may queue follow-up requests
+  if (request.callback) {
+    request.callback(result, &request, response);
+  }
+}
+
+float ICACHE_FLASH_ATTR EvseWiFiModbus::getLoad(uint8_t slave) {
+  const s_modbusSlaveStats* slaveStats = getStats(slave);
+  if (slaveStats == NULL) {
+    return 0.0;
+  }
+  return slaveStats->loadPermille / 10.0;
+}
+
+const s_modbusSlaveStats* ICACHE_FLASH_ATTR EvseWiFiModbus::getStats(uint8_t slave) {
+  for (uint8_t i = 0; i < statsCount; i++) {
+    if (stats[i].slave == slave) {
+      return &stats[i];
+    }
+  }
+  return NULL;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbus::account(uint8_t slave, uint32_t busy, bool error) {
+  s_modbusSlaveStats* slaveStats = (s_modbusSlaveStats*)getStats(slave);
+  if (slaveStats == NULL) {
+    if (statsCount >= MODBUS_MAX_SLAVES) {
+      return;
+    }
+    slaveStats = &stats[statsCount++];
+    memset(slaveStats, 0, sizeof(s_modbusSlaveStats));
+    slaveStats->slave = slave;
+  }
+  slaveStats->busyMicros += busy;
+  slaveStats->transactions++;
+  if (error) {
+    slaveStats->errors++;
+  }
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbus::rollStats() {
+  unsigned long window = millis() - millisStatsWindow;
+  for (uint8_t i = 0; i < statsCount; i++) {
+    stats[i].loadPermille = min((uint32_t)1000, (uint32_t)(stats[i].busyMicros / window));
+    stats[i].busyMicros = 0;
+    stats[i].transactions = 0;
+    stats[i].errors = 0;
+  }
+  millisStatsWindow = millis();
+}
+
+uint16_t ICACHE_FLASH_ATTR EvseWiFiModbus::crc16(const uint8_t* data, uint16_t length) {
+  uint16_t crc = 0xFFFF;
+  for (uint16_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      if (crc & 0x0001) {
+        crc = (crc >> 1) ^ 0xA001;
+      }
+      else {
+        crc >>= 1;
+      }
+    }
+  }
+  return crc;
+}
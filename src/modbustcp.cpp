@@ -0,0 +1,276 @@
+#include "modbustcp.h"
+
+// Frames arrive in the TCP task on ESP32, bus writes complete in loop()
+#ifdef ESP32
+static portMUX_TYPE modbusTcpMux = portMUX_INITIALIZER_UNLOCKED;
+#define MODBUSTCP_ENTER_CRITICAL() portENTER_CRITICAL(&modbusTcpMux)
+#define MODBUSTCP_EXIT_CRITICAL() portEXIT_CRITICAL(&modbusTcpMux)
+#else
+#define MODBUSTCP_ENTER_CRITICAL()
+#define MODBUSTCP_EXIT_CRITICAL()
+#endif
+
+void ICACHE_FLASH_ATTR EvseWiFiModbusTcp::begin(ModbusTcpReadHandler readHandler, ModbusTcpWriteHandler writeHandler, uint16_t port) {
+  this->readHandler = readHandler;
+  this->writeHandler = writeHandler;
+  for (uint8_t i = 0; i < MODBUSTCP_MAX_CLIENTS; i++) {
+    clients[i].client = NULL;
+    clients[i].closed = false;
+    clients[i].rxLength = 0;
+  }
+  memset(pending, 0, sizeof(pending));
+  if (server == NULL) {
+    server = new AsyncServer(port);
+    server->onClient(onClient, this);
+  }
+  server->setNoDelay(true);
+  server->begin();
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbusTcp::onClient(void* arg, AsyncClient* client) {
+  EvseWiFiModbusTcp* tcp = (EvseWiFiModbusTcp*)arg;
+  s_modbusTcpClient* slot = NULL;
+  for (uint8_t i = 0; i < MODBUSTCP_MAX_CLIENTS && slot == NULL; i++) {
+    if (tcp->clients[i].client == NULL) {
+      slot = &tcp->clients[i];
+    }
+  }
+  if (slot == NULL) {
+    client->onDisconnect([](void* arg, AsyncClient* client) {
+      delete client;
+    });
+    client->close(true);
+    return;
+  }
+  slot->closed = false;
+  slot->rxLength = 0;
+  slot->client = client;
+  client->setRxTimeout(MODBUSTCP_IDLE_TIMEOUT);
+  client->setNoDelay(true);
+  client->onData(onData, tcp);
+  client->onDisconnect(onDisconnect, tcp);
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbusTcp::onData(void* arg, AsyncClient* client, void* data, size_t len) {
+  EvseWiFiModbusTcp* tcp = (EvseWiFiModbusTcp*)arg;
+  for (uint8_t i = 0; i < MODBUSTCP_MAX_CLIENTS; i++) {
+    if (tcp->clients[i].client == client && !tcp->clients[i].closed) {
+      tcp->receive(&tcp->clients[i], (const uint8_t*)data, len);
+      return;
+    }
+  }
+}
+
+// The client object is freed in loop(), pending writes may still refer to it
+void ICACHE_FLASH_ATTR EvseWiFiModbusTcp::onDisconnect(void* arg, AsyncClient* client) {
+  EvseWiFiModbusTcp* tcp = (EvseWiFiModbusTcp*)arg;
+  for (uint8_t i = 0; i < MODBUSTCP_MAX_CLIENTS; i++) {
+    if (tcp->clients[i].client == client) {
+      tcp->clients[i].closed = true;
+    }
+  }
+}
+
+// TCP is a stream - frames may be split over or packed into segments
+void ICACHE_FLASH_ATTR EvseWiFiModbusTcp::receive(s_modbusTcpClient* slot, const uint8_t* data, size_t len) {
+  while (len > 0) {
+    size_t chunk = min(len, (size_t)(MODBUSTCP_MAX_FRAME - slot->rxLength));
+    memcpy(&slot->rx[slot->rxLength], data, chunk);
+    slot->rxLength += chunk;
+    data += chunk;
+    len -= chunk;
+
+    while (slot->rxLength >= 8) {
+      uint16_t protocol = word(slot->rx[2], slot->rx[3]);
+      uint16_t frameLength = 6 + word(slot->rx[4], slot->rx[5]);
+      if (protocol != 0 || frameLength < 8 || frameLength > MODBUSTCP_MAX_FRAME) {
+        // Not Modbus TCP, there is no way to find the next frame
+        slot->rxLength = 0;
+        slot->client->close(true);
+        return;
+      }
+      if (slot->rxLength < frameLength) {
+        break;
+      }
+      handleFrame(slot, slot->rx, frameLength);
+      slot->rxLength -= frameLength;
+      memmove(slot->rx, &slot->rx[frameLength], slot->rxLength);
+    }
+  }
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbusTcp::handleFrame(s_modbusTcpClient* slot, const uint8_t* frame, uint16_t length) {
+  uint16_t transaction = word(frame[0], frame[1]);
+  uint8_t unit = frame[6];
+  const uint8_t* pdu = &frame[7];
+  uint16_t pduLength = length - 7;
+  uint8_t function = pdu[0];
+  uint8_t result;
+
+  if (function == MODBUS_READ_HOLDING_REGISTERS || function == MODBUS_READ_INPUT_REGISTERS) {
+    uint16_t address = word(pdu[1], pdu[2]);
+    uint16_t quantity = word(pdu[3], pdu[4]);
+    if (pduLength != 5 || quantity == 0 || quantity > MODBUSTCP_MAX_READ) {
+      sendException(slot, transaction, unit, function, MODBUS_ILLEGAL_DATA_VALUE);
+      return;
+    }
+    uint16_t values[MODBUSTCP_MAX_READ];
+    result = readHandler(unit, function, address, quantity, values);
+    if (result != MODBUS_SUCCESS) {
+      sendException(slot, transaction, unit, function, result);
+      return;
+    }
+    uint8_t response[2 + 2 * MODBUSTCP_MAX_READ];
+    response[0] = function;
+    response[1] = 2 * quantity;
+    for (uint16_t i = 0; i < quantity; i++) {
+      response[2 + 2 * i] = highByte(values[i]);
+      response[3 + 2 * i] = lowByte(values[i]);
+    }
+    sendResponse(slot, transaction, unit, response, 2 + 2 * quantity);
+  }
+  else if (function == MODBUS_WRITE_SINGLE_REGISTER || function == MODBUS_WRITE_MULTIPLE_REGISTERS) {
+    // Answered from loop() once the bus writes are done
+    result = handleWrite(slot, transaction, unit, pdu, pduLength);
+    if (result != MODBUS_SUCCESS) {
+      sendException(slot, transaction, unit, function, result);
+    }
+  }
+  else {
+    sendException(slot, transaction, unit, function, MODBUS_ILLEGAL_FUNCTION);
+  }
+}
+
+uint8_t ICACHE_FLASH_ATTR EvseWiFiModbusTcp::handleWrite(s_modbusTcpClient* slot, uint16_t transaction, uint8_t unit, const uint8_t* pdu, uint16_t length) {
+  uint8_t function = pdu[0];
+  uint16_t address = word(pdu[1], pdu[2]);
+  uint16_t quantity;
+  const uint8_t* data;
+  if (function == MODBUS_WRITE_SINGLE_REGISTER) {
+    if (length != 5) {
+      return MODBUS_ILLEGAL_DATA_VALUE;
+    }
+    quantity = 1;
+    data = &pdu[3];
+  }
+  else {
+    if (length < 6) {
+      return MODBUS_ILLEGAL_DATA_VALUE;
+    }
+    quantity = word(pdu[3], pdu[4]);
+    if (quantity == 0 || quantity > MODBUSTCP_MAX_WRITE || pdu[5] != 2 * quantity || length != 6 + 2 * quantity) {
+      return MODBUS_ILLEGAL_DATA_VALUE;
+    }
+    data = &pdu[6];
+  }
+
+  s_modbusTcpPending* p = NULL;
+  for (uint8_t i = 0; i < MODBUSTCP_MAX_PENDING && p == NULL; i++) {
+    if (!pending[i].used) {
+      p = &pending[i];
+    }
+  }
+  if (p == NULL) {
+    return MODBUS_SERVER_DEVICE_BUSY;
+  }
+  p->client = slot;
+  p->transaction = transaction;
+  p->unit = unit;
+  p->function = function;
+  p->address = address;
+  p->quantity = (function == MODBUS_WRITE_SINGLE_REGISTER) ? word(data[0], data[1]) : quantity;
+  p->result = MODBUS_SUCCESS;
+  MODBUSTCP_ENTER_CRITICAL();
+  p->outstanding = quantity;
+  p->used = true;
+  MODBUSTCP_EXIT_CRITICAL();
+
+  for (uint16_t i = 0; i < quantity; i++) {
+    uint8_t result = writeHandler(unit, address + i, word(data[2 * i], data[2 * i + 1]), p);
+    if (result != MODBUS_SUCCESS) {
+      // Registers already queued are written anyway, the client gets the error
+      MODBUSTCP_ENTER_CRITICAL();
+      if (p->result == MODBUS_SUCCESS) {
+        p->result = result;
+      }
+      p->outstanding -= quantity - i;
+      MODBUSTCP_EXIT_CRITICAL();
+      break;
+    }
+  }
+  return MODBUS_SUCCESS;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbusTcp::complete(void* token, uint8_t result) {
+  s_modbusTcpPending* p = (s_modbusTcpPending*)token;
+  MODBUSTCP_ENTER_CRITICAL();
+  if (result != MODBUS_SUCCESS && p->result == MODBUS_SUCCESS) {
+    // Serial line errors mean the EVSE did not answer
+    p->result = (result < 0x80) ? result : MODBUS_GATEWAY_TARGET_FAILED;
+  }
+  if (p->outstanding > 0) {
+    p->outstanding--;
+  }
+  MODBUSTCP_EXIT_CRITICAL();
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbusTcp::loop() {
+  for (uint8_t i = 0; i < MODBUSTCP_MAX_PENDING; i++) {
+    s_modbusTcpPending& p = pending[i];
+    if (!p.used || p.outstanding > 0) {
+      continue;
+    }
+    if (p.client != NULL && !p.client->closed) {
+      if (p.result == MODBUS_SUCCESS) {
+        uint8_t response[5] = {p.function, highByte(p.address), lowByte(p.address), highByte(p.quantity), lowByte(p.quantity)};
+        sendResponse(p.client, p.transaction, p.unit, response, sizeof(response));
+      }
+      else {
+        sendException(p.client, p.transaction, p.unit, p.function, p.result);
+      }
+    }
+    p.used = false;
+  }
+
+  for (uint8_t i = 0; i < MODBUSTCP_MAX_CLIENTS; i++) {
+    s_modbusTcpClient& slot = clients[i];
+    if (slot.client == NULL || !slot.closed) {
+      continue;
+    }
+    MODBUSTCP_ENTER_CRITICAL();
+    for (uint8_t j = 0; j < MODBUSTCP_MAX_PENDING; j++) {
+      if (pending[j].client == &slot) {
+        pending[j].client = NULL;
+      }
+    }
+    MODBUSTCP_EXIT_CRITICAL();
+    delete slot.client;
+    slot.client = NULL;
+  }
+}
+
+uint8_t ICACHE_FLASH_ATTR EvseWiFiModbusTcp::getClientCount() {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < MODBUSTCP_MAX_CLIENTS; i++) {
+    if (clients[i].client != NULL && !clients[i].closed) {
+      count++;
+    }
+  }
+  return count;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbusTcp::sendResponse(s_modbusTcpClient* slot, uint16_t transaction, uint8_t unit, const uint8_t* pdu, uint16_t length) {
+  AsyncClient* client = slot->client;
+  if (client == NULL || !client->connected() || client->space() < 7 + (size_t)length) {
+    return;   // the client does not read its answers, it will time out
+  }
+  uint8_t header[7] = {highByte(transaction), lowByte(transaction), 0, 0, highByte(length + 1), lowByte(length + 1), unit};
+  client->add((const char*)header, sizeof(header));
+  client->add((const char*)pdu, length);
+  client->send();
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiModbusTcp::sendException(s_modbusTcpClient* slot, uint16_t transaction, uint8_t unit, uint8_t function, uint8_t exception) {
+  uint8_t pdu[2] = {(uint8_t)(function | 0x80), exception};
+  sendResponse(slot, transaction, unit, pdu, sizeof(pdu));
+}
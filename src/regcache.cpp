@@ -0,0 +1,139 @@
+#include "regcache.h"
+
+void ICACHE_FLASH_ATTR EvseWiFiRegisterCache::begin(EvseWiFiModbus* bus, uint8_t slave) {
+  this->bus = bus;
+  this->slave = slave;
+}
+
+uint8_t ICACHE_FLASH_ATTR EvseWiFiRegisterCache::addBlock(uint16_t address, uint16_t quantity, uint16_t minQuantity, unsigned long maxAge, RegisterCacheCallback callback) {
+  if (blockCount >= REGCACHE_MAX_BLOCKS) {
+    return blockCount - 1;
+  }
+  s_registerBlock& block = blocks[blockCount];
+  block.address = address;
+  block.quantity = min(quantity, (uint16_t)REGCACHE_MAX_REGS);
+  block.minQuantity = min(minQuantity, block.quantity);
+  block.maxAge = maxAge;
+  block.millisUpdated = 0;
+  block.millisRequested = 0;
+  block.valid = false;
+  block.pending = false;
+  block.failures = 0;
+  block.callback = callback;
+  memset(block.values, 0, sizeof(block.values));
+  return blockCount++;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiRegisterCache::setMaxAge(uint8_t block, unsigned long maxAge) {
+  if (block < blockCount) {
+    blocks[block].maxAge = maxAge;
+  }
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiRegisterCache::refresh(uint8_t block) {
+  if (block >= blockCount || bus == NULL) {
+    return false;
+  }
+  if (blocks[block].pending) {  // a refresh is already on its way
+    return true;
+  }
+  if (!bus->readHoldingRegisters(slave, blocks[block].address, blocks[block].quantity, onResponse, this)) {
+    return false;
+  }
+  blocks[block].pending = true;
+  blocks[block].millisRequested = millis();
+  return true;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiRegisterCache::invalidate(uint8_t block) {
+  if (block < blockCount) {
+    blocks[block].valid = false;
+  }
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiRegisterCache::loop() {
+  for (uint8_t i = 0; i < blockCount; i++) {
+    if (!blocks[i].pending && !isFresh(i) &&
+        millis() - blocks[i].millisRequested >= retryDelay(blocks[i])) {
+      refresh(i);
+    }
+  }
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiRegisterCache::isFresh(uint8_t block) {
+  if (block >= blockCount) {
+    return false;
+  }
+  return blocks[block].valid && millis() - blocks[block].millisUpdated < blocks[block].maxAge;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiRegisterCache::isValid(uint8_t block) {
+  return block < blockCount && blocks[block].valid;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiRegisterCache::contains(uint16_t reg) {
+  return findBlock(reg) != NULL;
+}
+
+uint16_t ICACHE_FLASH_ATTR EvseWiFiRegisterCache::get(uint16_t reg) {
+  s_registerBlock* block = findBlock(reg);
+  if (block == NULL) {
+    return 0;
+  }
+  return block->values[reg - block->address];
+}
+
+// Mirror successful writes so readers do not have to wait for the next poll
+void ICACHE_FLASH_ATTR EvseWiFiRegisterCache::set(uint16_t reg, uint16_t value) {
+  s_registerBlock* block = findBlock(reg);
+  if (block != NULL) {
+    block->values[reg - block->address] = value;
+  }
+}
+
+// Back off exponentially while the slave does not answer
+unsigned long ICACHE_FLASH_ATTR EvseWiFiRegisterCache::retryDelay(const s_registerBlock& block) {
+  uint8_t shift = block.failures > 0 ? min((uint8_t)(block.failures - 1), (uint8_t)6) : 0;
+  return min((unsigned long)REGCACHE_RETRY << shift, (unsigned long)REGCACHE_RETRY_MAX);
+}
+
+s_registerBlock* ICACHE_FLASH_ATTR EvseWiFiRegisterCache::findBlock(uint16_t reg) {
+  for (uint8_t i = 0; i < blockCount; i++) {
+    if (reg >= blocks[i].address && reg < blocks[i].address + blocks[i].quantity) {
+      return &blocks[i];
+    }
+  }
+  return NULL;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiRegisterCache::onResponse(uint8_t result, const s_modbusRequest* request, const uint16_t* response) {
+  EvseWiFiRegisterCache* cache = (EvseWiFiRegisterCache*)request->context;
+  uint8_t index = 0;
+  while (index < cache->blockCount && cache->blocks[index].address != request->address) {
+    index++;
+  }
+  if (index >= cache->blockCount) {
+    return;
+  }
+  s_registerBlock* block = &cache->blocks[index];
+  block->pending = false;
+
+  if (result == MODBUS_ILLEGAL_DATA_ADDRESS && block->quantity > block->minQuantity) {
+    // Older EVSE firmware does not know all registers - retry with the smaller range
+    block->quantity = block->minQuantity;
+    cache->refresh(index);
+    return;
+  }
+  if (result == MODBUS_SUCCESS) {
+    memcpy(block->values, response, request->quantity * sizeof(uint16_t));
+    block->millisUpdated = millis();
+    block->valid = true;
+    block->failures = 0;
+  }
+  else if (block->failures < 255) {
+    block->failures++;
+  }
+  if (block->callback) {
+    block->callback(result, cache->slave, block->address, block->values);
+  }
+}
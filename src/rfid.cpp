@@ -1,10 +1,29 @@
 #include <rfid.h>
 
 MFRC522 mfrc522 = MFRC522();
+static volatile bool irqPending = false;    // the reader answered, ComIrqReg not cleared yet
+#ifdef ESP32
+static TaskHandle_t scanTask = NULL;
+static QueueHandle_t scanQueue = NULL;
+#endif
 
-bool ICACHE_FLASH_ATTR EvseWiFiRfid::begin(int rfidss, bool usePN532, int rfidgain, NtpClient* ntp, bool debug) {
+static void ICACHE_RAM_ATTR onReaderIrq() {
+  irqPending = true;
+  #ifdef ESP32
+  BaseType_t woken = pdFALSE;
+  if (scanTask != NULL) {
+    vTaskNotifyGiveFromISR(scanTask, &woken);
+  }
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+  #endif
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::begin(int rfidss, bool usePN532, int rfidgain, int irqpin, NtpClient* ntp, bool debug) {
   this->debug = debug;
   this->ntpClient = ntp;
+  this->irqPin = irqpin;
   mfrc522.PCD_SetAntennaGain(rfidgain);
   delay(50);
   mfrc522.PCD_Init(rfidss, 0);
@@ -13,6 +32,24 @@ bool ICACHE_FLASH_ATTR EvseWiFiRfid::begin(int rfidss, bool usePN532, int rfidga
   if (debug) Serial.println("");
   delay(50);
   printReaderDetails();
+  if (irqPin >= 0) {
+    pinMode(irqPin, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(irqPin), onReaderIrq, FALLING);
+    if (debug) Serial.printf("[ INFO ] RFID IRQ pin: %d\n", irqPin);
+  }
+  armIrq();
+  loadUsers();
+  millisCheck = millis();
+  #ifdef ESP32
+  // Core 0 next to WiFi, the loop keeps core 1. The OLED shares the SPI
+  // bus; the SPI driver locks it per transaction.
+  scanQueue = xQueueCreate(RFID_QUEUE, sizeof(s_rfidScan));
+  if (scanQueue == NULL || xTaskCreatePinnedToCore(runTask, "rfid", RFID_TASK_STACK, this, 1, &scanTask, 0) != pdPASS) {
+    Serial.println(F("[ WARN ] Cannot start the RFID task"));
+    return false;
+  }
+  #endif
+  started = true;
   return true;
 }
 
@@ -40,148 +77,392 @@ void ICACHE_FLASH_ATTR EvseWiFiRfid::printReaderDetails() {
   }
 }
 
-scanResult ICACHE_FLASH_ATTR EvseWiFiRfid::readPicc() {
-  scanResult res;
-  //RC522
-    if (! mfrc522.PICC_IsNewCardPresent()) {
-      delay(50);
-      res.read = false;
-      this->cooldown = millis() + 50;
-      return res;
-    }
-    if (! mfrc522.PICC_ReadCardSerial()) {
-      delay(50);
-      res.read = false;
-      this->cooldown = millis() + 50;
-      return res;
+// A card read completely, with its user; false while there is none. On
+// ESP32 it comes from the task, on ESP8266 the reader is served right here.
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::getScan(scanResult& result) {
+  if (!started) {
+    return false;
+  }
+  s_rfidScan scan;
+  #ifdef ESP32
+  if (xQueueReceive(scanQueue, &scan, 0) != pdTRUE) {
+    return false;
+  }
+  #else
+  if (!service(scan)) {
+    return false;
+  }
+  #endif
+  result = resolve(scan);
+  return true;
+}
+
+#ifdef ESP32
+// Sleeps until the interrupt or the next due step, a notification that
+// came early only ends the sleep
+void EvseWiFiRfid::runTask(void* parameter) {
+  EvseWiFiRfid* rfid = (EvseWiFiRfid*)parameter;
+  while (true) {
+    s_rfidScan scan;
+    if (rfid->service(scan) && xQueueSend(scanQueue, &scan, 0) != pdTRUE) {
+      Serial.println(F("[ WARN ] RFID scan dropped, the loop is busy"));
+    }
+    long wait = (long)(rfid->millisNext - millis());
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(constrain(wait, 1, RFID_CHECK_INTERVAL)));
+  }
+}
+#endif
+
+// One step with the reader: the setup check when due, then the card that
+// answered or, when due, the next REQA or poll. After a card the reader
+// rests for RFID_COOLDOWN.
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::service(s_rfidScan& scan) {
+  if (toReset) {
+    toReset = false;
+    initReader();
+  }
+  if (millis() - millisCheck >= RFID_CHECK_INTERVAL) {
+    millisCheck = millis();
+    if (!isReaderReady()) {
+      if (this->debug) Serial.println(F("[ RFID ] Reader lost its setup, PCD_Init() again"));
+      initReader();
     }
+  }
+  bool due = (long)(millis() - millisNext) >= 0;
+  if (due) {
+    cooling = false;
+  }
+  if (!due && (cooling || !irqPending)) {
+    return false;
+  }
+  bool found = irqPin >= 0 ? readAnswered(scan) : poll(scan);
+  cooling = found;
+  millisNext = millis() + (found ? RFID_COOLDOWN : irqPin >= 0 ? RFID_KICK_INTERVAL : RFID_POLL_INTERVAL);
+  return found;
+}
+
+// With IRQ pin: a card answered the last REQA, or a new REQA goes out
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::readAnswered(s_rfidScan& scan) {
+  if (!irqPending) {
+    sendRequest();
+    return false;
+  }
+  irqPending = false;
+  mfrc522.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);
+  if (!mfrc522.PICC_ReadCardSerial()) {
+    return false;
+  }
+  takeCard(scan);
+  return true;
+}
+
+// Without IRQ pin, waits for the reader's timeout when no card is there
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::poll(s_rfidScan& scan) {
+  if (!mfrc522.PICC_IsNewCardPresent() || !mfrc522.PICC_ReadCardSerial()) {
+    return false;
+  }
+  takeCard(scan);
+  return true;
+}
+
+// The interrupts of the select and halt are no card
+void ICACHE_FLASH_ATTR EvseWiFiRfid::takeCard(s_rfidScan& scan) {
+  scan.size = min((uint8_t)mfrc522.uid.size, (uint8_t)sizeof(scan.uid));
+  memcpy(scan.uid, mfrc522.uid.uidByte, scan.size);
+  scan.sak = mfrc522.uid.sak;
+  mfrc522.PICC_HaltA();
+  if (irqPin >= 0) {
+    mfrc522.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);
+    irqPending = false;
+  }
+}
+
+// REQA without waiting for the answer, a card's ATQA raises RxIRq
+void ICACHE_FLASH_ATTR EvseWiFiRfid::sendRequest() {
+  mfrc522.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);
+  mfrc522.PCD_WriteRegister(MFRC522::FIFOLevelReg, 0x80);
+  mfrc522.PCD_WriteRegister(MFRC522::FIFODataReg, MFRC522::PICC_CMD_REQA);
+  mfrc522.PCD_WriteRegister(MFRC522::CommandReg, MFRC522::PCD_Transceive);
+  mfrc522.PCD_WriteRegister(MFRC522::BitFramingReg, 0x87);     // start, 7 bits
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiRfid::initReader() {
+  mfrc522.PCD_Init();
+  armIrq();
+}
+
+// RxIRq on the IRQ pin, active low
+void ICACHE_FLASH_ATTR EvseWiFiRfid::armIrq() {
+  if (irqPin < 0) {
+    return;
+  }
+  mfrc522.PCD_WriteRegister(MFRC522::ComIEnReg, 0xA0);
+  mfrc522.PCD_WriteRegister(MFRC522::ComIrqReg, 0x7F);
+  irqPending = false;
+}
+
+// PCD_Init() starts the timer automatically and the antenna; a reader that
+// was reset by a brown-out or lost on the bus reads back otherwise
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::isReaderReady() {
+  if (mfrc522.PCD_ReadRegister(MFRC522::TModeReg) != 0x80 ||
+      (mfrc522.PCD_ReadRegister(MFRC522::TxControlReg) & 0x03) != 0x03) {
+    return false;
+  }
+  return irqPin < 0 || mfrc522.PCD_ReadRegister(MFRC522::ComIEnReg) == 0xA0;
+}
+
+scanResult ICACHE_FLASH_ATTR EvseWiFiRfid::resolve(const s_rfidScan& scan) {
+  scanResult res;
     res.read = true;
     Serial.println("[ RFID ] Card detected to read!"); ///DEBUG
-    mfrc522.PICC_HaltA();
-    this->cooldown = millis() + 3000;
     if (this->debug) Serial.print(F("[ INFO ] PICC's UID: "));
     String uid = "";
-    for (int i = 0; i < mfrc522.uid.size; ++i) {
-      uid += String(mfrc522.uid.uidByte[i], HEX);
+    for (int i = 0; i < scan.size; ++i) {
+      uid += String(scan.uid[i], HEX);
     }
     res.uid = uid;
     if (this->debug) Serial.print(uid);
-    MFRC522::PICC_Type piccType = mfrc522.PICC_GetType(mfrc522.uid.sak);
+    MFRC522::PICC_Type piccType = mfrc522.PICC_GetType(scan.sak);
     String type = mfrc522.PICC_GetTypeName(piccType);
     res.type = type;
   
-    int AccType = 0;
-    String filename = "/P/";
-    filename += res.uid;
-    File rfidFile = SPIFFS.open(filename, "r");
-    #ifdef ESP8266
-    if (rfidFile)  // Known PICC
-    #else
-    if (SPIFFS.exists(filename)) 
-    #endif
-    {
+    uint8_t packed[RFID_UID_DIGITS / 2];
+    uint8_t digits;
+    int slot = -1;
+    if (packUid(res.uid.c_str(), packed, digits)) {
+      slot = findUser(packed, digits);
+    }
+    char user[RFID_NAME_LENGTH];
+    uint8_t acctype = 0;
+    uint32_t validuntil = 0;
+    if (slot >= 0) {
       res.known = true;
-      String jsonString = "";
-      while (rfidFile.available()) {
-        jsonString += char(rfidFile.read());
+      snprintf(user, RFID_NAME_LENGTH, "%s", names + users[slot].name);
+      acctype = users[slot].acctype;
+      validuntil = users[slot].validuntil;
+    }
+    else if (!loaded || overflow) {   // not everything is in RAM
+      s_userRecord record;
+      if (userDb.find(res.uid.c_str(), record)) {
+        res.known = true;
+        snprintf(user, RFID_NAME_LENGTH, "%s", record.user);
+        acctype = record.acctype;
+        validuntil = record.validuntil;
+      }
+    }
+    if (res.known) {  // Known PICC
+      res.user = user;
+      if (this->debug) Serial.println(" = known PICC");
+      if (this->debug) Serial.print("[ INFO ] User Name: ");
+      if (res.user == "undefined") {
+        if (this->debug) Serial.print(res.uid);
       }
-      StaticJsonDocument<200> jsonDoc;
-      DeserializationError error = deserializeJson(jsonDoc, jsonString);
-      if (!error) {
-        res.user = strdup(jsonDoc["user"]);
-        AccType = jsonDoc["acctype"];
-        if (this->debug) Serial.println(" = known PICC");
-        if (this->debug) Serial.print("[ INFO ] User Name: ");
-        if (res.user == "undefined") {
-          if (this->debug) Serial.print(res.uid);
-        }
-        else {
-          if (this->debug) Serial.print(res.user);
-        }
-        if ((AccType == 1 || AccType == 99) &&
-            ntpClient->getUtcTimeNow() < jsonDoc["validuntil"]) {
-          if (this->debug) Serial.println(" have permission");
-          res.valid = true;
-        }
-        else {
-          if (this->debug) Serial.println(" does not have permission");
-        }
+      else {
+        if (this->debug) Serial.print(res.user);
+      }
+      if (isPermitted(acctype, validuntil)) {
+        if (this->debug) Serial.println(" have permission");
+        res.valid = true;
       }
       else {
-        if (this->debug) Serial.println("");
-        if (this->debug) Serial.println(F("[ WARN ] Failed to parse User Data"));
+        if (this->debug) Serial.println(" does not have permission");
       }
     }
     else { // Unknown PICC
       if (this->debug) Serial.println(" = unknown PICC");
     }
-    rfidFile.close();
     return res;
- return res;
-}
-
-DynamicJsonDocument ICACHE_FLASH_ATTR EvseWiFiRfid::getUserList(int page) {
-  Serial.print("getUserlist - Page: ");
-  Serial.println(page);
-  DynamicJsonDocument jsonDoc(3000);
-  jsonDoc["command"] = "userlist";
-  jsonDoc["page"] = page;
-  JsonArray users = jsonDoc.createNestedArray("list");
-  #ifdef ESP8266
-  Dir dir = SPIFFS.openDir("/P/");
-  #else
-  File dir = SPIFFS.open("/P");
-  #endif
-  int first = (page - 1) * 15;
-  int last = page * 15;
-  int i = 0;
-  #ifdef ESP8266
-  while (dir.next()) {
-  #else
-  File file = dir.openNextFile();
-  while (file) {
-  #endif
-    if (i >= first && i < last) {
-      JsonObject item = users.createNestedObject();
-      #ifdef ESP8266
-      String uid = dir.fileName();
-      File f = SPIFFS.open(dir.fileName(), "r");
-      #else
-      String uid = file.name();
-      File f = SPIFFS.open(file.name(), "r");
-      #endif
-      uid.remove(0, 3);
-      item["uid"] = uid;
-      size_t size = f.size();
-      std::unique_ptr<char[]> buf(new char[size]);
-      f.readBytes(buf.get(), size);
-      StaticJsonDocument<200> jsonDoc2;
-      DeserializationError error = deserializeJson(jsonDoc2, buf.get());
-      if (!error) {
-        String username = jsonDoc2["user"];
-        int AccType = jsonDoc2["acctype"];
-        unsigned long validuntil = jsonDoc2["validuntil"];
-        item["username"] = username;
-        item["acctype"] = AccType;
-        item["validuntil"] = validuntil;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::isPermitted(uint8_t acctype, uint32_t validuntil) {
+  return (acctype == 1 || acctype == 99) && ntpClient->getUtcTimeNow() < (time_t)validuntil;
+}
+
+// Reads the user database once, later changes come through setUser()/removeUser()
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::loadUsers() {
+  clearUsers();
+  loaded = true;
+  s_userCursor cursor;
+  s_userRecord record;
+  userDb.openList(cursor);
+  while (userDb.nextUser(cursor, record)) {
+    setUser(record.uid, record.user, record.acctype, record.validuntil);
+  }
+  cursor.file.close();
+  if (this->debug) Serial.printf("[ INFO ] %u RFID users in RAM%s\n", userCount, overflow ? ", more on flash" : "");
+  return !overflow;
+}
+
+// false if the user is not in RAM - a scan then reads the file, if the
+// table is full - or cannot be, if no scan can yield that UID
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::setUser(const char* uid, const char* user, uint8_t acctype, uint32_t validuntil) {
+  uint8_t packed[RFID_UID_DIGITS / 2];
+  uint8_t digits;
+  if (!loaded || !packUid(uid, packed, digits)) {
+    return false;
+  }
+  int slot = findUser(packed, digits);
+  if (slot >= 0) {
+    removeSlot(slot);
+  }
+  uint16_t name;
+  if (userCount >= RFID_USERS || !addName(user ? user : "", name)) {
+    overflow = true;
+    return false;
+  }
+  slot = hashUid(packed, digits);
+  while (users[slot].digits) {
+    slot = (slot + 1) & (RFID_USER_SLOTS - 1);
+  }
+  memcpy(users[slot].uid, packed, sizeof(packed));
+  users[slot].digits = digits;
+  users[slot].acctype = acctype;
+  users[slot].validuntil = validuntil;
+  users[slot].name = name;
+  userCount++;
+  return true;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiRfid::removeUser(const char* uid) {
+  uint8_t packed[RFID_UID_DIGITS / 2];
+  uint8_t digits;
+  if (!loaded || !packUid(uid, packed, digits)) {
+    return;
+  }
+  int slot = findUser(packed, digits);
+  if (slot >= 0) {
+    removeSlot(slot);
+  }
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiRfid::clearUsers() {
+  memset(users, 0, sizeof(users));
+  userCount = 0;
+  namesUsed = 0;
+  overflow = false;
+}
+
+// Linear probing, the table is never more than 3/4 full
+int ICACHE_FLASH_ATTR EvseWiFiRfid::findUser(const uint8_t* uid, uint8_t digits) {
+  uint16_t slot = hashUid(uid, digits);
+  while (users[slot].digits) {
+    if (users[slot].digits == digits && memcmp(users[slot].uid, uid, RFID_UID_DIGITS / 2) == 0) {
+      return slot;
+    }
+    slot = (slot + 1) & (RFID_USER_SLOTS - 1);
+  }
+  return -1;
+}
+
+// Entries behind the slot move up into the gap, no tombstones needed.
+// The name stays in the pool until the next compaction.
+void ICACHE_FLASH_ATTR EvseWiFiRfid::removeSlot(uint16_t slot) {
+  const uint16_t mask = RFID_USER_SLOTS - 1;
+  users[slot].digits = 0;
+  userCount--;
+  uint16_t hole = slot;
+  uint16_t i = slot;
+  while (true) {
+    i = (i + 1) & mask;
+    if (!users[i].digits) {
+      break;
+    }
+    uint16_t home = hashUid(users[i].uid, users[i].digits);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      users[hole] = users[i];
+      users[i].digits = 0;
+      hole = i;
+    }
+  }
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::addName(const char* user, uint16_t& offset) {
+  size_t length = min(strlen(user), (size_t)(RFID_NAME_LENGTH - 1));
+  if (namesUsed + length + 1 > RFID_NAMES) {
+    compactNames();
+  }
+  if (namesUsed + length + 1 > RFID_NAMES) {
+    return false;
+  }
+  memcpy(names + namesUsed, user, length);
+  names[namesUsed + length] = '\0';
+  offset = namesUsed;
+  namesUsed += length + 1;
+  return true;
+}
+
+// Moves the names still in use to the front, in pool order
+void ICACHE_FLASH_ATTR EvseWiFiRfid::compactNames() {
+  uint16_t used = 0;
+  uint16_t from = 0;
+  while (true) {
+    int next = -1;
+    for (uint16_t i = 0; i < RFID_USER_SLOTS; i++) {
+      if (users[i].digits && users[i].name >= from && (next < 0 || users[i].name < users[next].name)) {
+        next = i;
       }
     }
-    i++;
-    #ifdef ESP32
-    file = dir.openNextFile();
-    #endif
+    if (next < 0) {
+      break;
+    }
+    uint16_t offset = users[next].name;
+    size_t length = strlen(names + offset) + 1;
+    memmove(names + used, names + offset, length);
+    users[next].name = used;
+    used += length;
+    from = offset + length;
   }
-  serializeJson(jsonDoc, Serial);
-  float pages = i / 15.0;
-  jsonDoc["haspages"] = ceil(pages);
-  return jsonDoc;
+  namesUsed = used;
+}
+
+// readPicc() writes the UID bytes as lower case hex without padding, so
+// the digits are the key - anything else can never be scanned
+bool ICACHE_FLASH_ATTR EvseWiFiRfid::packUid(const char* uid, uint8_t* packed, uint8_t& digits) {
+  memset(packed, 0, RFID_UID_DIGITS / 2);
+  digits = 0;
+  if (uid == NULL) {
+    return false;
+  }
+  for (; uid[digits] != '\0'; digits++) {
+    char c = uid[digits];
+    uint8_t value;
+    if (c >= '0' && c <= '9') {
+      value = c - '0';
+    }
+    else if (c >= 'a' && c <= 'f') {
+      value = c - 'a' + 10;
+    }
+    else {
+      return false;
+    }
+    if (digits >= RFID_UID_DIGITS) {
+      return false;
+    }
+    packed[digits / 2] |= (digits % 2) ? value : value << 4;
+  }
+  return digits > 0;
+}
+
+// FNV-1a over the packed digits and their count
+uint16_t ICACHE_FLASH_ATTR EvseWiFiRfid::hashUid(const uint8_t* packed, uint8_t digits) {
+  uint32_t hash = 2166136261UL;
+  for (uint8_t i = 0; i < RFID_UID_DIGITS / 2; i++) {
+    hash = (hash ^ packed[i]) * 16777619UL;
+  }
+  hash = (hash ^ digits) * 16777619UL;
+  return hash & (RFID_USER_SLOTS - 1);
 }
 
 bool ICACHE_FLASH_ATTR EvseWiFiRfid::performSelfTest() {
   return mfrc522.PCD_PerformSelfTest();
 }
 
+// On ESP32 the task does it before its next step
 bool ICACHE_FLASH_ATTR EvseWiFiRfid::reset() {
-  mfrc522.PCD_Init();
+  #ifdef ESP32
+  toReset = true;
+  #else
+  initReader();
+  #endif
   return true;
 }
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include "s0meter.h"
+
+void ICACHE_FLASH_ATTR EvseWiFiS0Meter::begin(uint16_t impPerKwh, uint8_t factor, uint16_t impLength) {
+  this->impPerKwh = impPerKwh;
+  this->factor = factor;
+  this->minInterval = ((uint32_t)impLength + S0_BOUNCE_MARGIN) * 1000UL;
+  ringTail = ringHead;
+  historyCount = 0;
+  pulses = 0;
+  pulsesReset = 0;
+  rejected = 0;
+  power = 0.0;
+  millisUpdate = millis();
+}
+
+// Interrupt context - a timestamp and an index, nothing else
+void ICACHE_RAM_ATTR EvseWiFiS0Meter::pulse() {
+  uint32_t now = micros();
+  uint8_t head = ringHead;
+  uint8_t next = (head + 1) & (S0_RING_SIZE - 1);
+  if (next == ringTail) {
+    overruns++;
+    return;
+  }
+  ring[head] = now;
+  ringHead = next;
+}
+
+// Returns true whenever there is a new power value
+bool ICACHE_FLASH_ATTR EvseWiFiS0Meter::loop() {
+  uint8_t head = ringHead;
+  while (ringTail != head) {
+    accept(ring[ringTail]);
+    ringTail = (ringTail + 1) & (S0_RING_SIZE - 1);
+  }
+  if (millis() - millisUpdate < S0_UPDATE_INTERVAL) {
+    return false;
+  }
+  millisUpdate = millis();
+  power = calculate(micros());
+  return true;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiS0Meter::accept(uint32_t timestamp) {
+  if (historyCount > 0 && timestamp - getHistory(0) < minInterval) {
+    rejected++;
+    return;
+  }
+  history[historyHead] = timestamp;
+  historyHead = (historyHead + 1) % S0_HISTORY;
+  if (historyCount < S0_HISTORY) {
+    historyCount++;
+  }
+  pulses++;
+}
+
+// age 0 is the latest pulse
+uint32_t ICACHE_FLASH_ATTR EvseWiFiS0Meter::getHistory(uint8_t age) {
+  return history[(historyHead + S0_HISTORY - 1 - age) % S0_HISTORY];
+}
+
+// Average over all pulse intervals that reach into the window. The interval
+// still running counts as well: once it is longer than the average, the
+// power must have dropped to at most one pulse per elapsed time, and it
+// fades out to 0 by S0_STOP_INTERVALS average intervals without a pulse.
+float ICACHE_FLASH_ATTR EvseWiFiS0Meter::calculate(uint32_t microsNow) {
+  if (historyCount == 0 || impPerKwh == 0) {
+    return 0.0;
+  }
+  uint32_t latest = getHistory(0);
+  uint32_t sinceLatest = microsNow - latest;
+  if (sinceLatest > S0_IDLE_TIMEOUT * 1000UL) {
+    historyCount = 0;   // also keeps the timestamps clear of the micros() wrap
+    return 0.0;
+  }
+  if (historyCount < 2) {
+    return 0.0;
+  }
+  uint8_t intervals = 0;
+  uint32_t oldest = latest;
+  while (intervals < historyCount - 1) {
+    intervals++;
+    oldest = getHistory(intervals);
+    if (microsNow - oldest >= S0_WINDOW * 1000UL) {
+      break;
+    }
+  }
+  uint32_t span = latest - oldest;
+  float overdue = (float)sinceLatest * intervals / (float)span;   // in average intervals
+  if (overdue >= S0_STOP_INTERVALS) {
+    return 0.0;     // pulses overdue, the load has stopped
+  }
+  float pulsesPerHour = (float)intervals * 3600e6 / (float)span;
+  if (overdue > 1.0) {
+    pulsesPerHour = pulsesPerHour * (S0_STOP_INTERVALS - overdue) / (S0_STOP_INTERVALS - 1);
+    if (pulsesPerHour > 3600e6 / (float)sinceLatest) {
+      pulsesPerHour = 3600e6 / (float)sinceLatest;
+    }
+  }
+  return pulsesPerHour / impPerKwh * factor;
+}
+
+// kW
+float ICACHE_FLASH_ATTR EvseWiFiS0Meter::getPower() {
+  return power;
+}
+
+// Wh since resetEnergy(), scaled from the pulse count without floats. Both
+// ends are scaled from the running count, so the parts of a Wh that do not
+// make it into one session show up in the next one.
+uint64_t ICACHE_FLASH_ATTR EvseWiFiS0Meter::getWattHours() {
+  if (impPerKwh == 0) {
+    return 0;
+  }
+  return pulses * 1000 * factor / impPerKwh - pulsesReset * 1000 * factor / impPerKwh;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiS0Meter::resetEnergy() {
+  pulsesReset = pulses;
+}
+
+// Bounces and pulses lost to a full ring
+uint32_t ICACHE_FLASH_ATTR EvseWiFiS0Meter::getRejected() {
+  return rejected + overruns;
+}
@@ -0,0 +1,141 @@
+#include "sdm.h"
+
+// Register maps from the Eastron protocol documentation (input registers, IEEE754 float)
+static constexpr s_sdmRegister sdm120Registers[] = {
+  {SDM_VOLTAGE_P1, 0x0000},
+  {SDM_CURRENT_P1, 0x0006},
+  {SDM_POWER_TOTAL, 0x000C},
+  {SDM_ENERGY_TOTAL, 0x0156}
+};
+
+static constexpr s_sdmRegister sdm630Registers[] = {
+  {SDM_VOLTAGE_P1, 0x0000},
+  {SDM_VOLTAGE_P2, 0x0002},
+  {SDM_VOLTAGE_P3, 0x0004},
+  {SDM_CURRENT_P1, 0x0006},
+  {SDM_CURRENT_P2, 0x0008},
+  {SDM_CURRENT_P3, 0x000A},
+  {SDM_POWER_TOTAL, 0x0034},
+  {SDM_ENERGY_TOTAL, 0x0156}
+};
+
+// SDM220 uses the SDM120 map, SDM72 (D-M V2) the SDM630 map
+static constexpr s_sdmModel sdmModels[] = {
+  {"SDM120", sdm120Registers, sizeof(sdm120Registers) / sizeof(s_sdmRegister)},
+  {"SDM220", sdm120Registers, sizeof(sdm120Registers) / sizeof(s_sdmRegister)},
+  {"SDM630", sdm630Registers, sizeof(sdm630Registers) / sizeof(s_sdmRegister)},
+  {"SDM72", sdm630Registers, sizeof(sdm630Registers) / sizeof(s_sdmRegister)}
+};
+
+bool ICACHE_FLASH_ATTR EvseWiFiSdmMeter::begin(EvseWiFiModbus* bus, uint8_t slave, const char* type) {
+  this->bus = bus;
+  this->slave = slave;
+  this->model = NULL;
+  for (uint8_t i = 0; i < sizeof(sdmModels) / sizeof(s_sdmModel); i++) {
+    if (strcmp(type, sdmModels[i].name) == 0) {
+      this->model = &sdmModels[i];
+    }
+  }
+  if (model == NULL) {
+    return false;
+  }
+  memset(values, 0, sizeof(values));
+  updated = 0;
+  pending = 0;
+  plan();
+  return true;
+}
+
+// Merge neighbouring registers into blocks - reading a few unused registers is
+// far cheaper than the request/turnaround overhead of another transaction
+void ICACHE_FLASH_ATTR EvseWiFiSdmMeter::plan() {
+  blockCount = 0;
+  for (uint8_t i = 0; i < model->count; i++) {
+    uint16_t address = model->registers[i].address;
+    if (blockCount > 0) {
+      s_sdmBlock& last = blocks[blockCount - 1];
+      uint16_t end = last.address + last.quantity;
+      if (address - end <= SDM_MAX_GAP && address + 2 - last.address <= MODBUS_MAX_REGS) {
+        last.quantity = address + 2 - last.address;
+        continue;
+      }
+    }
+    if (blockCount >= SDM_MAX_BLOCKS) {
+      break;
+    }
+    blocks[blockCount].address = address;
+    blocks[blockCount].quantity = 2;
+    blockCount++;
+  }
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSdmMeter::poll(SdmCallback callback) {
+  if (model == NULL || bus == NULL || pending > 0) {
+    return false;
+  }
+  this->callback = callback;
+  cycleResult = MODBUS_SUCCESS;
+  updated = 0;
+  for (uint8_t i = 0; i < blockCount; i++) {
+    if (bus->readInputRegisters(slave, blocks[i].address, blocks[i].quantity, onResponse, this)) {
+      pending++;
+    }
+  }
+  return pending > 0;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSdmMeter::isUpdated(SdmValue value) {
+  return updated & (1 << value);
+}
+
+float ICACHE_FLASH_ATTR EvseWiFiSdmMeter::get(SdmValue value) {
+  return values[value];
+}
+
+// Last polled value as the meter would send it, for registers of the model's table only
+bool ICACHE_FLASH_ATTR EvseWiFiSdmMeter::getRegister(uint16_t address, uint16_t& value) {
+  if (model == NULL) {
+    return false;
+  }
+  for (uint8_t i = 0; i < model->count; i++) {
+    const s_sdmRegister& reg = model->registers[i];
+    if (address == reg.address || address == reg.address + 1) {
+      uint32_t raw;
+      memcpy(&raw, &values[reg.value], sizeof(raw));
+      value = (address == reg.address) ? (uint16_t)(raw >> 16) : (uint16_t)raw;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint8_t ICACHE_FLASH_ATTR EvseWiFiSdmMeter::getBlockCount() {
+  return blockCount;
+}
+
+// Eastron sends the high word first
+float ICACHE_FLASH_ATTR EvseWiFiSdmMeter::decodeFloat(const uint16_t* registers) {
+  uint32_t raw = ((uint32_t)registers[0] << 16) | registers[1];
+  float value;
+  memcpy(&value, &raw, sizeof(value));
+  return value;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiSdmMeter::onResponse(uint8_t result, const s_modbusRequest* request, const uint16_t* response) {
+  EvseWiFiSdmMeter* meter = (EvseWiFiSdmMeter*)request->context;
+  if (result == MODBUS_SUCCESS) {
+    for (uint8_t i = 0; i < meter->model->count; i++) {
+      const s_sdmRegister& reg = meter->model->registers[i];
+      if (reg.address >= request->address && reg.address + 2 <= request->address + request->quantity) {
+        meter->values[reg.value] = decodeFloat(&response[reg.address - request->address]);
+        meter->updated |= (1 << reg.value);
+      }
+    }
+  }
+  else if (meter->cycleResult == MODBUS_SUCCESS) {
+    meter->cycleResult = result;
+  }
+  if (meter->pending > 0 && --meter->pending == 0 && meter->callback) {
+    meter->callback(meter->cycleResult);
+  }
+}
@@ -0,0 +1,903 @@
+#include "sessionlog.h"
+
+// Downloads are read from the web server task on ESP32
+#ifdef ESP32
+static portMUX_TYPE sessionLogMux = portMUX_INITIALIZER_UNLOCKED;
+#define SESSIONLOG_ENTER_CRITICAL() portENTER_CRITICAL(&sessionLogMux)
+#define SESSIONLOG_EXIT_CRITICAL() portEXIT_CRITICAL(&sessionLogMux)
+#else
+#define SESSIONLOG_ENTER_CRITICAL()
+#define SESSIONLOG_EXIT_CRITICAL()
+#endif
+
+// Reads the index and recounts the newest segment, the only one a power
+// loss can have left behind its index entry
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::begin() {
+  segmentCount = 0;
+  File file = storage.open(SESSIONLOG_INDEX, "r");
+  if (!file) {
+    return true;
+  }
+  s_sessionSegment segment;
+  while (segmentCount < SESSIONLOG_SEGMENTS &&
+         file.read((uint8_t*)&segment, sizeof(segment)) == sizeof(segment)) {
+    if (segment.check != checksum(segment)) {
+      continue;
+    }
+    if (segmentCount > 0) {
+      s_sessionSegment& previous = segments[segmentCount - 1];
+      if (segment.month <= previous.month || segment.firstSequence < previous.firstSequence + previous.count) {
+        continue;
+      }
+    }
+    segments[segmentCount++] = segment;
+  }
+  file.close();
+  if (segmentCount > 0) {
+    scanSegment(segmentCount - 1);
+  }
+  nextSequence = getStoredLast() + 1;
+  pendingCount = 0;
+  hasLatest = readStored(getStoredLast(), latest);
+  return true;
+}
+
+// Takes the next sequence and queues the record, false when the queue is full
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::append(s_sessionRecord& record) {
+  SESSIONLOG_ENTER_CRITICAL();
+  bool queued = !isFull();
+  if (queued) {
+    record.sequence = nextSequence++;
+    queue(record, true);
+  }
+  SESSIONLOG_EXIT_CRITICAL();
+  return queued;
+}
+
+// Queues a rewrite, the sequence must be in a segment or still queued
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::update(s_sessionRecord& record) {
+  if (findPending(record.sequence) < 0 && findSegment(record.sequence) < 0) {
+    return false;
+  }
+  SESSIONLOG_ENTER_CRITICAL();
+  bool queued = queue(record, false);
+  SESSIONLOG_EXIT_CRITICAL();
+  return queued;
+}
+
+// A record already queued is replaced, an append stays an append. Called
+// in the critical section, downloads read the queue as well.
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::queue(const s_sessionRecord& record, bool append) {
+  int index = findPending(record.sequence);
+  if (index >= 0) {
+    pending[index].record = record;
+  }
+  else if (isFull()) {
+    return false;
+  }
+  else {
+    pending[pendingCount].record = record;
+    pending[pendingCount].append = append;
+    pendingCount++;
+  }
+  if (record.sequence == getLast()) {
+    latest = record;
+    hasLatest = true;
+  }
+  return true;
+}
+
+int ICACHE_FLASH_ATTR EvseWiFiSessionLog::findPending(uint32_t sequence) {
+  for (uint8_t i = 0; i < pendingCount; i++) {
+    if (pending[i].record.sequence == sequence) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Writes up to max queued operations in order, false if one of them failed.
+// A failed one is dropped - retrying would only keep the bus waiting. False
+// as well while a download is open, then nothing is written.
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::flush(uint8_t max) {
+  if (!beginWrite()) {
+    return false;
+  }
+  bool success = true;
+  uint8_t done = 0;
+  while (done < pendingCount && done < max) {
+    s_sessionPending& operation = pending[done];
+    success &= operation.append ? store(operation.record) : rewrite(operation.record);
+    done++;
+  }
+  SESSIONLOG_ENTER_CRITICAL();
+  pendingCount -= done;
+  memmove(&pending[0], &pending[done], pendingCount * sizeof(s_sessionPending));
+  SESSIONLOG_EXIT_CRITICAL();
+  endWrite();
+  return success;
+}
+
+// Writes come from the main loop only and wait for open downloads; on
+// ESP32 those are read on another task. Downloads that stopped reading
+// are dropped here.
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::beginWrite() {
+  unsigned long now = millis();
+  SESSIONLOG_ENTER_CRITICAL();
+  bool free = writing > 0 || !isReadAlive(now);
+  if (free) {
+    if (readers > 0) {
+      readers = 0;
+      readGeneration++;
+    }
+    writing++;
+  }
+  SESSIONLOG_EXIT_CRITICAL();
+  return free;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiSessionLog::endWrite() {
+  SESSIONLOG_ENTER_CRITICAL();
+  writing--;
+  SESSIONLOG_EXIT_CRITICAL();
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::isReadAlive(unsigned long now) {
+  return readers > 0 && now - millisRead < SESSIONLOG_READ_TIMEOUT;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::isReading() {
+  unsigned long now = millis();
+  SESSIONLOG_ENTER_CRITICAL();
+  bool alive = isReadAlive(now);
+  SESSIONLOG_EXIT_CRITICAL();
+  return alive;
+}
+
+// Refused while the main loop writes, any number of downloads may be open
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::openRead(uint32_t& generation) {
+  unsigned long now = millis();
+  SESSIONLOG_ENTER_CRITICAL();
+  bool free = writing == 0;
+  if (free) {
+    if (readers > 0 && !isReadAlive(now)) {
+      readers = 0;
+      readGeneration++;
+    }
+    readers++;
+    millisRead = now;
+    generation = readGeneration;
+  }
+  SESSIONLOG_EXIT_CRITICAL();
+  return free;
+}
+
+// False once the download was dropped, the log may have been written since
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::continueRead(uint32_t generation) {
+  unsigned long now = millis();
+  SESSIONLOG_ENTER_CRITICAL();
+  bool alive = generation == readGeneration && isReadAlive(now);
+  if (alive) {
+    millisRead = now;
+  }
+  SESSIONLOG_EXIT_CRITICAL();
+  return alive;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiSessionLog::closeRead(uint32_t generation) {
+  SESSIONLOG_ENTER_CRITICAL();
+  if (generation == readGeneration && readers > 0) {
+    readers--;
+  }
+  SESSIONLOG_EXIT_CRITICAL();
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::isPending() {
+  return pendingCount > 0;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::isFull() {
+  return pendingCount >= SESSIONLOG_QUEUE;
+}
+
+// One record into the segment of its month, one index entry
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::store(s_sessionRecord& record) {
+  uint32_t month = record.timestamp ? toMonth(record.timestamp) : 0;
+  bool pruned = false;
+  while (segmentCount > 1 && storage.getFreeBytes() < SESSIONLOG_MIN_FREE) {
+    pruned |= prune();
+  }
+  if (segmentCount == 0 || month > segments[segmentCount - 1].month) {
+    if (segmentCount == SESSIONLOG_SEGMENTS) {
+      pruned |= prune();
+    }
+    s_sessionSegment& segment = segments[segmentCount];
+    memset(&segment, 0, sizeof(segment));
+    segment.month = month;
+    segment.firstTimestamp = record.timestamp;
+    segment.lastTimestamp = record.timestamp;
+    segment.firstSequence = record.sequence;
+    char name[32];
+    segmentName(month, name);
+    File file = storage.open(name, "w");   // drops what a lost index entry left behind
+    if (!file) {
+      return false;
+    }
+    file.close();
+    segmentCount++;
+  }
+  uint8_t index = segmentCount - 1;
+  if (!write(index, record)) {
+    return false;
+  }
+  if (record.state == SESSION_FINISHED) {
+    addTotal(segments[index].month, record);
+  }
+  s_sessionSegment& segment = segments[index];
+  segment.count = record.sequence - segment.firstSequence + 1;
+  segment.users |= userBit(record.uid);
+  if (record.state == SESSION_FINISHED) {
+    segment.energy += record.energy;
+  }
+  if (record.timestamp > segment.lastTimestamp) {
+    segment.lastTimestamp = record.timestamp;
+  }
+  return pruned ? writeIndex() : writeSegment(index);
+}
+
+// Rewrites a record in place, the sequence must still be in a segment
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::rewrite(s_sessionRecord& record) {
+  int index = findSegment(record.sequence);
+  if (index < 0) {
+    return false;
+  }
+  s_sessionRecord previous;
+  bool finished = readStored(record.sequence, previous) && previous.state == SESSION_FINISHED;
+  if (!write(index, record)) {
+    return false;
+  }
+  if (finished) {
+    segments[index].energy -= previous.energy;
+    addTotal(segments[index].month, previous, true);
+  }
+  if (record.state == SESSION_FINISHED) {
+    segments[index].energy += record.energy;
+    addTotal(segments[index].month, record);
+  }
+  segments[index].users |= userBit(record.uid);
+  return writeSegment(index);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::write(uint8_t index, s_sessionRecord& record) {
+  record.uid[sizeof(record.uid) - 1] = '\0';
+  record.username[sizeof(record.username) - 1] = '\0';
+  record.check = checksum(record);
+  size_t offset = (record.sequence - segments[index].firstSequence) * sizeof(s_sessionRecord);
+
+  char name[32];
+  segmentName(segments[index].month, name);
+  File file = storage.open(name, storage.exists(name) ? "r+" : "w");
+  if (!file) {
+    return false;
+  }
+  size_t size = file.size();
+  if (offset > size) {
+    // Positions lost to a truncated file are filled with invalid records
+    s_sessionRecord empty;
+    memset(&empty, 0, sizeof(empty));
+    file.seek(size - size % sizeof(s_sessionRecord));
+    while (file.position() < offset) {
+      file.write((const uint8_t*)&empty, sizeof(empty));
+    }
+  }
+  else {
+    file.seek(offset);
+  }
+  size_t written = file.write((const uint8_t*)&record, sizeof(record));
+  file.close();
+  return written == sizeof(record);
+}
+
+// Rewrites one index entry in place
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::writeSegment(uint8_t index) {
+  segments[index].check = checksum(segments[index]);
+  size_t offset = index * sizeof(s_sessionSegment);
+  File file = storage.open(SESSIONLOG_INDEX, storage.exists(SESSIONLOG_INDEX) ? "r+" : "w");
+  if (!file) {
+    return false;
+  }
+  if (file.size() < offset) {
+    file.close();
+    return writeIndex();
+  }
+  file.seek(offset);
+  size_t written = file.write((const uint8_t*)&segments[index], sizeof(s_sessionSegment));
+  file.close();
+  return written == sizeof(s_sessionSegment);
+}
+
+// Whole index, only after segments were pruned
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::writeIndex() {
+  File file = storage.open(SESSIONLOG_INDEX, "w");
+  if (!file) {
+    return false;
+  }
+  bool success = true;
+  for (uint8_t i = 0; i < segmentCount; i++) {
+    segments[i].check = checksum(segments[i]);
+    success &= file.write((const uint8_t*)&segments[i], sizeof(s_sessionSegment)) == sizeof(s_sessionSegment);
+  }
+  file.close();
+  return success;
+}
+
+// Count, energy and users from the records, up to the first invalid one
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::scanSegment(uint8_t index) {
+  s_sessionSegment& segment = segments[index];
+  s_sessionSegment scanned = segment;
+  scanned.count = 0;
+  scanned.energy = 0;
+  scanned.users = 0;
+  char name[32];
+  segmentName(segment.month, name);
+  File file = storage.open(name, "r");
+  if (file) {
+    s_sessionRecord record;
+    while (file.read((uint8_t*)&record, sizeof(record)) == sizeof(record) &&
+           record.sequence == scanned.firstSequence + scanned.count && record.check == checksum(record)) {
+      if (scanned.count == 0) {
+        scanned.firstTimestamp = record.timestamp;
+        scanned.lastTimestamp = record.timestamp;
+      }
+      scanned.count++;
+      scanned.users |= userBit(record.uid);
+      if (record.state == SESSION_FINISHED) {
+        scanned.energy += record.energy;
+      }
+      if (record.timestamp > scanned.lastTimestamp) {
+        scanned.lastTimestamp = record.timestamp;
+      }
+    }
+    file.close();
+  }
+  if (scanned.count == segment.count && scanned.energy == segment.energy && scanned.users == segment.users &&
+      scanned.firstTimestamp == segment.firstTimestamp && scanned.lastTimestamp == segment.lastTimestamp) {
+    return true;
+  }
+  segment = scanned;
+  rebuildTotals(index);
+  return writeSegment(index);
+}
+
+// Adds a finished session to the totals of its UID, or takes it back out
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::addTotal(uint32_t month, const s_sessionRecord& record, bool subtract) {
+  char name[32];
+  totalsName(month, name);
+  File file = storage.open(name, storage.exists(name) ? "r+" : "w");
+  if (!file) {
+    return false;
+  }
+  s_sessionTotal total;
+  size_t size = file.size();
+  size_t offset = 0;
+  bool found = false;
+  while (offset + sizeof(total) <= size && file.read((uint8_t*)&total, sizeof(total)) == sizeof(total)) {
+    if (total.check == checksum(total) && strcmp(total.uid, record.uid) == 0) {
+      found = true;
+      break;
+    }
+    offset += sizeof(total);
+  }
+  if (!found) {
+    if (subtract) {
+      file.close();
+      return true;
+    }
+    memset(&total, 0, sizeof(total));
+    strncpy(total.uid, record.uid, sizeof(total.uid) - 1);
+    offset = size - size % sizeof(total);
+  }
+  uint32_t cost = (uint32_t)(record.energy * record.price + 0.5);
+  if (subtract) {
+    total.sessions -= min(total.sessions, (uint32_t)1);
+    total.energy -= min(total.energy, record.energy);
+    total.duration -= min(total.duration, record.duration);
+    total.cost -= min(total.cost, cost);
+  }
+  else {
+    strncpy(total.username, record.username, sizeof(total.username) - 1);
+    total.sessions++;
+    total.energy += record.energy;
+    total.duration += record.duration;
+    total.cost += cost;
+  }
+  total.check = checksum(total);
+  file.seek(offset);
+  size_t written = file.write((const uint8_t*)&total, sizeof(total));
+  file.close();
+  return written == sizeof(total);
+}
+
+// After a lost write the totals of a segment are summed up from its records
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::rebuildTotals(uint8_t index) {
+  char name[32];
+  totalsName(segments[index].month, name);
+  if (storage.exists(name)) {
+    storage.remove(name);
+  }
+  bool success = true;
+  s_sessionRecord record;
+  for (uint32_t i = 0; i < segments[index].count; i++) {
+    if (readStored(segments[index].firstSequence + i, record) && record.state == SESSION_FINISHED) {
+      success &= addTotal(segments[index].month, record);
+    }
+  }
+  return success;
+}
+
+// Drops the oldest month, the index is rewritten by the caller
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::prune() {
+  if (segmentCount == 0) {
+    return false;
+  }
+  char name[32];
+  segmentName(segments[0].month, name);
+  storage.remove(name);
+  totalsName(segments[0].month, name);
+  storage.remove(name);
+  segmentCount--;
+  memmove(&segments[0], &segments[1], segmentCount * sizeof(s_sessionSegment));
+  return true;
+}
+
+int ICACHE_FLASH_ATTR EvseWiFiSessionLog::findSegment(uint32_t sequence) {
+  int low = 0;
+  int high = (int)segmentCount - 1;
+  while (low <= high) {
+    int middle = (low + high) / 2;
+    if (sequence < segments[middle].firstSequence) {
+      high = middle - 1;
+    }
+    else if (sequence >= segments[middle].firstSequence + segments[middle].count) {
+      low = middle + 1;
+    }
+    else {
+      return middle;
+    }
+  }
+  return -1;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::read(uint32_t sequence, s_sessionRecord& record) {
+  SESSIONLOG_ENTER_CRITICAL();
+  int index = findPending(sequence);
+  if (index >= 0) {
+    record = pending[index].record;
+  }
+  SESSIONLOG_EXIT_CRITICAL();
+  return index >= 0 || readStored(sequence, record);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::readStored(uint32_t sequence, s_sessionRecord& record) {
+  int index = findSegment(sequence);
+  if (index < 0) {
+    return false;
+  }
+  char name[32];
+  segmentName(segments[index].month, name);
+  File file = storage.open(name, "r");
+  if (!file) {
+    return false;
+  }
+  file.seek((sequence - segments[index].firstSequence) * sizeof(s_sessionRecord));
+  bool valid = file.read((uint8_t*)&record, sizeof(record)) == sizeof(record) &&
+               record.sequence == sequence && record.check == checksum(record);
+  file.close();
+  return valid;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::getLatest(s_sessionRecord& record) {
+  if (hasLatest) {
+    record = latest;
+  }
+  return hasLatest;
+}
+
+// 0 when empty
+uint32_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::getFirst() {
+  if (segmentCount > 0) {
+    return segments[0].firstSequence;
+  }
+  return pendingCount > 0 ? pending[0].record.sequence : 0;
+}
+
+// Queued appends included
+uint32_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::getLast() {
+  return nextSequence - 1;
+}
+
+uint32_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::getStoredLast() {
+  if (segmentCount == 0) {
+    return 0;
+  }
+  return segments[segmentCount - 1].firstSequence + segments[segmentCount - 1].count - 1;
+}
+
+// Wh of all finished sessions stored on flash, from the index alone
+uint64_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::getEnergy() {
+  uint64_t energy = 0;
+  for (uint8_t i = 0; i < segmentCount; i++) {
+    energy += segments[i].energy;
+  }
+  return energy;
+}
+
+uint8_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::getSegmentCount() {
+  return segmentCount;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::getSegment(uint8_t index, s_sessionSegment& segment) {
+  if (index >= segmentCount) {
+    return false;
+  }
+  segment = segments[index];
+  return true;
+}
+
+// False while a download is open
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::clear() {
+  if (!beginWrite()) {
+    return false;
+  }
+  bool success = true;
+  char name[32];
+  for (uint8_t i = 0; i < segmentCount; i++) {
+    segmentName(segments[i].month, name);
+    if (storage.exists(name)) {
+      success &= storage.remove(name);
+    }
+    totalsName(segments[i].month, name);
+    if (storage.exists(name)) {
+      success &= storage.remove(name);
+    }
+  }
+  SESSIONLOG_ENTER_CRITICAL();
+  segmentCount = 0;
+  pendingCount = 0;
+  nextSequence = 1;
+  hasLatest = false;
+  SESSIONLOG_EXIT_CRITICAL();
+  success &= !storage.exists(SESSIONLOG_INDEX) || storage.remove(SESSIONLOG_INDEX);
+  endWrite();
+  return success;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiSessionLog::segmentName(uint32_t month, char* name) {
+  snprintf(name, 32, SESSIONLOG_SEGMENT, (unsigned long)month);
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiSessionLog::totalsName(uint32_t month, char* name) {
+  snprintf(name, 32, SESSIONLOG_TOTALS, (unsigned long)month);
+}
+
+// YYYYMM in UTC, from the days since 1970 (civil calendar, no TimeLib state)
+uint32_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::toMonth(uint32_t timestamp) {
+  uint32_t days = timestamp / 86400 + 719468;
+  uint32_t era = days / 146097;
+  uint32_t dayOfEra = days - era * 146097;
+  uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+  uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+  uint32_t shiftedMonth = (5 * dayOfYear + 2) / 153;
+  uint32_t month = shiftedMonth < 10 ? shiftedMonth + 3 : shiftedMonth - 9;
+  uint32_t year = yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
+  return year * 100 + month;
+}
+
+uint32_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::userBit(const char* uid) {
+  return 1UL << (crc32((const uint8_t*)uid, strlen(uid)) & 31);
+}
+
+uint32_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::crc32(const uint8_t* data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+// CRC-32 of everything but the check itself
+uint32_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::checksum(const s_sessionRecord& record) {
+  return crc32((const uint8_t*)&record, offsetof(s_sessionRecord, check));
+}
+
+uint32_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::checksum(const s_sessionSegment& segment) {
+  return crc32((const uint8_t*)&segment, offsetof(s_sessionSegment, check));
+}
+
+uint32_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::checksum(const s_sessionTotal& total) {
+  return crc32((const uint8_t*)&total, offsetof(s_sessionTotal, check));
+}
+
+// Records after the sequence since, at most limit of them (0 = all), that
+// started between from and to (0 = open end) and belong to uid (NULL = all).
+// False while the main loop writes the log.
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::openJson(s_sessionCursor& cursor, uint32_t since, uint32_t limit,
+    uint32_t from, uint32_t to, const char* uid) {
+  if (!openRead(cursor.generation)) {
+    return false;
+  }
+  cursor.sequence = since + 1;
+  cursor.remaining = limit;
+  cursor.limited = limit > 0;
+  cursor.from = from;
+  cursor.to = to;
+  cursor.uid[0] = '\0';
+  if (uid != NULL) {
+    strncpy(cursor.uid, uid, sizeof(cursor.uid) - 1);
+    cursor.uid[sizeof(cursor.uid) - 1] = '\0';
+  }
+  cursor.part = 0;
+  cursor.separator = false;
+  cursor.lineLength = 0;
+  cursor.lineOffset = 0;
+  return true;
+}
+
+// A segment is opened only if its time span and user mask can match
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::isRelevant(uint8_t index, const s_sessionCursor& cursor) {
+  const s_sessionSegment& segment = segments[index];
+  if (segment.lastTimestamp < cursor.from || (cursor.to != 0 && segment.firstTimestamp > cursor.to)) {
+    return false;
+  }
+  return cursor.uid[0] == '\0' || (segment.users & userBit(cursor.uid)) != 0;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::matches(const s_sessionRecord& record, const s_sessionCursor& cursor) {
+  return record.timestamp >= cursor.from && (cursor.to == 0 || record.timestamp <= cursor.to) &&
+         (cursor.uid[0] == '\0' || strcmp(record.uid, cursor.uid) == 0);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::nextRecord(s_sessionCursor& cursor, s_sessionRecord& record) {
+  while (cursor.sequence <= getLast() && !(cursor.limited && cursor.remaining == 0)) {
+    if (cursor.sequence < getFirst()) {
+      cursor.sequence = getFirst();
+    }
+    if (findPending(cursor.sequence) < 0) {
+      int index = findSegment(cursor.sequence);
+      if (index < 0) {
+        // in no segment - continue with the next segment or queued record
+        uint32_t next = 0;
+        for (uint8_t i = 0; i < segmentCount && next == 0; i++) {
+          if (segments[i].firstSequence > cursor.sequence) {
+            next = segments[i].firstSequence;
+          }
+        }
+        for (uint8_t i = 0; i < pendingCount; i++) {
+          uint32_t sequence = pending[i].record.sequence;
+          if (sequence > cursor.sequence && (next == 0 || sequence < next)) {
+            next = sequence;
+          }
+        }
+        if (next == 0) {
+          break;
+        }
+        cursor.sequence = next;
+        continue;
+      }
+      if (!isRelevant(index, cursor)) {
+        cursor.sequence = segments[index].firstSequence + segments[index].count;
+        continue;
+      }
+    }
+    if (read(cursor.sequence++, record) && matches(record, cursor)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Fills buffer with as much of {"type":"latestlog","list":[...],"more":false}
+// as fits, 0 at the end. "more" tells a limited reader to ask again with the
+// last "seq" it got. Torn records are skipped, a dropped download ends where it is.
+size_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::readJson(s_sessionCursor& cursor, uint8_t* buffer, size_t maxLen) {
+  if (cursor.part < 3 && !continueRead(cursor.generation)) {
+    return 0;
+  }
+  size_t len = 0;
+  while (len < maxLen) {
+    if (cursor.lineOffset >= cursor.lineLength) {
+      cursor.lineOffset = 0;
+      cursor.lineLength = 0;
+      if (cursor.part == 0) {
+        cursor.lineLength = snprintf(cursor.line, SESSIONLOG_LINE, "{\"type\":\"latestlog\",\"list\":[");
+        cursor.part = 1;
+      }
+      else if (cursor.part == 1) {
+        s_sessionRecord record;
+        if (nextRecord(cursor, record)) {
+          cursor.lineLength = formatRecord(record, cursor.separator, cursor.line, SESSIONLOG_LINE);
+          cursor.separator = true;
+          cursor.remaining--;
+        }
+        else {
+          cursor.part = 2;
+        }
+      }
+      else if (cursor.part == 2) {
+        // A full page has more only if one further record matches
+        s_sessionRecord record;
+        cursor.remaining = 1;
+        cursor.lineLength = snprintf(cursor.line, SESSIONLOG_LINE, "],\"more\":%s}",
+            nextRecord(cursor, record) ? "true" : "false");
+        cursor.part = 3;
+        closeRead(cursor.generation);
+      }
+      else {
+        break;
+      }
+    }
+    size_t chunk = min((size_t)(cursor.lineLength - cursor.lineOffset), maxLen - len);
+    memcpy(&buffer[len], &cursor.line[cursor.lineOffset], chunk);
+    cursor.lineOffset += chunk;
+    len += chunk;
+  }
+  return len;
+}
+
+// Months between fromMonth and toMonth (YYYYMM, 0 = open end), uid NULL for all.
+// False while the main loop writes the log.
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::openTotals(s_totalsCursor& cursor, uint32_t fromMonth, uint32_t toMonth, const char* uid) {
+  if (!openRead(cursor.generation)) {
+    return false;
+  }
+  cursor.fromMonth = fromMonth;
+  cursor.toMonth = toMonth;
+  cursor.uid[0] = '\0';
+  if (uid != NULL) {
+    strncpy(cursor.uid, uid, sizeof(cursor.uid) - 1);
+    cursor.uid[sizeof(cursor.uid) - 1] = '\0';
+  }
+  cursor.started = false;
+  cursor.month = 0;
+  cursor.entry = 0;
+  cursor.part = 0;
+  cursor.separator = false;
+  cursor.lineLength = 0;
+  cursor.lineOffset = 0;
+  return true;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiSessionLog::nextTotal(s_totalsCursor& cursor, s_sessionTotal& total, uint32_t& month) {
+  while (true) {
+    if (cursor.started) {
+      char name[32];
+      totalsName(cursor.month, name);
+      File file = storage.open(name, "r");
+      bool more = false;
+      if (file) {
+        file.seek(cursor.entry * sizeof(total));
+        more = file.read((uint8_t*)&total, sizeof(total)) == sizeof(total);
+        file.close();
+      }
+      if (more) {
+        cursor.entry++;
+        if (total.check == checksum(total) && total.sessions > 0 &&
+            (cursor.uid[0] == '\0' || strcmp(total.uid, cursor.uid) == 0)) {
+          month = cursor.month;
+          return true;
+        }
+        continue;
+      }
+    }
+    // next month in range, skipping those the uid is not in
+    uint8_t i = 0;
+    while (i < segmentCount && ((cursor.started && segments[i].month <= cursor.month) ||
+           segments[i].month < cursor.fromMonth ||
+           (cursor.uid[0] != '\0' && (segments[i].users & userBit(cursor.uid)) == 0))) {
+      i++;
+    }
+    if (i == segmentCount || (cursor.toMonth != 0 && segments[i].month > cursor.toMonth)) {
+      return false;
+    }
+    cursor.started = true;
+    cursor.month = segments[i].month;
+    cursor.entry = 0;
+  }
+}
+
+// Fills buffer with as much of {"type":"totals","list":[...]} as fits, 0 at the
+// end or once the download was dropped
+size_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::readTotals(s_totalsCursor& cursor, uint8_t* buffer, size_t maxLen) {
+  if (cursor.part < 3 && !continueRead(cursor.generation)) {
+    return 0;
+  }
+  size_t len = 0;
+  while (len < maxLen) {
+    if (cursor.lineOffset >= cursor.lineLength) {
+      cursor.lineOffset = 0;
+      cursor.lineLength = 0;
+      if (cursor.part == 0) {
+        cursor.lineLength = snprintf(cursor.line, SESSIONLOG_LINE, "{\"type\":\"totals\",\"list\":[");
+        cursor.part = 1;
+      }
+      else if (cursor.part == 1) {
+        s_sessionTotal total;
+        uint32_t month;
+        if (nextTotal(cursor, total, month)) {
+          cursor.lineLength = formatTotal(month, total, cursor.separator, cursor.line, SESSIONLOG_LINE);
+          cursor.separator = true;
+        }
+        else {
+          cursor.part = 2;
+        }
+      }
+      else if (cursor.part == 2) {
+        cursor.lineLength = snprintf(cursor.line, SESSIONLOG_LINE, "]}");
+        cursor.part = 3;
+        closeRead(cursor.generation);
+      }
+      else {
+        break;
+      }
+    }
+    size_t chunk = min((size_t)(cursor.lineLength - cursor.lineOffset), maxLen - len);
+    memcpy(&buffer[len], &cursor.line[cursor.lineOffset], chunk);
+    cursor.lineOffset += chunk;
+    len += chunk;
+  }
+  return len;
+}
+
+// One element of the list in the format latestlog.json had, a session
+// interrupted by a reboot reports "e" instead of its figures
+size_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::formatRecord(const s_sessionRecord& record, bool separator, char* line, size_t size) {
+  size_t len = snprintf(line, size, "%s{\"seq\":%lu,\"uid\":\"", separator ? "," : "", (unsigned long)record.sequence);
+  len += escape(record.uid, &line[len], size - len);
+  len += snprintf(&line[len], size - len, "\",\"username\":\"");
+  len += escape(record.username, &line[len], size - len);
+  len += snprintf(&line[len], size - len, "\",\"timestamp\":%lu,", (unsigned long)record.timestamp);
+  if (record.state == SESSION_FAILED) {
+    len += snprintf(&line[len], size - len, "\"duration\":\"e\",\"energy\":\"e\",\"price\":\"e\"}");
+  }
+  else {
+    uint32_t price = (uint32_t)(record.price * 100.0 + 0.5);
+    uint32_t energy = record.energy + 5;
+    len += snprintf(&line[len], size - len, "\"duration\":%lu,\"energy\":%lu.%02u,\"price\":%lu.%02u}",
+        (unsigned long)record.duration, (unsigned long)(energy / 1000), (unsigned)(energy % 1000 / 10),
+        (unsigned long)(price / 100), (unsigned)(price % 100));
+  }
+  return min(len, size - 1);
+}
+
+// Energy in kWh and cost in cent, both with two decimals
+size_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::formatTotal(uint32_t month, const s_sessionTotal& total, bool separator, char* line, size_t size) {
+  size_t len = snprintf(line, size, "%s{\"month\":%lu,\"uid\":\"", separator ? "," : "", (unsigned long)month);
+  len += escape(total.uid, &line[len], size - len);
+  len += snprintf(&line[len], size - len, "\",\"username\":\"");
+  len += escape(total.username, &line[len], size - len);
+  uint32_t energy = total.energy + 5;
+  uint32_t cost = total.cost + 5;
+  len += snprintf(&line[len], size - len, "\",\"sessions\":%lu,\"energy\":%lu.%02u,\"duration\":%lu,\"cost\":%lu.%02u}",
+      (unsigned long)total.sessions, (unsigned long)(energy / 1000), (unsigned)(energy % 1000 / 10),
+      (unsigned long)total.duration, (unsigned long)(cost / 1000), (unsigned)(cost % 1000 / 10));
+  return min(len, size - 1);
+}
+
+// Quotes and backslashes escaped, control characters dropped
+size_t ICACHE_FLASH_ATTR EvseWiFiSessionLog::escape(const char* text, char* line, size_t size) {
+  size_t len = 0;
+  for (; *text != '\0' && len + 2 < size; text++) {
+    if (*text == '"' || *text == '\\') {
+      line[len++] = '\\';
+      line[len++] = *text;
+    }
+    else if ((uint8_t)*text >= 0x20) {
+      line[len++] = *text;
+    }
+  }
+  line[len] = '\0';
+  return len;
+}
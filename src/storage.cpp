@@ -0,0 +1,225 @@
+#include "storage.h"
+
+EvseWiFiStorage storage;
+
+bool ICACHE_FLASH_ATTR EvseWiFiStorage::begin() {
+  #if defined(ESP32) && defined(STORAGE_LITTLEFS)
+  return STORAGE_FS.begin(true);    // a board switched over comes up formatted
+  #else
+  return STORAGE_FS.begin();
+  #endif
+}
+
+const char* ICACHE_FLASH_ATTR EvseWiFiStorage::getName() {
+  return STORAGE_NAME;
+}
+
+// LittleFS on ESP32 only creates the parent directories when asked to
+File ICACHE_FLASH_ATTR EvseWiFiStorage::open(const char* path, const char* mode) {
+  #if defined(ESP32) && defined(STORAGE_LITTLEFS)
+  return STORAGE_FS.open(path, mode, strcmp(mode, "r") != 0);
+  #else
+  return STORAGE_FS.open(path, mode);
+  #endif
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiStorage::exists(const char* path) {
+  return STORAGE_FS.exists(path);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiStorage::remove(const char* path) {
+  return STORAGE_FS.remove(path);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiStorage::rename(const char* from, const char* to) {
+  return STORAGE_FS.rename(from, to);
+}
+
+size_t ICACHE_FLASH_ATTR EvseWiFiStorage::getTotalBytes() {
+  size_t total, used;
+  getInfo(total, used);
+  return total;
+}
+
+size_t ICACHE_FLASH_ATTR EvseWiFiStorage::getUsedBytes() {
+  size_t total, used;
+  getInfo(total, used);
+  return used;
+}
+
+size_t ICACHE_FLASH_ATTR EvseWiFiStorage::getFreeBytes() {
+  size_t total, used;
+  getInfo(total, used);
+  return total > used ? total - used : 0;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiStorage::getInfo(size_t& total, size_t& used) {
+  #ifdef ESP32
+  total = STORAGE_FS.totalBytes();
+  used = STORAGE_FS.usedBytes();
+  #else
+  FSInfo info;
+  if (!STORAGE_FS.info(info)) {
+    total = 0;
+    used = 0;
+    return;
+  }
+  total = info.totalBytes;
+  used = info.usedBytes;
+  #endif
+}
+
+// SPIFFS has no directories, path is a prefix there - "/P" lists "/P/..."
+bool ICACHE_FLASH_ATTR EvseWiFiStorage::openDir(const char* path, s_storageDir& dir) {
+  snprintf(dir.path, STORAGE_PATH, "%s", path);
+  size_t len = strlen(dir.path);
+  while (len > 1 && dir.path[len - 1] == '/') {
+    dir.path[--len] = '\0';
+  }
+  #ifdef ESP32
+  dir.dir = STORAGE_FS.open(dir.path);
+  return (bool)dir.dir;
+  #else
+  char prefix[STORAGE_PATH + 1];
+  snprintf(prefix, sizeof(prefix), "%s/", dir.path);
+  dir.dir = STORAGE_FS.openDir(prefix);
+  return true;
+  #endif
+}
+
+// Full path of the next file; SPIFFS and older cores give it, LittleFS only the name
+bool ICACHE_FLASH_ATTR EvseWiFiStorage::nextFile(s_storageDir& dir, char* path, size_t size) {
+  #ifdef ESP32
+  File file = dir.dir.openNextFile();
+  if (!file) {
+    return false;
+  }
+  const char* name = file.name();
+  #else
+  if (!dir.dir.next()) {
+    return false;
+  }
+  auto fileName = dir.dir.fileName();
+  const char* name = fileName.c_str();
+  #endif
+  if (name[0] == '/') {
+    snprintf(path, size, "%s", name);
+  }
+  else {
+    snprintf(path, size, "%s/%s", dir.path, name);
+  }
+  return true;
+}
+
+// For the web server and the editor
+fs::FS& ICACHE_FLASH_ATTR EvseWiFiStorage::getFS() {
+  return STORAGE_FS;
+}
+
+const char* ICACHE_FLASH_ATTR EvseWiFiStorage::getOperationName(uint8_t operation) {
+  switch (operation) {
+    case STORAGE_OPEN: return "open";
+    case STORAGE_READ: return "read";
+    case STORAGE_APPEND: return "append";
+    case STORAGE_RENAME: return "rename";
+    case STORAGE_LIST: return "list";
+    case STORAGE_CREATE: return "create";
+    default: return "";
+  }
+}
+
+static void ICACHE_FLASH_ATTR addTiming(s_storageTiming& timing, uint64_t& sum, unsigned long elapsed, bool success) {
+  sum += elapsed;
+  if (elapsed > timing.maximum) {
+    timing.maximum = elapsed;
+  }
+  if (!success) {
+    timing.errors++;
+  }
+}
+
+// Leaves nothing behind below STORAGE_BENCH_DIR. clock is micros() on the
+// board, the native build passes host time.
+void ICACHE_FLASH_ATTR EvseWiFiStorage::benchmark(s_storageTiming* timings, unsigned long (*clock)()) {
+  uint64_t sums[STORAGE_OPERATIONS];
+  memset(timings, 0, STORAGE_OPERATIONS * sizeof(s_storageTiming));
+  memset(sums, 0, sizeof(sums));
+  uint8_t data[1024];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)i;
+  }
+  char path[STORAGE_PATH];
+  char other[STORAGE_PATH];
+
+  File file = open(STORAGE_BENCH_DIR "/read.bin", "w");
+  file.write(data, sizeof(data));
+  file.close();
+  for (uint8_t i = 0; i < STORAGE_BENCH_FILES; i++) {
+    snprintf(path, STORAGE_PATH, STORAGE_BENCH_DIR "/P/%08x", (unsigned)(0x1000 + i));
+    file = open(path, "w");
+    file.write(data, 100);
+    file.close();
+  }
+  file = open(STORAGE_BENCH_DIR "/rename.a", "w");
+  file.write(data, 16);
+  file.close();
+
+  for (uint8_t run = 0; run < STORAGE_BENCH_RUNS; run++) {
+    unsigned long start = clock();
+    file = open(STORAGE_BENCH_DIR "/read.bin", "r");
+    bool success = (bool)file;
+    file.close();
+    addTiming(timings[STORAGE_OPEN], sums[STORAGE_OPEN], clock() - start, success);
+
+    start = clock();
+    file = open(STORAGE_BENCH_DIR "/read.bin", "r");
+    success = file && file.read(data, sizeof(data)) == sizeof(data);
+    file.close();
+    addTiming(timings[STORAGE_READ], sums[STORAGE_READ], clock() - start, success);
+
+    start = clock();
+    file = open(STORAGE_BENCH_DIR "/append.bin", "a");
+    success = file && file.write(data, 16) == 16;
+    file.close();
+    addTiming(timings[STORAGE_APPEND], sums[STORAGE_APPEND], clock() - start, success);
+
+    start = clock();
+    success = (run % 2 == 0) ? rename(STORAGE_BENCH_DIR "/rename.a", STORAGE_BENCH_DIR "/rename.b") :
+                               rename(STORAGE_BENCH_DIR "/rename.b", STORAGE_BENCH_DIR "/rename.a");
+    addTiming(timings[STORAGE_RENAME], sums[STORAGE_RENAME], clock() - start, success);
+
+    start = clock();
+    s_storageDir dir;
+    uint8_t count = 0;
+    if (openDir(STORAGE_BENCH_DIR "/P", dir)) {
+      while (nextFile(dir, other, STORAGE_PATH)) {
+        count++;
+      }
+    }
+    addTiming(timings[STORAGE_LIST], sums[STORAGE_LIST], clock() - start, count == STORAGE_BENCH_FILES);
+
+    snprintf(path, STORAGE_PATH, STORAGE_BENCH_DIR "/new%02u", run);
+    start = clock();
+    file = open(path, "w");
+    success = file && file.write(data, 100) == 100;
+    file.close();
+    addTiming(timings[STORAGE_CREATE], sums[STORAGE_CREATE], clock() - start, success);
+    yield();
+  }
+
+  for (uint8_t i = 0; i < STORAGE_OPERATIONS; i++) {
+    timings[i].average = (uint32_t)(sums[i] / STORAGE_BENCH_RUNS);
+  }
+  for (uint8_t i = 0; i < STORAGE_BENCH_FILES; i++) {
+    snprintf(path, STORAGE_PATH, STORAGE_BENCH_DIR "/P/%08x", (unsigned)(0x1000 + i));
+    remove(path);
+  }
+  for (uint8_t run = 0; run < STORAGE_BENCH_RUNS; run++) {
+    snprintf(path, STORAGE_PATH, STORAGE_BENCH_DIR "/new%02u", run);
+    remove(path);
+  }
+  remove(STORAGE_BENCH_DIR "/read.bin");
+  remove(STORAGE_BENCH_DIR "/append.bin");
+  remove(STORAGE_BENCH_DIR "/rename.a");
+  remove(STORAGE_BENCH_DIR "/rename.b");
+}
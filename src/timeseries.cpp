@@ -0,0 +1,150 @@
+#include "timeseries.h"
+
+void ICACHE_FLASH_ATTR EvseWiFiTimeSeries::begin() {
+  tiers[0].period = 5;
+  tiers[0].capacity = sizeof(samples5s) / sizeof(s_seriesSample);
+  tiers[0].samples = samples5s;
+  tiers[1].period = 60;
+  tiers[1].capacity = sizeof(samples1m) / sizeof(s_seriesSample);
+  tiers[1].samples = samples1m;
+  tiers[2].period = 900;
+  tiers[2].capacity = sizeof(samples15m) / sizeof(s_seriesSample);
+  tiers[2].samples = samples15m;
+  start(0);
+  running = false;
+}
+
+// A new session drops the samples of the last one
+void ICACHE_FLASH_ATTR EvseWiFiTimeSeries::start(uint32_t epoch) {
+  for (uint8_t i = 0; i < SERIES_TIERS; i++) {
+    tiers[i].head = 0;
+    tiers[i].total = 0;
+    tiers[i].periodStart = 0;
+    tiers[i].count = 0;
+    memset(tiers[i].sums, 0, sizeof(tiers[i].sums));
+  }
+  this->epoch = epoch;
+  millisStart = millis();
+  running = true;
+}
+
+// Keep the partial periods, the samples stay available until the next start()
+void ICACHE_FLASH_ATTR EvseWiFiTimeSeries::stop() {
+  if (!running) {
+    return;
+  }
+  for (uint8_t i = 0; i < SERIES_TIERS; i++) {
+    flush(tiers[i]);
+  }
+  running = false;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiTimeSeries::add(float watts, float currentP1, float currentP2, float currentP3, float voltageP1, float voltageP2, float voltageP3) {
+  if (!running) {
+    return;
+  }
+  float scaled[SERIES_VALUES] = {watts, currentP1 * 100.0f, currentP2 * 100.0f, currentP3 * 100.0f,
+                                 voltageP1 * 10.0f, voltageP2 * 10.0f, voltageP3 * 10.0f};
+  uint32_t now = (millis() - millisStart) / 1000;
+  for (uint8_t i = 0; i < SERIES_TIERS; i++) {
+    s_seriesTier& tier = tiers[i];
+    if (tier.count > 0 && now >= tier.periodStart + tier.period) {
+      flush(tier);
+    }
+    if (tier.count == 0) {
+      tier.periodStart = now - now % tier.period;
+    }
+    for (uint8_t v = 0; v < SERIES_VALUES; v++) {
+      tier.sums[v] += (uint32_t)constrain(scaled[v] + 0.5f, 0.0f, 65535.0f);
+    }
+    tier.count++;
+  }
+}
+
+// Average of the running period becomes the next sample of the ring
+void ICACHE_FLASH_ATTR EvseWiFiTimeSeries::flush(s_seriesTier& tier) {
+  if (tier.count == 0) {
+    return;
+  }
+  s_seriesSample& sample = tier.samples[tier.head];
+  sample.time = tier.periodStart;
+  for (uint8_t v = 0; v < SERIES_VALUES; v++) {
+    sample.values[v] = (tier.sums[v] + tier.count / 2) / tier.count;
+    tier.sums[v] = 0;
+  }
+  tier.count = 0;
+  tier.head = (tier.head + 1) % tier.capacity;
+  tier.total++;
+}
+
+// Samples older than the capacity of the ring are gone
+uint32_t ICACHE_FLASH_ATTR EvseWiFiTimeSeries::getOldest(uint8_t tier) {
+  uint32_t total = tiers[tier].total;
+  return total > tiers[tier].capacity ? total - tiers[tier].capacity : 0;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiTimeSeries::get(uint8_t tier, uint32_t sequence, s_seriesSample& sample) {
+  if (tier >= SERIES_TIERS || sequence < getOldest(tier) || sequence >= tiers[tier].total) {
+    return false;
+  }
+  sample = tiers[tier].samples[sequence % tiers[tier].capacity];
+  return true;
+}
+
+uint32_t ICACHE_FLASH_ATTR EvseWiFiTimeSeries::getTotal(uint8_t tier) {
+  return tiers[tier].total;
+}
+
+uint16_t ICACHE_FLASH_ATTR EvseWiFiTimeSeries::getPeriod(uint8_t tier) {
+  return tiers[tier].period;
+}
+
+// tier < 0 streams all tiers, finest first
+void ICACHE_FLASH_ATTR EvseWiFiTimeSeries::openCsv(s_seriesCursor& cursor, int tier) {
+  cursor.tier = (tier < 0 || tier >= SERIES_TIERS) ? 0 : tier;
+  cursor.lastTier = (tier < 0 || tier >= SERIES_TIERS) ? SERIES_TIERS - 1 : tier;
+  cursor.sequence = getOldest(cursor.tier);
+  cursor.header = true;
+  cursor.lineLength = 0;
+  cursor.lineOffset = 0;
+}
+
+// Fills buffer with as much CSV as fits, 0 at the end. Lines may be split
+// over calls; samples overwritten while downloading are skipped.
+size_t ICACHE_FLASH_ATTR EvseWiFiTimeSeries::readCsv(s_seriesCursor& cursor, uint8_t* buffer, size_t maxLen) {
+  size_t len = 0;
+  while (len < maxLen) {
+    if (cursor.lineOffset >= cursor.lineLength) {
+      cursor.lineOffset = 0;
+      cursor.lineLength = 0;
+      if (cursor.header) {
+        cursor.lineLength = snprintf(cursor.line, SERIES_LINE, "period,time,power,currentP1,currentP2,currentP3,voltageP1,voltageP2,voltageP3\n");
+        cursor.header = false;
+      }
+      else {
+        if (cursor.sequence < getOldest(cursor.tier)) {
+          cursor.sequence = getOldest(cursor.tier);
+        }
+        s_seriesSample sample;
+        while (!get(cursor.tier, cursor.sequence, sample) && cursor.tier < cursor.lastTier) {
+          cursor.tier++;
+          cursor.sequence = getOldest(cursor.tier);
+        }
+        if (!get(cursor.tier, cursor.sequence, sample)) {
+          break;
+        }
+        cursor.sequence++;
+        cursor.lineLength = snprintf(cursor.line, SERIES_LINE, "%u,%lu,%u,%u.%02u,%u.%02u,%u.%02u,%u.%u,%u.%u,%u.%u\n",
+            tiers[cursor.tier].period, (unsigned long)(epoch + sample.time), sample.values[0],
+            sample.values[1] / 100, sample.values[1] % 100, sample.values[2] / 100, sample.values[2] % 100,
+            sample.values[3] / 100, sample.values[3] % 100, sample.values[4] / 10, sample.values[4] % 10,
+            sample.values[5] / 10, sample.values[5] % 10, sample.values[6] / 10, sample.values[6] % 10);
+      }
+    }
+    size_t chunk = min((size_t)(cursor.lineLength - cursor.lineOffset), maxLen - len);
+    memcpy(&buffer[len], &cursor.line[cursor.lineOffset], chunk);
+    cursor.lineOffset += chunk;
+    len += chunk;
+  }
+  return len;
+}
@@ -0,0 +1,924 @@
+#include "userdb.h"
+#include <ArduinoJson.h>
+
+EvseWiFiUserDb userDb;
+
+// Exports are read from the web server task on ESP32
+#ifdef ESP32
+static portMUX_TYPE userDbMux = portMUX_INITIALIZER_UNLOCKED;
+#define USERDB_ENTER_CRITICAL() portENTER_CRITICAL(&userDbMux)
+#define USERDB_EXIT_CRITICAL() portEXIT_CRITICAL(&userDbMux)
+#else
+#define USERDB_ENTER_CRITICAL()
+#define USERDB_EXIT_CRITICAL()
+#endif
+
+// Finishes a merge cut short by a power loss, replays the log and takes
+// over /P/. An import that was not committed is dropped.
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::begin() {
+  changeCount = 0;
+  logCount = 0;
+  upload.active = false;
+  const char* temps[] = { USERDB_TEMP, USERDB_TEMP2 };
+  for (uint8_t i = 0; i < 2; i++) {
+    if (!storage.exists(temps[i])) {
+      continue;
+    }
+    if (storage.exists(USERDB_FILE)) {
+      storage.remove(temps[i]);         // incomplete, the log is still there
+    }
+    else {
+      storage.rename(temps[i], USERDB_FILE);
+    }
+  }
+  if (storage.exists(USERDB_IMPORT)) {
+    storage.remove(USERDB_IMPORT);
+  }
+  bool success = readLog();
+  return migrate() && success;
+}
+
+// Entries up to the first torn one; the log never holds more than
+// USERDB_CHANGES entries, so they all fit
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::readLog() {
+  if (!storage.exists(USERDB_LOG)) {
+    return true;
+  }
+  File file = storage.open(USERDB_LOG, "r");
+  if (!file) {
+    return false;
+  }
+  s_userRecord record;
+  while (logCount < USERDB_CHANGES && file.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) {
+    if (record.check != checksum(record)) {
+      break;
+    }
+    addChange(record);
+    logCount++;
+  }
+  file.close();
+  return true;
+}
+
+// Every file of /P/ goes through the changes into the database, the files
+// are removed when all of them are in. Cut short, it starts over.
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::migrate() {
+  s_storageDir dir;
+  char path[STORAGE_PATH];
+  uint16_t count = 0;
+  storage.openDir(USERDB_LEGACY, dir);
+  while (storage.nextFile(dir, path, STORAGE_PATH)) {
+    File file = storage.open(path, "r");
+    if (!file) {
+      continue;
+    }
+    StaticJsonDocument<256> jsonDoc;
+    DeserializationError error = deserializeJson(jsonDoc, file);
+    file.close();
+    s_userRecord record;
+    if (error || !makeRecord(record, path + strlen(USERDB_LEGACY) + 1, jsonDoc["user"] | "", jsonDoc["acctype"], jsonDoc["validuntil"])) {
+      Serial.print(F("[ WARN ] Cannot take over user "));
+      Serial.println(path);
+      continue;
+    }
+    if (!change(record, false)) {
+      return false;
+    }
+    count++;
+    yield();
+  }
+  if (count == 0) {
+    return true;
+  }
+  if (!compact()) {
+    return false;
+  }
+  storage.openDir(USERDB_LEGACY, dir);
+  while (storage.nextFile(dir, path, STORAGE_PATH)) {
+    storage.remove(path);
+  }
+  Serial.printf("[ SYSTEM ] %u users taken over from %s/\n", count, USERDB_LEGACY);
+  return true;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::find(const char* uid, s_userRecord& record) {
+  int index = findChange(uid);
+  if (index >= 0) {
+    record = changes[index];
+    return !record.removed;
+  }
+  File file = storage.open(USERDB_FILE, "r");
+  if (!file) {
+    return false;
+  }
+  uint32_t low = 0;
+  uint32_t high = file.size() / sizeof(s_userRecord);
+  bool found = false;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (!readRecord(file, middle, record)) {
+      break;
+    }
+    int compare = strcmp(record.uid, uid);
+    if (compare == 0) {
+      found = true;
+      break;
+    }
+    if (compare < 0) {
+      low = middle + 1;
+    }
+    else {
+      high = middle;
+    }
+  }
+  file.close();
+  return found;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::put(const char* uid, const char* user, uint8_t acctype, uint32_t validuntil) {
+  s_userRecord record;
+  if (!makeRecord(record, uid, user, acctype, validuntil) || !beginWrite()) {
+    return false;
+  }
+  bool success = change(record, true);
+  endWrite();
+  return success;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::remove(const char* uid) {
+  s_userRecord record;
+  if (!makeRecord(record, uid, "", 0, 0) || !beginWrite()) {
+    return false;
+  }
+  record.removed = 1;
+  record.check = checksum(record);
+  bool success = change(record, true);
+  endWrite();
+  return success;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::clear() {
+  if (!beginWrite()) {
+    return false;
+  }
+  changeCount = 0;
+  logCount = 0;
+  bool success = true;
+  if (storage.exists(USERDB_FILE)) {
+    success &= storage.remove(USERDB_FILE);
+  }
+  if (storage.exists(USERDB_LOG)) {
+    success &= storage.remove(USERDB_LOG);
+  }
+  endWrite();
+  return success;
+}
+
+// Writes come from the main loop only and wait for an open export; on
+// ESP32 the export is opened on another task
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::beginWrite() {
+  unsigned long now = millis();
+  USERDB_ENTER_CRITICAL();
+  bool free = writing > 0 || !isExportAlive(now);
+  if (free) {
+    writing++;
+  }
+  USERDB_EXIT_CRITICAL();
+  return free;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiUserDb::endWrite() {
+  USERDB_ENTER_CRITICAL();
+  writing--;
+  USERDB_EXIT_CRITICAL();
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::isExportAlive(unsigned long now) {
+  return exportOpen && now - millisExport < USERDB_EXPORT_TIMEOUT;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::isExporting() {
+  unsigned long now = millis();
+  USERDB_ENTER_CRITICAL();
+  bool alive = isExportAlive(now);
+  USERDB_EXIT_CRITICAL();
+  return alive;
+}
+
+// A full log is refused, the main loop merges it first. Changes taken
+// over by begin() are not logged, they are merged right away.
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::change(s_userRecord& record, bool log) {
+  if (log && isLogFull()) {
+    return false;
+  }
+  if (!log && changeCount >= USERDB_CHANGES && findChange(record.uid) < 0 && !compact()) {
+    return false;
+  }
+  if (log) {
+    File file = storage.open(USERDB_LOG, "a");
+    if (!file) {
+      return false;
+    }
+    size_t written = file.write((const uint8_t*)&record, sizeof(record));
+    file.close();
+    if (written != sizeof(record)) {
+      return false;
+    }
+    logCount++;
+  }
+  millisChanged = millis();
+  return addChange(record);
+}
+
+// Sorted insert, a later change of the same UID replaces the earlier one
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::addChange(const s_userRecord& record) {
+  int index = findChange(record.uid);
+  if (index >= 0) {
+    changes[index] = record;
+    return true;
+  }
+  if (changeCount >= USERDB_CHANGES) {
+    return false;
+  }
+  uint8_t position = changeCount;
+  while (position > 0 && strcmp(changes[position - 1].uid, record.uid) > 0) {
+    changes[position] = changes[position - 1];
+    position--;
+  }
+  changes[position] = record;
+  changeCount++;
+  return true;
+}
+
+int ICACHE_FLASH_ATTR EvseWiFiUserDb::findChange(const char* uid) {
+  for (uint8_t i = 0; i < changeCount; i++) {
+    if (strcmp(changes[i].uid, uid) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::isCompactionDue() {
+  return changeCount > 0 && millis() - millisChanged > (isLogFull() ? USERDB_FULL_DELAY : USERDB_COMPACT_DELAY);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::isLogFull() {
+  return logCount >= USERDB_CHANGES;
+}
+
+// Writes the merged view to USERDB_TEMP and puts it in place of the file
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::compact() {
+  if (changeCount == 0 && logCount == 0) {
+    return true;
+  }
+  if (!beginWrite()) {
+    return false;
+  }
+  millisChanged = millis();     // a failed merge is tried again later
+  s_userMerge merged = { changes, changeCount, 0, NULL, NULL, 0 };
+  bool success = merge(USERDB_FILE, USERDB_TEMP, merged) && replace(USERDB_TEMP);
+  if (success) {
+    if (storage.exists(USERDB_LOG)) {
+      storage.remove(USERDB_LOG);
+    }
+    changeCount = 0;
+    logCount = 0;
+  }
+  endWrite();
+  return success;
+}
+
+// Users of source with the changes laid over them, sorted into target;
+// removed ones are left out. A missing source is an empty one.
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::merge(const char* source, const char* target, s_userMerge& changes) {
+  File in;
+  uint32_t count = 0;
+  if (storage.exists(source)) {
+    in = storage.open(source, "r");
+    if (!in) {
+      return false;
+    }
+    count = in.size() / sizeof(s_userRecord);
+  }
+  File out = storage.open(target, "w");
+  if (!out) {
+    in.close();
+    return false;
+  }
+  s_userRecord next;
+  s_userRecord change;
+  bool hasNext = false;
+  bool hasChange = false;
+  uint32_t index = 0;
+  uint16_t written = 0;
+  bool success = true;
+  while (success) {
+    if (!hasNext && index < count) {
+      hasNext = readRecord(in, index++, next);
+      continue;
+    }
+    if (!hasChange) {
+      hasChange = nextChange(changes, change);
+    }
+    if (!hasNext && !hasChange) {
+      break;
+    }
+    int compare = !hasNext ? 1 : !hasChange ? -1 : strcmp(next.uid, change.uid);
+    s_userRecord& record = compare < 0 ? next : change;
+    if (compare <= 0) {
+      hasNext = false;
+    }
+    if (compare >= 0) {
+      hasChange = false;
+      if (change.removed) {
+        continue;
+      }
+    }
+    record.removed = 0;
+    record.check = checksum(record);
+    success = out.write((const uint8_t*)&record, sizeof(record)) == sizeof(record);
+    if (++written % 64 == 0) {
+      yield();
+    }
+  }
+  in.close();
+  out.close();
+  if (!success) {
+    storage.remove(target);
+  }
+  return success;
+}
+
+// The smallest UID of the run heads; of equal UIDs the latest run wins
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::nextChange(s_userMerge& changes, s_userRecord& record) {
+  if (changes.runs == NULL) {
+    if (changes.index >= changes.count) {
+      return false;
+    }
+    record = changes.batch[changes.index++];
+    return true;
+  }
+  int best = -1;
+  for (uint8_t i = 0; i < changes.runCount; i++) {
+    s_userRun& run = changes.runs[i];
+    while (!run.hasHead && run.next < run.end) {
+      run.hasHead = readRecord(*changes.staging, run.next++, run.head);
+    }
+    if (run.hasHead && (best < 0 || strcmp(run.head.uid, changes.runs[best].head.uid) <= 0)) {
+      best = i;
+    }
+  }
+  if (best < 0) {
+    return false;
+  }
+  record = changes.runs[best].head;
+  for (uint8_t i = 0; i < changes.runCount; i++) {
+    if (changes.runs[i].hasHead && strcmp(changes.runs[i].head.uid, record.uid) == 0) {
+      changes.runs[i].hasHead = false;
+    }
+  }
+  return true;
+}
+
+// name takes the place of the user file
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::replace(const char* name) {
+  if (storage.exists(USERDB_FILE) && !storage.remove(USERDB_FILE)) {
+    storage.remove(name);
+    return false;
+  }
+  return storage.rename(name, USERDB_FILE);    // if not, begin() finishes it
+}
+
+// With after, the walk starts behind that UID
+void ICACHE_FLASH_ATTR EvseWiFiUserDb::openList(s_userCursor& cursor, const char* after) {
+  cursor.file = storage.open(USERDB_FILE, "r");
+  cursor.count = cursor.file ? cursor.file.size() / sizeof(s_userRecord) : 0;
+  cursor.index = 0;
+  cursor.change = 0;
+  cursor.hasNext = false;
+  if (after == NULL) {
+    return;
+  }
+  uint32_t high = cursor.count;
+  while (cursor.index < high) {
+    uint32_t middle = cursor.index + (high - cursor.index) / 2;
+    if (!readRecord(cursor.file, middle, cursor.next) || strcmp(cursor.next.uid, after) <= 0) {
+      cursor.index = middle + 1;
+    }
+    else {
+      high = middle;
+    }
+  }
+  while (cursor.change < changeCount && strcmp(changes[cursor.change].uid, after) <= 0) {
+    cursor.change++;
+  }
+}
+
+// Removed users are skipped, a change wins over the record of the file
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::nextUser(s_userCursor& cursor, s_userRecord& record) {
+  while (true) {
+    if (!cursor.hasNext && cursor.index < cursor.count) {
+      cursor.hasNext = readRecord(cursor.file, cursor.index++, cursor.next);
+      continue;
+    }
+    bool hasChange = cursor.change < changeCount;
+    if (!cursor.hasNext && !hasChange) {
+      return false;
+    }
+    int compare = !cursor.hasNext ? 1 : !hasChange ? -1 : strcmp(cursor.next.uid, changes[cursor.change].uid);
+    if (compare < 0) {
+      record = cursor.next;
+      cursor.hasNext = false;
+      return true;
+    }
+    if (compare == 0) {
+      cursor.hasNext = false;
+    }
+    const s_userRecord& change = changes[cursor.change++];
+    if (!change.removed) {
+      record = change;
+      return true;
+    }
+  }
+}
+
+// Fills page with up to limit + 1 users, more tells if there are further ones.
+// Sorted by name or expiry, the page keeps the first ones in sort order
+// while the whole file goes by - from the main loop only, it yields.
+uint8_t ICACHE_FLASH_ATTR EvseWiFiUserDb::getPage(const s_userQuery& query, s_userRecord* page, bool& more) {
+  bool byUid = query.sort == USER_SORT_UID;
+  uint8_t capacity = query.limit + 1;
+  uint8_t count = 0;
+  uint16_t seen = 0;
+  s_userCursor cursor;
+  s_userRecord record;
+  openList(cursor, byUid && query.hasAfter ? query.after.uid : NULL);
+  while (nextUser(cursor, record)) {
+    if (++seen % 64 == 0) {
+      yield();
+    }
+    if (!matches(record, query.filter)) {
+      continue;
+    }
+    if (byUid) {
+      page[count++] = record;
+      if (count == capacity) {
+        break;
+      }
+      continue;
+    }
+    if (query.hasAfter && compare(record, query.after, query.sort) <= 0) {
+      continue;
+    }
+    if (count == capacity && compare(record, page[capacity - 1], query.sort) >= 0) {
+      continue;
+    }
+    uint8_t position = count < capacity ? count++ : capacity - 1;
+    while (position > 0 && compare(page[position - 1], record, query.sort) > 0) {
+      page[position] = page[position - 1];
+      position--;
+    }
+    page[position] = record;
+  }
+  cursor.file.close();
+  more = count > query.limit;
+  return more ? query.limit : count;
+}
+
+// Refused while an import is open, there is only one staging file
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::beginImport() {
+  if (upload.active) {
+    return false;
+  }
+  upload.file = storage.open(USERDB_IMPORT, "w");
+  if (!upload.file) {
+    return false;
+  }
+  upload.batch.reset(new s_userRecord[USERDB_BATCH]);
+  upload.active = true;
+  upload.writeFailed = false;
+  upload.batchCount = 0;
+  upload.staged = 0;
+  upload.count = 0;
+  upload.failed = 0;
+  upload.lines = 0;
+  upload.sorted = true;
+  upload.lastUid[0] = '\0';
+  upload.lineLength = 0;
+  upload.lineTooLong = false;
+  upload.millisData = millis();
+  return true;
+}
+
+// Any piece of the upload; a line cut between two pieces is kept until
+// its end comes
+void ICACHE_FLASH_ATTR EvseWiFiUserDb::importData(const uint8_t* data, size_t len) {
+  if (!upload.active) {
+    return;
+  }
+  upload.millisData = millis();
+  for (size_t i = 0; i < len; i++) {
+    char c = (char)data[i];
+    if (c == '\n') {
+      importLine();
+    }
+    else if (c == '\r') {
+      continue;
+    }
+    else if (upload.lineLength < USERDB_LINE - 1) {
+      upload.line[upload.lineLength++] = c;
+    }
+    else {
+      upload.lineTooLong = true;
+    }
+  }
+}
+
+// A JSON object or CSV, told apart by the first character. A first line
+// starting with "uid" is the CSV head.
+void ICACHE_FLASH_ATTR EvseWiFiUserDb::importLine() {
+  upload.line[upload.lineLength] = '\0';
+  bool tooLong = upload.lineTooLong;
+  upload.lineLength = 0;
+  upload.lineTooLong = false;
+  char* line = upload.line;
+  while (*line == ' ' || *line == '\t') {
+    line++;
+  }
+  if (*line == '\0' && !tooLong) {
+    return;
+  }
+  if (++upload.lines == 1 && strncasecmp(line, "uid", 3) == 0) {
+    return;
+  }
+  s_userRecord record;
+  bool parsed = !tooLong && (line[0] == '{' ? parseJson(line, record) : parseCsv(line, record));
+  if (!parsed || !stage(record)) {
+    upload.failed++;
+    return;
+  }
+  upload.count++;
+}
+
+// Sorted insert into the batch, a later line of the same UID replaces the
+// earlier one; a full batch goes to the staging file
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::stage(const s_userRecord& record) {
+  if (upload.writeFailed) {
+    return false;
+  }
+  if (upload.sorted && upload.lastUid[0] != '\0' && strcmp(record.uid, upload.lastUid) <= 0) {
+    upload.sorted = false;
+  }
+  strcpy(upload.lastUid, record.uid);
+  s_userRecord* batch = upload.batch.get();
+  uint16_t position = upload.batchCount;
+  while (position > 0 && strcmp(batch[position - 1].uid, record.uid) > 0) {
+    position--;
+  }
+  if (position > 0 && strcmp(batch[position - 1].uid, record.uid) == 0) {
+    batch[position - 1] = record;
+    return true;
+  }
+  memmove(&batch[position + 1], &batch[position], (upload.batchCount - position) * sizeof(s_userRecord));
+  batch[position] = record;
+  if (++upload.batchCount < USERDB_BATCH) {
+    return true;
+  }
+  return flushBatch();
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::flushBatch() {
+  size_t size = upload.batchCount * sizeof(s_userRecord);
+  if (size > 0 && upload.file.write((const uint8_t*)upload.batch.get(), size) != size) {
+    upload.writeFailed = true;
+    return false;
+  }
+  upload.staged += upload.batchCount;
+  upload.batchCount = 0;
+  return true;
+}
+
+// Takes the log in first, then lays the runs over the user file. Nothing
+// changes for readers until the new file is complete.
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::commitImport() {
+  if (!upload.active) {
+    return false;
+  }
+  if (!beginWrite()) {
+    abortImport();
+    return false;
+  }
+  if (upload.lineLength > 0) {
+    importLine();       // no line break at the end
+  }
+  bool success = !upload.writeFailed && flushBatch();
+  upload.batch.reset();
+  upload.file.close();
+  success = success && compact() && mergeImport();
+  storage.remove(USERDB_IMPORT);
+  upload.active = false;
+  endWrite();
+  return success;
+}
+
+// USERDB_RUNS runs at a time; with more, each pass merges the output of
+// the one before, alternating between the two temporary files
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::mergeImport() {
+  if (upload.staged == 0) {
+    return true;
+  }
+  uint32_t runTotal = upload.sorted ? 1 : (upload.staged + USERDB_BATCH - 1) / USERDB_BATCH;
+  std::unique_ptr<s_userRun[]> runs(new s_userRun[min(runTotal, (uint32_t)USERDB_RUNS)]);
+  File staging = storage.open(USERDB_IMPORT, "r");
+  if (!staging) {
+    return false;
+  }
+  const char* temps[] = { USERDB_TEMP, USERDB_TEMP2 };
+  const char* source = USERDB_FILE;
+  bool success = true;
+  uint8_t pass = 0;
+  for (uint32_t first = 0; success && first < runTotal; first += USERDB_RUNS) {
+    s_userMerge merged = { NULL, 0, 0, &staging, runs.get(), (uint8_t)min(runTotal - first, (uint32_t)USERDB_RUNS) };
+    for (uint8_t i = 0; i < merged.runCount; i++) {
+      runs[i].next = upload.sorted ? 0 : (first + i) * USERDB_BATCH;
+      runs[i].end = upload.sorted ? upload.staged : min(runs[i].next + USERDB_BATCH, upload.staged);
+      runs[i].hasHead = false;
+    }
+    const char* target = temps[pass++ % 2];
+    success = merge(source, target, merged);
+    if (pass > 1) {
+      storage.remove(source);     // output of the pass before
+    }
+    source = target;
+  }
+  staging.close();
+  if (!success) {
+    return false;
+  }
+  return replace(source);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::isImporting() {
+  return upload.active;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::isImportStalled() {
+  return upload.active && millis() - upload.millisData > USERDB_IMPORT_TIMEOUT;
+}
+
+void ICACHE_FLASH_ATTR EvseWiFiUserDb::abortImport() {
+  if (!upload.active) {
+    return;
+  }
+  upload.batch.reset();
+  upload.file.close();
+  storage.remove(USERDB_IMPORT);
+  upload.active = false;
+}
+
+uint32_t ICACHE_FLASH_ATTR EvseWiFiUserDb::getImportCount() {
+  return upload.count;
+}
+
+uint32_t ICACHE_FLASH_ATTR EvseWiFiUserDb::getImportFailed() {
+  return upload.failed;
+}
+
+// uid,username,acctype,validuntil - a field may be in double quotes,
+// with "" for a quote inside. Parsed in place.
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::parseCsv(char* line, s_userRecord& record) {
+  char* fields[4];
+  uint8_t count = 0;
+  char* in = line;
+  while (count < 4) {
+    char* out = in;
+    fields[count++] = out;
+    bool quoted = *in == '"';
+    if (quoted) {
+      in++;
+    }
+    while (*in != '\0' && (quoted || *in != ',')) {
+      if (quoted && *in == '"') {
+        if (in[1] != '"') {
+          quoted = false;
+          in++;
+          continue;
+        }
+        in++;
+      }
+      *out++ = *in++;
+    }
+    bool more = *in == ',';
+    *out = '\0';
+    if (!more) {
+      break;
+    }
+    in++;
+  }
+  if (count < 4) {
+    return false;
+  }
+  char* end;
+  unsigned long acctype = strtoul(fields[2], &end, 10);
+  if (end == fields[2] || *end != '\0' || acctype > 255) {
+    return false;
+  }
+  unsigned long validuntil = strtoul(fields[3], &end, 10);
+  if (end == fields[3] || *end != '\0') {
+    return false;
+  }
+  return makeRecord(record, fields[0], fields[1], acctype, validuntil);
+}
+
+// A user as formatUser() writes it; "user" is taken for "username" as in
+// the backup files
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::parseJson(const char* line, s_userRecord& record) {
+  StaticJsonDocument<384> jsonDoc;
+  if (deserializeJson(jsonDoc, line)) {
+    return false;
+  }
+  const char* user = jsonDoc["username"] | (jsonDoc["user"] | "");
+  return makeRecord(record, jsonDoc["uid"] | "", user, jsonDoc["acctype"], jsonDoc["validuntil"]);
+}
+
+// Refused while the main loop writes or another export is read
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::openExport(s_userExport& cursor, uint8_t format) {
+  unsigned long now = millis();
+  USERDB_ENTER_CRITICAL();
+  bool free = writing == 0 && !isExportAlive(now);
+  if (free) {
+    exportOpen = true;
+    millisExport = now;
+    cursor.generation = ++exportGeneration;
+  }
+  USERDB_EXIT_CRITICAL();
+  if (!free) {
+    return false;
+  }
+  openList(cursor.cursor);
+  cursor.format = format;
+  cursor.part = format == USER_FORMAT_CSV ? 0 : 1;
+  cursor.lineLength = 0;
+  cursor.lineOffset = 0;
+  return true;
+}
+
+// Fills buffer with the next maxLen bytes, 0 once all users are out. The
+// file is closed then. A dropped export ends where it is, the database
+// may have been written since.
+size_t ICACHE_FLASH_ATTR EvseWiFiUserDb::readExport(s_userExport& cursor, uint8_t* buffer, size_t maxLen) {
+  unsigned long now = millis();
+  USERDB_ENTER_CRITICAL();
+  bool alive = cursor.generation == exportGeneration && isExportAlive(now);
+  if (alive) {
+    millisExport = now;
+  }
+  USERDB_EXIT_CRITICAL();
+  if (!alive) {
+    cursor.cursor.file.close();
+    return 0;
+  }
+  size_t len = 0;
+  while (len < maxLen) {
+    if (cursor.lineOffset >= cursor.lineLength) {
+      cursor.lineOffset = 0;
+      cursor.lineLength = 0;
+      if (cursor.part == 0) {
+        cursor.lineLength = snprintf(cursor.line, USERDB_LINE, "uid,username,acctype,validuntil\n");
+        cursor.part = 1;
+      }
+      else if (cursor.part == 1) {
+        s_userRecord record;
+        if (nextUser(cursor.cursor, record)) {
+          cursor.lineLength = cursor.format == USER_FORMAT_CSV ? formatCsv(record, cursor.line, USERDB_LINE) :
+                                                                 formatUser(record, false, cursor.line, USERDB_LINE - 1);
+          cursor.line[cursor.lineLength++] = '\n';
+        }
+        else {
+          cursor.cursor.file.close();
+          cursor.part = 2;
+          exportOpen = false;
+        }
+      }
+      else {
+        break;
+      }
+    }
+    size_t chunk = min((size_t)(cursor.lineLength - cursor.lineOffset), maxLen - len);
+    memcpy(&buffer[len], &cursor.line[cursor.lineOffset], chunk);
+    cursor.lineOffset += chunk;
+    len += chunk;
+  }
+  return len;
+}
+
+// Without line break, one byte of size stays free for it
+size_t ICACHE_FLASH_ATTR EvseWiFiUserDb::formatCsv(const s_userRecord& record, char* line, size_t size) {
+  size -= 1;
+  size_t len = quote(record.uid, line, size);
+  line[len++] = ',';
+  len += quote(record.user, &line[len], size - len);
+  len += snprintf(&line[len], size - len, ",%u,%lu", (unsigned)record.acctype, (unsigned long)record.validuntil);
+  return min(len, size - 1);
+}
+
+// In double quotes if it holds a comma or quote, control characters dropped
+size_t ICACHE_FLASH_ATTR EvseWiFiUserDb::quote(const char* text, char* line, size_t size) {
+  bool quoted = strpbrk(text, ",\"") != NULL || text[0] == ' ';
+  size_t len = 0;
+  if (quoted) {
+    line[len++] = '"';
+  }
+  for (; *text != '\0' && len + 3 < size; text++) {
+    if (*text == '"') {
+      line[len++] = '"';
+    }
+    if ((uint8_t)*text >= 0x20) {
+      line[len++] = *text;
+    }
+  }
+  if (quoted) {
+    line[len++] = '"';
+  }
+  line[len] = '\0';
+  return len;
+}
+
+// Ties are broken by UID, so every user has one place in each order
+int ICACHE_FLASH_ATTR EvseWiFiUserDb::compare(const s_userRecord& a, const s_userRecord& b, uint8_t sort) {
+  int result = 0;
+  if (sort == USER_SORT_NAME) {
+    result = strcasecmp(a.user, b.user);
+  }
+  else if (sort == USER_SORT_EXPIRY) {
+    result = a.validuntil < b.validuntil ? -1 : a.validuntil > b.validuntil ? 1 : 0;
+  }
+  return result != 0 ? result : strcmp(a.uid, b.uid);
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::matches(const s_userRecord& record, const char* filter) {
+  size_t length = strlen(filter);
+  return length == 0 || strncasecmp(record.uid, filter, length) == 0 || strncasecmp(record.user, filter, length) == 0;
+}
+
+// One user as in the list the web UI shows and restores from
+size_t ICACHE_FLASH_ATTR EvseWiFiUserDb::formatUser(const s_userRecord& record, bool separator, char* line, size_t size) {
+  size_t len = snprintf(line, size, "%s{\"uid\":\"", separator ? "," : "");
+  len += escape(record.uid, &line[len], size - len);
+  len += snprintf(&line[len], size - len, "\",\"username\":\"");
+  len += escape(record.user, &line[len], size - len);
+  len += snprintf(&line[len], size - len, "\",\"acctype\":%u,\"validuntil\":%lu}",
+      (unsigned)record.acctype, (unsigned long)record.validuntil);
+  return min(len, size - 1);
+}
+
+// Quotes and backslashes escaped, control characters dropped
+size_t ICACHE_FLASH_ATTR EvseWiFiUserDb::escape(const char* text, char* line, size_t size) {
+  size_t len = 0;
+  for (; *text != '\0' && len + 2 < size; text++) {
+    if (*text == '"' || *text == '\\') {
+      line[len++] = '\\';
+      line[len++] = *text;
+    }
+    else if ((uint8_t)*text >= 0x20) {
+      line[len++] = *text;
+    }
+  }
+  line[len] = '\0';
+  return len;
+}
+
+// Longer UIDs and names than the record holds are refused, not cut
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::makeRecord(s_userRecord& record, const char* uid, const char* user, uint8_t acctype, uint32_t validuntil) {
+  memset(&record, 0, sizeof(record));
+  if (uid == NULL || uid[0] == '\0' || strlen(uid) >= sizeof(record.uid)) {
+    return false;
+  }
+  strcpy(record.uid, uid);
+  snprintf(record.user, sizeof(record.user), "%s", user ? user : "");
+  record.acctype = acctype;
+  record.validuntil = validuntil;
+  record.check = checksum(record);
+  return true;
+}
+
+bool ICACHE_FLASH_ATTR EvseWiFiUserDb::readRecord(File& file, uint32_t index, s_userRecord& record) {
+  if (file.position() != index * sizeof(record) && !file.seek(index * sizeof(record))) {
+    return false;
+  }
+  return file.read((uint8_t*)&record, sizeof(record)) == sizeof(record) && record.check == checksum(record);
+}
+
+// CRC-32 of everything before check
+uint32_t ICACHE_FLASH_ATTR EvseWiFiUserDb::checksum(const s_userRecord& record) {
+  const uint8_t* data = (const uint8_t*)&record;
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < offsetof(s_userRecord, check); i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+  }
+  return ~crc;
+}
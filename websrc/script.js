@@ -18,8 +18,8 @@ var currentModalOpen = false;
 //Users
 var timezone;
 var userdata = [];
-var page = 1;
-var haspages;
+var usermore = false;
+var usernext;
 var usertable = false;
 
 //Log
@@ -30,8 +30,6 @@ var logtable = false;
 var utcSeconds;
 var recordstorestore = 0;
 var slot = 0;
-var page = 1;
-var haspages;
 var file = {};
 var completed = false;
 var wsUri;
@@ -192,8 +190,7 @@ function loadUsers() {
   closeNav();
 
   userdata = [];
-  var commandtosend = {};
-  websock.send("{\"command\":\"userlist\", \"page\":" + page + "}");
+  requestUserPage(null);
 }
 function listSCAN(obj) {
   if (obj.known === 1) {
@@ -209,19 +206,21 @@ function listSCAN(obj) {
   }
 }
 
-function getnextpage() {
-  document.getElementById("loadpages").innerHTML = "Loading " + page + "/" + haspages;
-  if (page < haspages) {
-    page = page + 1;
-    var commandtosend = {};
-    commandtosend.command = "userlist";
-    commandtosend.page = page;
-    websock.send(JSON.stringify(commandtosend));
+// The device sends one page per request, the next one starts behind "after"
+function requestUserPage(after) {
+  var commandtosend = {};
+  commandtosend.command = "userlist";
+  commandtosend.limit = 25;
+  if (after !== null) {
+    commandtosend.after = after;
   }
+  websock.send(JSON.stringify(commandtosend));
 }
 
 function builduserdata(obj) {
-  userdata = obj.list;
+  userdata = userdata.concat(obj.list);
+  usermore = obj.more;
+  usernext = obj.next;
 }
 
 function initUserTable() {
@@ -427,10 +426,10 @@ FooTable.MyFiltering = FooTable.Filtering.extend({
 function loadLog() {
 
   if (hw_rev === "ESP8266") {
-    document.getElementById("textlimitlogfile").innerHTML = "The log file is limited to 50 entries (LIFO principle)";
+    document.getElementById("textlimitlogfile").innerHTML = "Showing the last 12 months. The log keeps up to 3 years, older months are removed when the flash runs low";
   }
   else {
-    document.getElementById("textlimitlogfile").innerHTML = "The log file is limited to 100 entries (LIFO principle)";
+    document.getElementById("textlimitlogfile").innerHTML = "Showing the last 12 months. The log keeps up to 10 years, older months are removed when the flash runs low";
   }
 
   document.getElementById("evseContent").style.display = "none";
@@ -439,15 +438,22 @@ function loadLog() {
   document.getElementById("logContent").style.display = "block";
   closeNav();
 
+  logdata = [];
+  requestLogPage(0);
   var commandtosend = {};
-  commandtosend.command = "latestlog";
-  websock.send(JSON.stringify(commandtosend));
-  commandtosend = {};
   commandtosend.command = "gettime";
   websock.send(JSON.stringify(commandtosend));
 
 }
 
+function requestLogPage(since) {
+  var commandtosend = {};
+  commandtosend.command = "latestlog";
+  commandtosend.since = since;
+  commandtosend.from = Math.floor(Date.now() / 1000) - 365 * 86400;
+  websock.send(JSON.stringify(commandtosend));
+}
+
 function initLogTable() {
   jQuery(function ($) {
     window.FooTable.init("#latestlogtable", {
@@ -591,6 +597,7 @@ function listCONF(obj) {
 
   //Load RFID settings
   document.getElementById("gain").value = obj.rfid.rfidgain;
+  document.getElementById("gpioirq").value = obj.rfid.irqpin >= 0 ? obj.rfid.irqpin : "";
   document.getElementById("checkboxRfid").checked = obj.rfid.userfid;
   handleRFID();
 
@@ -975,6 +982,7 @@ function saveConf() {
   datatosend.rfid.userfid = document.getElementById("checkboxRfid").checked;
   //datatosend.rfid.sspin = parseInt(document.getElementById("gpioss").value);
   datatosend.rfid.rfidgain = parseInt(document.getElementById("gain").value);
+  datatosend.rfid.irqpin = document.getElementById("gpioirq").value === "" ? -1 : parseInt(document.getElementById("gpioirq").value);
 
   datatosend.ntp.ntpip = document.getElementById("ntpIP").value;
   datatosend.ntp.timezone = parseInt(document.getElementById("DropDownTimezone").value);
@@ -1019,10 +1027,8 @@ function saveConf() {
 }
 
 function backupuser() {
-  var commandtosend = {};
-  commandtosend.command = "userlist";
-  commandtosend.page = page;
-  websock.send(JSON.stringify(commandtosend));
+  userdata = [];
+  requestUserPage(null);
 }
 
 function backupset() {
@@ -1305,13 +1311,6 @@ function socketMessageListener(evt) {
     utcSeconds = obj.epoch;
   }
   else if (obj.command === "userlist") {
-    haspages = obj.haspages;
-    if (haspages === 0) {
-      document.getElementById("usertable").innerHTML = null;
-      initUserTable();
-      $(".footable-show").click();
-      $(".fooicon-remove").click();
-    }
     builduserdata(obj);
   }
   else if (obj.command === "result") {
@@ -1321,10 +1320,10 @@ function socketMessageListener(evt) {
       }
     }
     else if (obj.resultof === "userlist") {
-      if (page < haspages && obj.result === true) {
-        getnextpage(page);
+      if (usermore && obj.result === true) {
+        requestUserPage(usernext);
       }
-      else if (page === haspages) {
+      else if (obj.result === true) {
         if (document.getElementById("settingsContent").style.display !== "none") {
           file.type = "evse-wifi-userbackup";
           file.version = "v0.1";
@@ -1357,23 +1356,25 @@ function socketMessageListener(evt) {
     websock.send("{\"command\":\"gettime\"}");
   }
   else if (obj.command === "userlist") {
-    haspages = obj.haspages;
     builduserdata(obj);
   }
   else if (obj.command === "status") {
     listStats(obj);
   }
   if (obj.type === "latestlog") {
-    logdata = obj.list;
-    for (i in logdata) {
-      if (logdata[i].price === "e") {
-        logdata[i].costs = "<span class=\"glyphicon glyphicon-remove\"></span>";
+    for (i in obj.list) {
+      if (obj.list[i].price === "e") {
+        obj.list[i].costs = "<span class=\"glyphicon glyphicon-remove\"></span>";
       }
       else {
-        logdata[i].costs = String(round(logdata[i].price / 100 * logdata[i].energy)) + " €";
+        obj.list[i].costs = String(round(obj.list[i].price / 100 * obj.list[i].energy)) + " €";
       }
+      logdata.push(obj.list[i]);
+    }
+    if (obj.more && obj.list.length > 0) {
+      requestLogPage(obj.list[obj.list.length - 1].seq);
     }
-    if (logdata.length > 0 || logtable === false) {
+    else if (logdata.length > 0 || logtable === false) {
       document.getElementById("latestlogtable").innerHTML = null;
       initLogTable();
     }